@@ -26,6 +26,11 @@ export 'package:image_compress_plus_platform_interface/image_compress_plus_platf
 /// The returned image will retain the proportion of the original image.
 /// Compress image will remove its EXIF info. and the result is in jpeg format.
 /// Rotation is also supported.
+///
+/// [CompressOptions] adds cancellation, priorities, deadlines, cropping and
+/// previews on Linux and Windows. Their worker, memory and pipeline limits
+/// are set on the platform instance, `ImageCompressPlusLinux` or
+/// `ImageCompressPlusWindows`, cast from [ImageCompressPlusPlatform.instance].
 class ImageCompressPlus {
   static ImageCompressPlusPlatform get _platform =>
       ImageCompressPlusPlatform.instance;
@@ -47,6 +52,7 @@ class ImageCompressPlus {
     bool autoCorrectionAngle = true,
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
+    CompressOptions options = const CompressOptions(),
   }) async {
     return _platform.compressWithList(
       image,
@@ -58,6 +64,7 @@ class ImageCompressPlus {
       autoCorrectionAngle: autoCorrectionAngle,
       format: format,
       keepExif: keepExif,
+      options: options,
     );
   }
 
@@ -73,6 +80,7 @@ class ImageCompressPlus {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     return _platform.compressWithFile(
       path,
@@ -85,6 +93,7 @@ class ImageCompressPlus {
       format: format,
       keepExif: keepExif,
       numberOfRetries: numberOfRetries,
+      options: options,
     );
   }
 
@@ -101,6 +110,7 @@ class ImageCompressPlus {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     return _platform.compressAndGetFile(
       path,
@@ -114,6 +124,7 @@ class ImageCompressPlus {
       format: format,
       keepExif: keepExif,
       numberOfRetries: numberOfRetries,
+      options: options,
     );
   }
 
@@ -140,6 +151,44 @@ class ImageCompressPlus {
     );
   }
 
+  /// Compresses each of [jobs] from its path to its target path in a single
+  /// native call, with at most [maxParallel] jobs in flight (`0` lets the
+  /// platform decide). [jobId] and [priority] are as in [CompressOptions].
+  ///
+  /// Only supported on Linux and Windows.
+  static Future<List<CompressBatchResult>> compressBatch(
+    List<CompressBatchJob> jobs, {
+    int maxParallel = 0,
+    String? jobId,
+    CompressPriority priority = CompressPriority.interactive,
+  }) async {
+    return _platform.compressBatch(
+      jobs,
+      maxParallel: maxParallel,
+      jobId: jobId,
+      priority: priority,
+    );
+  }
+
+  /// Reads the format, stored size and EXIF orientation of each of [paths]
+  /// from its header alone, without decoding it. [jobId] and [priority] are
+  /// as in [CompressOptions].
+  ///
+  /// Only supported on Linux and Windows.
+  static Future<List<ImageProbeResult>> probe(
+    List<String> paths, {
+    String? jobId,
+    CompressPriority priority = CompressPriority.interactive,
+  }) async {
+    return _platform.probe(paths, jobId: jobId, priority: priority);
+  }
+
+  /// Cancels the pending calls that were given [jobId], and returns whether
+  /// there were any. Other platforms than Linux and Windows return `false`.
+  static Future<bool> cancel(String jobId) async {
+    return _platform.cancel(jobId);
+  }
+
   static void ignoreCheckSupportPlatform(bool value) {
     _platform.ignoreCheckSupportPlatform(value);
   }
@@ -65,6 +65,7 @@ class ImageCompressPlusIOS extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     if (numberOfRetries <= 0) {
       throw CompressError("numberOfRetries can't be null or less than 0");
@@ -100,7 +101,8 @@ class ImageCompressPlusIOS extends ImageCompressPlusPlatform {
       int inSampleSize = 1,
       bool autoCorrectionAngle = true,
       CompressFormat format = CompressFormat.jpeg,
-      bool keepExif = false}) async {
+      bool keepExif = false,
+      CompressOptions options = const CompressOptions()}) async {
     if (image.isEmpty) {
       throw CompressError('The image is empty.');
     }
@@ -145,6 +147,7 @@ class ImageCompressPlusIOS extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     if (numberOfRetries <= 0) {
       throw CompressError("numberOfRetries can't be null or less than 0");
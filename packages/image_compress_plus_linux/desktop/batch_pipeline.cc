@@ -0,0 +1,175 @@
+#include "batch_pipeline.h"
+
+#include <algorithm>
+#include <deque>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+namespace fic {
+
+struct BatchPipeline::Batch {
+  Priority priority = Priority::kInteractive;
+  size_t max_parallel = 1;
+  PipelineDepths depths;
+  BatchStages stages;
+
+  std::mutex mutex;
+  std::vector<size_t> order;
+  size_t next_read = 0;
+  size_t reads_in_flight = 0;
+  std::deque<size_t> read_queue;
+  size_t runners = 0;
+  size_t writes_pending = 0;
+  size_t remaining = 0;
+};
+
+BatchPipeline::BatchPipeline(WorkerPool* cpu_pool)
+    : cpu_pool_(cpu_pool), reader_(1), writer_(1) {}
+
+BatchPipeline::~BatchPipeline() {
+  std::unique_lock<std::mutex> lock(live_mutex_);
+  live_cv_.wait(lock, [this]() { return live_batches_ == 0; });
+}
+
+void BatchPipeline::Run(Priority priority, size_t job_count,
+                        size_t max_parallel, PipelineDepths depths,
+                        BatchStages stages) {
+  if (job_count == 0) {
+    stages.on_done();
+    return;
+  }
+  auto batch = std::make_shared<Batch>();
+  batch->priority = priority;
+  if (max_parallel == 0) {
+    max_parallel = cpu_pool_->max_concurrency();
+  }
+  batch->max_parallel = std::max<size_t>(1, max_parallel);
+  batch->depths.read_ahead = std::max<size_t>(1, depths.read_ahead);
+  batch->depths.write_behind = std::max<size_t>(1, depths.write_behind);
+  batch->stages = std::move(stages);
+  batch->remaining = job_count;
+  {
+    std::lock_guard<std::mutex> lock(live_mutex_);
+    ++live_batches_;
+  }
+
+  // Ordering touches every file header, so it runs on the reader as well.
+  reader_.Submit(Priority::kInteractive, [this, batch, job_count]() {
+    std::vector<uint64_t> costs(job_count);
+    for (size_t i = 0; i < job_count; ++i) {
+      costs[i] = batch->stages.cost(i);
+    }
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->order.resize(job_count);
+    std::iota(batch->order.begin(), batch->order.end(), 0);
+    std::stable_sort(batch->order.begin(), batch->order.end(),
+                     [&costs](size_t a, size_t b) {
+                       return costs[a] > costs[b];
+                     });
+    PumpLocked(batch);
+  });
+}
+
+PipelineStats BatchPipeline::stats() const {
+  PipelineStats stats;
+  stats.reading = reading_.load();
+  stats.read_queue = read_queue_.load();
+  stats.processing = processing_.load();
+  stats.write_queue = write_queue_.load();
+  return stats;
+}
+
+void BatchPipeline::PumpLocked(const std::shared_ptr<Batch>& batch) {
+  while (batch->next_read < batch->order.size() &&
+         batch->reads_in_flight + batch->read_queue.size() <
+             batch->depths.read_ahead) {
+    size_t job = batch->order[batch->next_read++];
+    ++batch->reads_in_flight;
+    ++reading_;
+    reader_.Submit(Priority::kInteractive,
+                   [this, batch, job]() { Read(batch, job); });
+  }
+  while (batch->runners < batch->read_queue.size() &&
+         batch->runners < batch->max_parallel &&
+         batch->writes_pending < batch->depths.write_behind) {
+    ++batch->runners;
+    cpu_pool_->Submit(batch->priority,
+                      [this, batch]() { RunCpuStage(batch); });
+  }
+}
+
+void BatchPipeline::Read(const std::shared_ptr<Batch>& batch, size_t job) {
+  bool ok = batch->stages.read(job);
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  --batch->reads_in_flight;
+  --reading_;
+  if (ok) {
+    batch->read_queue.push_back(job);
+    ++read_queue_;
+  } else {
+    Finish(batch, job, &lock);
+    if (!lock.owns_lock()) {
+      return;
+    }
+  }
+  PumpLocked(batch);
+}
+
+void BatchPipeline::RunCpuStage(const std::shared_ptr<Batch>& batch) {
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  // Give the slot back as soon as there is nothing to take or nowhere to put
+  // the result; Read() and Write() start a new runner once that changes.
+  while (!batch->read_queue.empty() &&
+         batch->writes_pending < batch->depths.write_behind) {
+    size_t job = batch->read_queue.front();
+    batch->read_queue.pop_front();
+    --read_queue_;
+    ++processing_;
+    lock.unlock();
+    bool ok = batch->stages.process(job);
+    lock.lock();
+    --processing_;
+    if (ok) {
+      ++batch->writes_pending;
+      ++write_queue_;
+      writer_.Submit(Priority::kInteractive,
+                     [this, batch, job]() { Write(batch, job); });
+    } else {
+      Finish(batch, job, &lock);
+      if (!lock.owns_lock()) {
+        return;
+      }
+    }
+  }
+  --batch->runners;
+  PumpLocked(batch);
+}
+
+void BatchPipeline::Write(const std::shared_ptr<Batch>& batch, size_t job) {
+  batch->stages.write(job);
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  --batch->writes_pending;
+  --write_queue_;
+  Finish(batch, job, &lock);
+  if (lock.owns_lock()) {
+    PumpLocked(batch);
+  }
+}
+
+// Releases |lock| only when the batch is complete.
+void BatchPipeline::Finish(const std::shared_ptr<Batch>& batch, size_t job,
+                           std::unique_lock<std::mutex>* lock) {
+  batch->stages.finish(job);
+  if (--batch->remaining > 0) {
+    return;
+  }
+  lock->unlock();
+  batch->stages.on_done();
+  std::lock_guard<std::mutex> live_lock(live_mutex_);
+  if (--live_batches_ == 0) {
+    live_cv_.notify_all();
+  }
+}
+
+}  // namespace fic
@@ -4,6 +4,10 @@
 
 namespace fic {
 
+void InitExifLibrary() {
+  Exiv2::XmpParser::initialize();
+}
+
 bool ReadExifFromFile(const std::string& path, ExifPack* out,
                       std::string* error) {
   try {
@@ -55,6 +59,23 @@ int OrientationFromExif(const ExifPack& exif) {
   return 1;
 }
 
+bool ReadExifThumbnail(const ExifPack& exif, std::vector<uint8_t>* out) {
+  try {
+    Exiv2::ExifThumbC thumb(exif.exif);
+    if (std::string(thumb.mimeType()) != "image/jpeg") {
+      return false;
+    }
+    Exiv2::DataBuf buf = thumb.copy();
+    if (buf.size_ <= 0) {
+      return false;
+    }
+    out->assign(buf.pData_, buf.pData_ + buf.size_);
+    return true;
+  } catch (const Exiv2::Error&) {
+  }
+  return false;
+}
+
 void NormalizeOrientation(ExifPack* exif) {
   try {
     Exiv2::ExifKey key("Exif.Image.Orientation");
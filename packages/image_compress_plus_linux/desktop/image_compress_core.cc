@@ -1,10 +1,15 @@
 #include "image_compress_core.h"
 
 #include <algorithm>
+#include <atomic>
+#include <climits>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
+#include <type_traits>
+#include <utility>
 
 extern "C" {
 #include <jpeglib.h>
@@ -13,12 +18,25 @@ extern "C" {
 #include <webp/decode.h>
 #include <webp/encode.h>
 
+#include "pixel_convert.h"
+#include "task_scheduler.h"
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
 
 namespace fic {
 
+const char kCancelledError[] = "Job cancelled";
+
+bool CheckCancelled(const CancelToken* cancel, std::string* error) {
+  if (!cancel || !cancel->cancelled()) {
+    return false;
+  }
+  if (error) *error = kCancelledError;
+  return true;
+}
+
 ImageFormat DetectImageFormat(const uint8_t* data, size_t size) {
   if (size >= 2 && data[0] == 0xFF && data[1] == 0xD8) {
     return ImageFormat::kJpeg;
@@ -40,6 +58,350 @@ ImageFormat DetectImageFormat(const uint8_t* data, size_t size) {
   return ImageFormat::kUnknown;
 }
 
+// Bytes of an EXIF block the header readers look at for the orientation.
+constexpr size_t kExifScanBytes = 1024;
+
+// Reads |size| bytes at |offset| of the image; false past the end.
+using HeaderReader = std::function<bool(uint64_t offset, size_t size,
+                                        uint8_t* out)>;
+
+static uint32_t ReadBigEndian16(const uint8_t* p) {
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t ReadBigEndian32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) |
+         p[3];
+}
+
+static uint32_t ReadLittleEndian16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t ReadLittleEndian24(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static uint32_t ReadLittleEndian32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Orientation tag (0x0112) of IFD0 in a TIFF-structured EXIF block, or 1
+// when it is missing or malformed.
+static int ParseTiffOrientation(const uint8_t* tiff, size_t tiff_size) {
+  if (tiff_size < 8) {
+    return 1;
+  }
+  const bool little = tiff[0] == 'I' && tiff[1] == 'I';
+  if (!little && !(tiff[0] == 'M' && tiff[1] == 'M')) {
+    return 1;
+  }
+  auto read16 = [tiff, little](size_t offset) {
+    return little ? ReadLittleEndian16(tiff + offset)
+                  : ReadBigEndian16(tiff + offset);
+  };
+  auto read32 = [tiff, little](size_t offset) {
+    return little ? ReadLittleEndian32(tiff + offset)
+                  : ReadBigEndian32(tiff + offset);
+  };
+  const uint32_t ifd = read32(4);
+  if (read16(2) != 42 || ifd < 8 || ifd > tiff_size - 2) {
+    return 1;
+  }
+  const uint32_t count = read16(ifd);
+  for (uint32_t i = 0; i < count; ++i) {
+    const size_t entry = ifd + 2 + static_cast<size_t>(i) * 12;
+    if (entry + 12 > tiff_size) {
+      break;
+    }
+    // A SHORT, stored in the first two bytes of the value field.
+    if (read16(entry) == 0x0112 && read16(entry + 2) == 3) {
+      const uint32_t value = read16(entry + 8);
+      return value >= 1 && value <= 8 ? static_cast<int>(value) : 1;
+    }
+  }
+  return 1;
+}
+
+// Same as ParseTiffOrientation, for a PNG eXIf or WebP EXIF chunk, which
+// some writers start with the "Exif\0\0" header of a JPEG APP1 segment.
+static int ParseExifOrientation(const uint8_t* data, size_t size) {
+  if (size >= 6 && std::memcmp(data, "Exif\0\0", 6) == 0) {
+    return ParseTiffOrientation(data + 6, size - 6);
+  }
+  return ParseTiffOrientation(data, size);
+}
+
+// SOF2, SOF6, SOF10 and SOF14 start progressive frames.
+static bool IsJpegProgressiveSof(uint8_t marker) {
+  return marker == 0xC2 || marker == 0xC6 || marker == 0xCA || marker == 0xCE;
+}
+
+static bool IsJpegSofMarker(uint8_t marker) {
+  return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+         marker != 0xC8 && marker != 0xCC;
+}
+
+// Reads the start of the |size|-byte EXIF block at |offset|; IFD0 follows
+// the TIFF header, so a few hundred bytes cover it.
+static void ReadExifOrientation(const HeaderReader& read, uint64_t offset,
+                                uint32_t size, ImageInfo* info) {
+  uint8_t exif[kExifScanBytes];
+  const size_t scan = std::min<size_t>(size, sizeof(exif));
+  if (read(offset, scan, exif)) {
+    info->orientation = ParseExifOrientation(exif, scan);
+  }
+}
+
+// Same as ReadExifOrientation for the payload of a JPEG APP1 segment, which
+// only holds EXIF when it starts "Exif\0\0"; XMP and other APP1 payloads
+// are left alone. Returns whether the segment was EXIF.
+static bool ReadJpegExifOrientation(const HeaderReader& read, uint64_t offset,
+                                    uint32_t size, ImageInfo* info) {
+  uint8_t exif[kExifScanBytes];
+  const size_t scan = std::min<size_t>(size, sizeof(exif));
+  if (scan < 6 || !read(offset, scan, exif) ||
+      std::memcmp(exif, "Exif\0\0", 6) != 0) {
+    return false;
+  }
+  info->orientation = ParseTiffOrientation(exif + 6, scan - 6);
+  return true;
+}
+
+// Walks the marker segments up to the first SOFn, reading the start of the
+// first EXIF segment for its orientation and skipping other payloads (ICC,
+// XMP) without reading them. Reads on past the frame header to the first scan
+// for a restart interval.
+static bool ReadJpegInfo(const HeaderReader& read, ImageInfo* info) {
+  uint64_t offset = 2;
+  uint8_t segment[4];
+  bool exif_read = false;
+  for (;;) {
+    if (!read(offset, 2, segment) || segment[0] != 0xFF) {
+      return info->width > 0;
+    }
+    const uint8_t marker = segment[1];
+    if (marker == 0xFF) {
+      // Fill byte before the real marker.
+      offset += 1;
+      continue;
+    }
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+      offset += 2;
+      continue;
+    }
+    if (marker == 0xD9 || marker == 0xDA) {
+      return info->width > 0;
+    }
+    if (!read(offset + 2, 2, segment + 2)) {
+      return info->width > 0;
+    }
+    const uint32_t length = ReadBigEndian16(segment + 2);
+    if (length < 2) {
+      return info->width > 0;
+    }
+    if (marker == 0xE1 && length > 2 && info->width == 0 && !exif_read) {
+      exif_read = ReadJpegExifOrientation(read, offset + 4, length - 2, info);
+    }
+    if (IsJpegSofMarker(marker) && info->width == 0) {
+      uint8_t frame[6];
+      if (length < 8 || !read(offset + 4, sizeof(frame), frame)) {
+        return false;
+      }
+      info->height = static_cast<int>(ReadBigEndian16(frame + 1));
+      info->width = static_cast<int>(ReadBigEndian16(frame + 3));
+      info->progressive = IsJpegProgressiveSof(marker);
+      // Gray stays gray; YCbCr, RGB, CMYK and YCCK all decode to RGB.
+      info->channels = frame[5] == 1 ? 1 : 3;
+    }
+    uint8_t interval[2];
+    if (marker == 0xDD && length >= 4 && read(offset + 4, 2, interval)) {
+      info->restart_interval = static_cast<int>(ReadBigEndian16(interval));
+    }
+    offset += 2 + length;
+  }
+}
+
+static bool ReadPngInfo(const HeaderReader& read, ImageInfo* info) {
+  uint8_t header[29];
+  if (!read(0, sizeof(header), header) ||
+      std::memcmp(header + 12, "IHDR", 4) != 0) {
+    return false;
+  }
+  info->width = static_cast<int>(ReadBigEndian32(header + 16));
+  info->height = static_cast<int>(ReadBigEndian32(header + 20));
+  info->progressive = header[28] == PNG_INTERLACE_ADAM7;
+  const uint8_t color_type = header[25];
+  bool alpha = (color_type & PNG_COLOR_MASK_ALPHA) != 0;
+  // eXIf and tRNS, which gives alpha to any image without it, have to come
+  // before the image data; skip other chunks unread.
+  uint64_t offset = 8 + 8 + ReadBigEndian32(header + 8) + 4;
+  uint8_t chunk[8];
+  while (read(offset, sizeof(chunk), chunk)) {
+    const uint32_t length = ReadBigEndian32(chunk);
+    if (std::memcmp(chunk + 4, "eXIf", 4) == 0) {
+      ReadExifOrientation(read, offset + 8, length, info);
+    } else if (std::memcmp(chunk + 4, "tRNS", 4) == 0) {
+      alpha = true;
+    } else if (std::memcmp(chunk + 4, "IDAT", 4) == 0 ||
+               std::memcmp(chunk + 4, "IEND", 4) == 0) {
+      break;
+    }
+    offset += 8 + static_cast<uint64_t>(length) + 4;
+  }
+  info->channels =
+      ((color_type & PNG_COLOR_MASK_COLOR) ? 3 : 1) + (alpha ? 1 : 0);
+  return true;
+}
+
+static bool ReadWebpInfo(const HeaderReader& read, ImageInfo* info) {
+  uint8_t header[30];
+  if (!read(0, sizeof(header), header)) {
+    return false;
+  }
+  const uint8_t* chunk = header + 12;
+  const uint8_t* payload = header + 20;
+  if (std::memcmp(chunk, "VP8 ", 4) == 0) {
+    if (payload[3] != 0x9D || payload[4] != 0x01 || payload[5] != 0x2A) {
+      return false;
+    }
+    info->width = static_cast<int>(ReadLittleEndian16(payload + 6) & 0x3FFF);
+    info->height = static_cast<int>(ReadLittleEndian16(payload + 8) & 0x3FFF);
+    info->channels = 3;
+    return true;
+  }
+  if (std::memcmp(chunk, "VP8L", 4) == 0) {
+    if (payload[0] != 0x2F) {
+      return false;
+    }
+    const uint32_t bits = payload[1] | (payload[2] << 8) | (payload[3] << 16) |
+                          (static_cast<uint32_t>(payload[4]) << 24);
+    info->width = static_cast<int>((bits & 0x3FFF) + 1);
+    info->height = static_cast<int>(((bits >> 14) & 0x3FFF) + 1);
+    info->channels = (bits >> 28) & 1 ? 4 : 3;
+    return true;
+  }
+  if (std::memcmp(chunk, "VP8X", 4) == 0) {
+    info->width = static_cast<int>(ReadLittleEndian24(payload + 4) + 1);
+    info->height = static_cast<int>(ReadLittleEndian24(payload + 7) + 1);
+    constexpr uint8_t kAlphaFlag = 0x10;
+    constexpr uint8_t kExifFlag = 0x08;
+    info->channels = payload[0] & kAlphaFlag ? 4 : 3;
+    if (payload[0] & kExifFlag) {
+      // The EXIF chunk usually follows the image data; hop over the chunk
+      // headers to it.
+      const uint64_t riff_end = 8 + static_cast<uint64_t>(
+                                        ReadLittleEndian32(header + 4));
+      uint64_t offset = 12 + 8 + ReadLittleEndian32(chunk + 4);
+      uint8_t next[8];
+      while (offset + 8 <= riff_end && read(offset, sizeof(next), next)) {
+        const uint32_t size = ReadLittleEndian32(next + 4);
+        if (std::memcmp(next, "EXIF", 4) == 0) {
+          ReadExifOrientation(read, offset + 8, size, info);
+          break;
+        }
+        offset += 8 + static_cast<uint64_t>(size) + (size & 1);
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+static bool ReadImageInfoWith(const HeaderReader& read, ImageInfo* info,
+                       std::string* error) {
+  uint8_t magic[12] = {};
+  size_t magic_size = sizeof(magic);
+  while (magic_size > 0 && !read(0, magic_size, magic)) {
+    --magic_size;
+  }
+  info->format = DetectImageFormat(magic, magic_size);
+  bool ok = false;
+  switch (info->format) {
+    case ImageFormat::kJpeg:
+      ok = ReadJpegInfo(read, info);
+      break;
+    case ImageFormat::kPng:
+      ok = ReadPngInfo(read, info);
+      break;
+    case ImageFormat::kWebp:
+      ok = ReadWebpInfo(read, info);
+      break;
+    case ImageFormat::kHeic:
+      if (error) *error = "HEIC not supported";
+      return false;
+    default:
+      if (error) *error = "Unknown image format";
+      return false;
+  }
+  if (!ok || info->width <= 0 || info->height <= 0) {
+    if (error) *error = "Malformed image header";
+    return false;
+  }
+  return true;
+}
+
+bool ReadImageInfo(const std::vector<uint8_t>& input, ImageInfo* info,
+                   std::string* error) {
+  return ReadImageInfoWith(
+      [&input](uint64_t offset, size_t size, uint8_t* out) {
+        if (offset > input.size() || size > input.size() - offset) {
+          return false;
+        }
+        std::memcpy(out, input.data() + offset, size);
+        return true;
+      },
+      info, error);
+}
+
+bool ReadImageInfoFromFile(const std::string& path, ImageInfo* info,
+                           std::string* error) {
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (!file) {
+    if (error) *error = "Failed to open file: " + path;
+    return false;
+  }
+  // Most headers fit in the first block; JPEG segment walks seek past it.
+  uint8_t block[4096];
+  size_t block_size = std::fread(block, 1, sizeof(block), file);
+  bool ok = ReadImageInfoWith(
+      [file, &block, block_size](uint64_t offset, size_t size, uint8_t* out) {
+        if (offset + size <= block_size) {
+          std::memcpy(out, block + offset, size);
+          return true;
+        }
+        if (offset > static_cast<uint64_t>(LONG_MAX) ||
+            std::fseek(file, static_cast<long>(offset), SEEK_SET) != 0) {
+          return false;
+        }
+        return std::fread(out, 1, size, file) == size;
+      },
+      info, error);
+  std::fclose(file);
+  return ok;
+}
+
+// Files probed per scheduler task; each costs a few small reads.
+constexpr size_t kProbeGrain = 8;
+
+void ReadImageInfoFromFiles(const std::vector<std::string>& paths,
+                            const CancelToken* cancel,
+                            std::vector<ProbedImage>* results) {
+  results->assign(paths.size(), ProbedImage());
+  TaskScheduler::Instance().ParallelFor(
+      paths.size(), kProbeGrain, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+          ProbedImage& result = (*results)[i];
+          if (CheckCancelled(cancel, &result.error)) {
+            continue;
+          }
+          result.ok =
+              ReadImageInfoFromFile(paths[i], &result.info, &result.error);
+        }
+      });
+}
+
 bool ReadFileToBytes(const std::string& path, std::vector<uint8_t>* out,
                      std::string* error) {
   FILE* file = std::fopen(path.c_str(), "rb");
@@ -81,6 +443,13 @@ bool WriteBytesToFile(const std::string& path, const std::vector<uint8_t>& data,
   return true;
 }
 
+// Scanlines DecodeJpeg and EncodeJpeg hand to libjpeg per call.
+constexpr int kJpegBandRows = 256;
+// Output columns decoded beside a JPEG crop.
+constexpr int kJpegCropMargin = 2;
+// Columns and rows decoded around a lossy WebP crop.
+constexpr int kWebpCropMargin = 2;
+
 struct JpegErrorManager {
   jpeg_error_mgr pub;
   jmp_buf setjmp_buffer;
@@ -91,8 +460,531 @@ static void JpegErrorExit(j_common_ptr cinfo) {
   longjmp(err->setjmp_buffer, 1);
 }
 
-static bool DecodeJpeg(const std::vector<uint8_t>& input, ImageBuffer* out,
-                       std::string* error) {
+#if defined(LIBJPEG_TURBO_VERSION) || JPEG_LIB_VERSION >= 70
+// These have a scaled IDCT for every M/8.
+constexpr int kJpegScaleEighths[] = {1, 2, 3, 4, 5, 6, 7};
+#else
+constexpr int kJpegScaleEighths[] = {1, 2, 4};
+#endif
+
+void PickJpegScale(int width, int height, int target_w, int target_h,
+                   DecodeOptions* options) {
+  options->scale_num = 1;
+  options->scale_denom = 1;
+  for (int eighths : kJpegScaleEighths) {
+    DecodeOptions scaled = *options;
+    scaled.scale_num = eighths;
+    scaled.scale_denom = 8;
+    if (JpegScaledSize(width, scaled) >= target_w &&
+        JpegScaledSize(height, scaled) >= target_h) {
+      *options = scaled;
+      return;
+    }
+  }
+}
+
+int JpegScaledSize(int size, const DecodeOptions& options) {
+  const int64_t num = std::max(1, options.scale_num);
+  const int64_t denom = std::max(1, options.scale_denom);
+  if (num >= denom) {
+    return size;
+  }
+  // libjpeg rounds scaled dimensions up.
+  return static_cast<int>((size * num + denom - 1) / denom);
+}
+
+// Denominator of the Adam7 grid a preview decode of a PNG with |options|
+// reads: 2, 4 or 8, or 1 for all passes.
+static int PngPreviewDenom(const DecodeOptions& options) {
+  if (!options.preview || options.scale_num != 1 ||
+      options.crop_width > 0) {
+    return 1;
+  }
+  const int denom = options.scale_denom;
+  return denom == 2 || denom == 4 || denom == 8 ? denom : 1;
+}
+
+void PickPngPreviewScale(int width, int height, int target_w, int target_h,
+                         DecodeOptions* options) {
+  options->scale_num = 1;
+  options->scale_denom = 1;
+  for (int denom : {8, 4, 2}) {
+    if ((width + denom - 1) / denom >= target_w &&
+        (height + denom - 1) / denom >= target_h) {
+      options->scale_denom = denom;
+      return;
+    }
+  }
+}
+
+bool ClipRect(int width, int height, int* x, int* y, int* w, int* h) {
+  const int64_t left = std::max(0, *x);
+  const int64_t top = std::max(0, *y);
+  const int64_t right = std::min<int64_t>(width, int64_t{*x} + *w);
+  const int64_t bottom = std::min<int64_t>(height, int64_t{*y} + *h);
+  if (*w <= 0 || *h <= 0 || left >= right || top >= bottom) {
+    return false;
+  }
+  *x = static_cast<int>(left);
+  *y = static_cast<int>(top);
+  *w = static_cast<int>(right - left);
+  *h = static_cast<int>(bottom - top);
+  return true;
+}
+
+// The crop of |options| clipped to a |width| x |height| image, or all of it
+// when there is none. Returns false when nothing is left.
+static bool CropRect(const DecodeOptions& options, int width, int height,
+                     int* x, int* y, int* w, int* h) {
+  if (options.crop_width <= 0 || options.crop_height <= 0) {
+    *x = 0;
+    *y = 0;
+    *w = width;
+    *h = height;
+    return width > 0 && height > 0;
+  }
+  *x = options.crop_x;
+  *y = options.crop_y;
+  *w = options.crop_width;
+  *h = options.crop_height;
+  return ClipRect(width, height, x, y, w, h);
+}
+
+// Span [*begin, *end) of a DCT-scaled decode, |scaled_size| long, that
+// covers [start, start + length) of the full-size image.
+static void JpegScaledSpan(int start, int length, int scaled_size,
+                           const DecodeOptions& options, int* begin,
+                           int* end) {
+  int64_t num = std::max(1, options.scale_num);
+  int64_t denom = std::max(1, options.scale_denom);
+  if (num >= denom) {
+    num = 1;
+    denom = 1;
+  }
+  *begin = static_cast<int>(start * num / denom);
+  *end = static_cast<int>(std::min<int64_t>(
+      scaled_size, ((int64_t{start} + length) * num + denom - 1) / denom));
+}
+
+// libwebp starts a crop on even coordinates, so one that does not is
+// decoded at full size from the even column and row before it, and trimmed.
+static bool WebpCropPadded(int x, int y) { return (x | y) & 1; }
+
+void DecodedSize(ImageFormat format, int width, int height,
+                 const DecodeOptions& options, int* out_w, int* out_h) {
+  int x = 0;
+  int y = 0;
+  if (!CropRect(options, width, height, &x, &y, out_w, out_h)) {
+    *out_w = 0;
+    *out_h = 0;
+    return;
+  }
+  if (format == ImageFormat::kJpeg) {
+    int begin = 0;
+    int end = 0;
+    JpegScaledSpan(x, *out_w, JpegScaledSize(width, options), options,
+                   &begin, &end);
+    *out_w = end - begin;
+    JpegScaledSpan(y, *out_h, JpegScaledSize(height, options), options,
+                   &begin, &end);
+    *out_h = end - begin;
+  } else if (format == ImageFormat::kWebp && options.scaled_width > 0 &&
+             options.scaled_height > 0 && options.scaled_width <= *out_w &&
+             options.scaled_height <= *out_h && !WebpCropPadded(x, y)) {
+    *out_w = options.scaled_width;
+    *out_h = options.scaled_height;
+  } else if (format == ImageFormat::kPng) {
+    const int denom = PngPreviewDenom(options);
+    *out_w = (*out_w + denom - 1) / denom;
+    *out_h = (*out_h + denom - 1) / denom;
+  }
+}
+
+// Position of coefficient (row, column) of a DCT block in the zigzag order
+// scans and coef_bits index it by.
+constexpr uint8_t kJpegZigzagIndex[DCTSIZE2] = {
+    0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42,
+    3,  8,  12, 17, 25, 30, 41, 43, 9,  11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63,
+};
+
+// Whether the scans read so far hold every coefficient a scaled IDCT of
+// each component uses: the top-left N x N of its blocks, for an N x N
+// output block.
+static bool JpegPreviewReady(const jpeg_decompress_struct& cinfo) {
+  for (int c = 0; c < cinfo.num_components; ++c) {
+    const jpeg_component_info& comp = cinfo.comp_info[c];
+#if JPEG_LIB_VERSION >= 70
+    const int size =
+        std::max(comp.DCT_h_scaled_size, comp.DCT_v_scaled_size);
+#else
+    const int size = comp.DCT_scaled_size;
+#endif
+    const int n = std::min(size, DCTSIZE);
+    for (int row = 0; row < n; ++row) {
+      for (int col = 0; col < n; ++col) {
+        if (cinfo.coef_bits[c][kJpegZigzagIndex[row * DCTSIZE + col]] < 0) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Sets the decompression parameters of |options| on |cinfo|, which has read
+// its header. Gray comes out as gray and color as RGB, ImageBuffer layouts
+// libjpeg writes straight into; CMYK and YCCK come out as CMYK for
+// JpegRowToPixels().
+static void ConfigureJpegOutput(const DecodeOptions& options,
+                                jpeg_decompress_struct* cinfo) {
+  cinfo->scale_num = std::max(1, options.scale_num);
+  cinfo->scale_denom = std::max(1, options.scale_denom);
+  cinfo->dct_method = options.fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+  cinfo->do_fancy_upsampling = options.fancy_upsampling ? TRUE : FALSE;
+  if (cinfo->jpeg_color_space == JCS_CMYK ||
+      cinfo->jpeg_color_space == JCS_YCCK) {
+    cinfo->out_color_space = JCS_CMYK;
+  } else if (cinfo->jpeg_color_space == JCS_YCbCr ||
+             cinfo->jpeg_color_space == JCS_RGB) {
+    cinfo->out_color_space = JCS_RGB;
+  }
+}
+
+// Whether JpegRowToPixels() takes the scanlines |cinfo| outputs once
+// decompression has started.
+static bool JpegOutputSupported(const jpeg_decompress_struct& cinfo) {
+  switch (cinfo.out_color_space) {
+    case JCS_GRAYSCALE:
+      return cinfo.output_components == 1;
+    case JCS_RGB:
+      return cinfo.output_components == 3;
+    case JCS_CMYK:
+      return cinfo.output_components == 4;
+    default:
+      return false;
+  }
+}
+
+// ImageBuffer channels of the JPEG |cinfo| decodes.
+static int JpegChannels(const jpeg_decompress_struct& cinfo) {
+  return cinfo.out_color_space == JCS_GRAYSCALE ? 1 : 3;
+}
+
+// Copies |pixels| pixels of a scanline |cinfo| output to |dst| in
+// JpegChannels() layout. Adobe's APP14 marker means the CMYK inks are
+// stored inverted, as Photoshop writes them.
+static void JpegRowToPixels(const jpeg_decompress_struct& cinfo,
+                            const uint8_t* src, uint8_t* dst, int pixels) {
+  if (cinfo.out_color_space == JCS_CMYK) {
+    CmykToRgb(src, dst, pixels, cinfo.saw_Adobe_marker);
+  } else {
+    std::memcpy(dst, src,
+                static_cast<size_t>(pixels) * cinfo.output_components);
+  }
+}
+
+// Full-size pixels below which a JPEG is not split at its restart markers.
+constexpr int64_t kJpegBandsMinPixels = 2000 * 1000;
+
+bool JpegDecodesInBands(const ImageInfo& info) {
+  return info.format == ImageFormat::kJpeg && info.restart_interval > 0 &&
+         !info.progressive &&
+         int64_t{info.width} * info.height >= kJpegBandsMinPixels &&
+         TaskScheduler::Instance().concurrency() > 1;
+}
+
+// Byte layout of a single-scan JPEG, for cutting it at restart markers.
+struct JpegScanLayout {
+  // The frame height in the SOF segment.
+  size_t height_offset = 0;
+  // Entropy-coded data, [data_offset, data_end), and the restart markers
+  // in it.
+  size_t data_offset = 0;
+  size_t data_end = 0;
+  std::vector<size_t> restarts;
+};
+
+static bool ReadJpegScanLayout(const std::vector<uint8_t>& input,
+                               JpegScanLayout* layout) {
+  const uint8_t* data = input.data();
+  const size_t size = input.size();
+  size_t offset = 2;
+  while (layout->data_offset == 0) {
+    if (offset + 4 > size || data[offset] != 0xFF) {
+      return false;
+    }
+    const uint8_t marker = data[offset + 1];
+    if (marker == 0xFF) {
+      offset += 1;
+      continue;
+    }
+    const size_t length = ReadBigEndian16(data + offset + 2);
+    if (length < 2 || offset + 2 + length > size) {
+      return false;
+    }
+    if (marker == 0xC0 || marker == 0xC1) {
+      layout->height_offset = offset + 5;
+    } else if (marker == 0xDA) {
+      layout->data_offset = offset + 2 + length;
+    }
+    offset += 2 + length;
+  }
+  // The scan ends at the first marker other than a restart; 0xFF 0x00 is a
+  // stuffed byte and 0xFF 0xFF fill.
+  size_t i = layout->data_offset;
+  for (;;) {
+    const void* found = std::memchr(data + i, 0xFF, size - i);
+    if (!found) {
+      i = size;
+      break;
+    }
+    i = static_cast<const uint8_t*>(found) - data;
+    if (i + 1 >= size) {
+      break;
+    }
+    const uint8_t next = data[i + 1];
+    if (next == 0x00) {
+      i += 2;
+    } else if (next == 0xFF) {
+      i += 1;
+    } else if (next >= 0xD0 && next <= 0xD7) {
+      layout->restarts.push_back(i);
+      i += 2;
+    } else {
+      break;
+    }
+  }
+  layout->data_end = i;
+  return layout->height_offset != 0;
+}
+
+// One band of a JPEG cut at restart markers: a stream of its own that
+// decodes |skip_rows| output rows of context before |rows| rows for the
+// image.
+struct JpegBand {
+  std::vector<uint8_t> stream;
+  int skip_rows = 0;
+  int first_row = 0;
+  int rows = 0;
+};
+
+static bool DecodeJpegBand(const JpegBand& band, const DecodeOptions& options,
+                           int width, ImageBuffer* out,
+                           const CancelToken* cancel) {
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager jerr;
+  std::vector<uint8_t> scratch;
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = JpegErrorExit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, band.stream.data(), band.stream.size());
+  jpeg_read_header(&cinfo, TRUE);
+  ConfigureJpegOutput(options, &cinfo);
+  jpeg_start_decompress(&cinfo);
+  const int components = cinfo.output_components;
+  if (static_cast<int>(cinfo.output_width) != width ||
+      static_cast<int>(cinfo.output_height) < band.skip_rows + band.rows ||
+      !JpegOutputSupported(cinfo) || JpegChannels(cinfo) != out->channels) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  // Rows land straight in |out| unless they need converting.
+  const bool direct = cinfo.out_color_space != JCS_CMYK;
+  const size_t row_bytes = static_cast<size_t>(width) * out->channels;
+  scratch.resize(static_cast<size_t>(width) * components);
+  JSAMPROW row = scratch.data();
+  const int end = band.skip_rows + band.rows;
+  while (static_cast<int>(cinfo.output_scanline) < end) {
+    const int y = cinfo.output_scanline;
+    if (y % kJpegBandRows == 0 && cancel && cancel->cancelled()) {
+      jpeg_destroy_decompress(&cinfo);
+      return false;
+    }
+    uint8_t* dst =
+        y < band.skip_rows
+            ? nullptr
+            : out->data.data() + (band.first_row + y - band.skip_rows) *
+                                     row_bytes;
+    row = direct && dst ? dst : scratch.data();
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    if (!dst || direct) {
+      continue;
+    }
+    JpegRowToPixels(cinfo, scratch.data(), dst, width);
+  }
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+// Decodes a baseline JPEG whose restart intervals start on MCU rows in
+// bands on the TaskScheduler, each from its own copy of the headers and
+// its run of intervals, with the restart markers renumbered from 0. When
+// fancy upsampling reads chroma across MCU rows, each band also decodes
+// the MCU rows beside it, so the pixels match a serial decode. Returns
+// false, with |*supported| false and nothing decoded, for any other JPEG.
+static bool DecodeJpegBands(const std::vector<uint8_t>& input,
+                            const DecodeOptions& options, ImageBuffer* out,
+                            const CancelToken* cancel, std::string* error,
+                            bool* supported) {
+  *supported = false;
+  jpeg_decompress_struct cinfo;
+  JpegErrorManager jerr;
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = JpegErrorExit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, input.data(), input.size());
+  jpeg_read_header(&cinfo, TRUE);
+  const int image_w = cinfo.image_width;
+  const int image_h = cinfo.image_height;
+  const int restart_interval = cinfo.restart_interval;
+  const bool single_scan = !cinfo.progressive_mode && !cinfo.arith_code &&
+                           cinfo.comps_in_scan == cinfo.num_components;
+  const bool color = cinfo.jpeg_color_space == JCS_YCbCr ||
+                     cinfo.jpeg_color_space == JCS_RGB ||
+                     cinfo.jpeg_color_space == JCS_GRAYSCALE ||
+                     cinfo.jpeg_color_space == JCS_CMYK ||
+                     cinfo.jpeg_color_space == JCS_YCCK;
+  const int channels = cinfo.jpeg_color_space == JCS_GRAYSCALE ? 1 : 3;
+  // An interleaved scan codes MCUs of the largest sampling factors; a
+  // single component, 8 x 8 blocks.
+  int mcu_w = DCTSIZE;
+  int mcu_h = DCTSIZE;
+  bool vertical_context = false;
+  if (cinfo.num_components > 1) {
+    mcu_w *= cinfo.max_h_samp_factor;
+    mcu_h *= cinfo.max_v_samp_factor;
+    for (int c = 0; c < cinfo.num_components; ++c) {
+      vertical_context |=
+          cinfo.comp_info[c].v_samp_factor < cinfo.max_v_samp_factor;
+    }
+  }
+  vertical_context &= options.fancy_upsampling;
+  jpeg_destroy_decompress(&cinfo);
+
+  ImageInfo info;
+  info.format = ImageFormat::kJpeg;
+  info.width = image_w;
+  info.height = image_h;
+  info.restart_interval = restart_interval;
+  JpegScanLayout layout;
+  if (!JpegDecodesInBands(info) || !single_scan || !color ||
+      !ReadJpegScanLayout(input, &layout)) {
+    return false;
+  }
+  const int64_t mcus_per_row = (image_w + mcu_w - 1) / mcu_w;
+  const int64_t mcu_rows = (image_h + mcu_h - 1) / mcu_h;
+  const int64_t intervals =
+      (mcus_per_row * mcu_rows + restart_interval - 1) / restart_interval;
+  if (static_cast<int64_t>(layout.restarts.size()) != intervals - 1) {
+    return false;
+  }
+  // Bands are cut in units of the fewest MCU rows that end on an interval,
+  // and overlap by one unit where the upsampling needs context.
+  int64_t a = restart_interval;
+  int64_t b = mcus_per_row;
+  while (b != 0) {
+    const int64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  const int64_t unit_rows = restart_interval / a;
+  const int64_t units = (mcu_rows + unit_rows - 1) / unit_rows;
+  const int64_t overlap = vertical_context ? 1 : 0;
+  const int64_t band_count = std::min<int64_t>(
+      TaskScheduler::Instance().concurrency(), units / (2 + 2 * overlap));
+  if (band_count < 2) {
+    return false;
+  }
+  *supported = true;
+
+  const int unit_out_rows = JpegScaledSize(static_cast<int>(unit_rows) * mcu_h,
+                                           options);
+  const int out_w = JpegScaledSize(image_w, options);
+  const int out_h = JpegScaledSize(image_h, options);
+  std::vector<JpegBand> bands(band_count);
+  for (int64_t i = 0; i < band_count; ++i) {
+    const int64_t first = i * units / band_count;
+    const int64_t last = (i + 1) * units / band_count;
+    const int64_t begin = std::max<int64_t>(0, first - overlap);
+    const int64_t end = std::min(units, last + overlap);
+    // Intervals [begin_interval, end_interval) hold units [begin, end).
+    const int64_t begin_interval =
+        begin * unit_rows * mcus_per_row / restart_interval;
+    const int64_t end_interval =
+        end == units ? intervals
+                     : end * unit_rows * mcus_per_row / restart_interval;
+    const size_t data_begin =
+        begin_interval == 0 ? layout.data_offset
+                            : layout.restarts[begin_interval - 1] + 2;
+    const size_t data_end = end_interval == intervals
+                                ? layout.data_end
+                                : layout.restarts[end_interval - 1];
+    const int band_h = static_cast<int>(
+        std::min<int64_t>(image_h, end * unit_rows * mcu_h) -
+        begin * unit_rows * mcu_h);
+    JpegBand& band = bands[i];
+    band.stream.reserve(layout.data_offset + (data_end - data_begin) + 2);
+    band.stream.assign(input.begin(), input.begin() + layout.data_offset);
+    band.stream[layout.height_offset] = static_cast<uint8_t>(band_h >> 8);
+    band.stream[layout.height_offset + 1] = static_cast<uint8_t>(band_h);
+    band.stream.insert(band.stream.end(), input.begin() + data_begin,
+                       input.begin() + data_end);
+    for (int64_t k = begin_interval; k + 1 < end_interval; ++k) {
+      band.stream[layout.data_offset + (layout.restarts[k] - data_begin) +
+                  1] = static_cast<uint8_t>(0xD0 + ((k - begin_interval) & 7));
+    }
+    band.stream.push_back(0xFF);
+    band.stream.push_back(0xD9);
+    band.skip_rows = static_cast<int>(first - begin) * unit_out_rows;
+    band.first_row = static_cast<int>(first) * unit_out_rows;
+    band.rows = std::min(out_h, static_cast<int>(last) * unit_out_rows) -
+                band.first_row;
+  }
+
+  out->width = out_w;
+  out->height = out_h;
+  out->channels = channels;
+  out->data.resize(static_cast<size_t>(out_w) * out_h * channels);
+  std::atomic<bool> failed{false};
+  TaskScheduler::Instance().ParallelFor(
+      bands.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end && !failed; ++i) {
+          if (!DecodeJpegBand(bands[i], options, out_w, out, cancel)) {
+            failed = true;
+          }
+        }
+      });
+  if (failed) {
+    *out = ImageBuffer();
+    if (!CheckCancelled(cancel, error) && error) {
+      *error = "JPEG decode failed";
+    }
+    return false;
+  }
+  return true;
+}
+
+static bool DecodeJpeg(const std::vector<uint8_t>& input,
+                       const DecodeOptions& options, ImageBuffer* out,
+                       const CancelToken* cancel, std::string* error) {
+  if (options.crop_width <= 0) {
+    bool supported = false;
+    const bool decoded =
+        DecodeJpegBands(input, options, out, cancel, error, &supported);
+    if (supported) {
+      return decoded;
+    }
+  }
   jpeg_decompress_struct cinfo;
   JpegErrorManager jerr;
   cinfo.err = jpeg_std_error(&jerr.pub);
@@ -105,51 +997,357 @@ static bool DecodeJpeg(const std::vector<uint8_t>& input, ImageBuffer* out,
   jpeg_create_decompress(&cinfo);
   jpeg_mem_src(&cinfo, input.data(), input.size());
   jpeg_read_header(&cinfo, TRUE);
+  int crop_x = 0;
+  int crop_y = 0;
+  int crop_w = 0;
+  int crop_h = 0;
+  if (!CropRect(options, cinfo.image_width, cinfo.image_height, &crop_x,
+                &crop_y, &crop_w, &crop_h)) {
+    jpeg_destroy_decompress(&cinfo);
+    if (error) *error = "Crop rectangle is outside the image";
+    return false;
+  }
+  ConfigureJpegOutput(options, &cinfo);
+  // A preview of a scaled-down progressive JPEG reads scans in buffered-
+  // image mode only until the scaled IDCT has something of every
+  // coefficient it uses, and outputs from those.
+  const bool preview = options.preview && cinfo.progressive_mode &&
+                       JpegScaledSize(8, options) < 8;
+  if (preview) {
+    // Block smoothing guesses the AC coefficients early scans lack, which
+    // only blurs a scaled-down output.
+    cinfo.buffered_image = TRUE;
+    cinfo.do_block_smoothing = FALSE;
+  }
   jpeg_start_decompress(&cinfo);
 
-  int width = cinfo.output_width;
-  int height = cinfo.output_height;
-  int components = cinfo.output_components;
-  if (components != 3 && components != 1) {
-    jpeg_finish_decompress(&cinfo);
+  const int components = cinfo.output_components;
+  if (!JpegOutputSupported(cinfo)) {
     jpeg_destroy_decompress(&cinfo);
     if (error) *error = "Unsupported JPEG components";
     return false;
   }
+  if (preview) {
+    for (;;) {
+      if (CheckCancelled(cancel, error)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+      }
+      const int status = jpeg_consume_input(&cinfo);
+      if (status == JPEG_SUSPENDED || status == JPEG_REACHED_EOI ||
+          (status == JPEG_SCAN_COMPLETED && JpegPreviewReady(cinfo))) {
+        break;
+      }
+    }
+    jpeg_start_output(&cinfo, cinfo.input_scan_number);
+  }
+  // The crop in output pixels: rows [top, bottom), and |width| columns
+  // from |skip| into each scanline read.
+  int left = 0;
+  int right = 0;
+  int top = 0;
+  int bottom = 0;
+  JpegScaledSpan(crop_x, crop_w, cinfo.output_width, options, &left, &right);
+  JpegScaledSpan(crop_y, crop_h, cinfo.output_height, options, &top,
+                 &bottom);
+  const bool cropped = right - left != static_cast<int>(cinfo.output_width) ||
+                       bottom - top != static_cast<int>(cinfo.output_height);
+  int skip = left;
+#ifdef LIBJPEG_TURBO_VERSION
+  // libjpeg-turbo decodes only the iMCU columns that hold the crop and
+  // skips the rows above it without running the IDCT. Fancy upsampling
+  // reads the chroma beside a pixel, so a column either side is decoded
+  // too and the crop's edges come out as in a full decode.
+  if (cropped) {
+    const int margin_left = std::min(left, kJpegCropMargin);
+    JDIMENSION xoffset = left - margin_left;
+    JDIMENSION crop_width =
+        std::min<int>(cinfo.output_width, right + kJpegCropMargin) - xoffset;
+    jpeg_crop_scanline(&cinfo, &xoffset, &crop_width);
+    skip = left - static_cast<int>(xoffset);
+    if (top > 0) {
+      jpeg_skip_scanlines(&cinfo, top);
+    }
+  }
+#endif
+  const int width = right - left;
+  const int height = bottom - top;
   out->width = width;
   out->height = height;
-  out->channels = 4;
-  out->data.resize(static_cast<size_t>(width * height * 4));
-
-  std::vector<uint8_t> row_buf(width * components);
-  while (cinfo.output_scanline < cinfo.output_height) {
-    JSAMPROW row_pointer = row_buf.data();
-    jpeg_read_scanlines(&cinfo, &row_pointer, 1);
-    int y = cinfo.output_scanline - 1;
-    for (int x = 0; x < width; ++x) {
-      uint8_t r, g, b;
-      if (components == 1) {
-        r = g = b = row_buf[x];
-      } else {
-        r = row_buf[x * 3 + 0];
-        g = row_buf[x * 3 + 1];
-        b = row_buf[x * 3 + 2];
+  out->channels = JpegChannels(cinfo);
+  out->data.resize(static_cast<size_t>(width) * height * out->channels);
+
+  // Scanlines are read a band at a time: straight into |out| when libjpeg
+  // emits its layout at the whole width, otherwise into a band that is
+  // copied or converted in parallel.
+  const bool direct = cinfo.out_color_space != JCS_CMYK && !cropped;
+  const size_t row_bytes = static_cast<size_t>(width) * out->channels;
+  const size_t band_row_bytes =
+      static_cast<size_t>(cinfo.output_width) * components;
+  const int band_rows = std::max(1, std::min(height, kJpegBandRows));
+  std::vector<uint8_t> band;
+  if (!direct) {
+    band.resize(band_row_bytes * band_rows);
+  }
+  std::vector<JSAMPROW> rows(band_rows);
+  while (static_cast<int>(cinfo.output_scanline) < bottom) {
+    if (CheckCancelled(cancel, error)) {
+      jpeg_destroy_decompress(&cinfo);
+      *out = ImageBuffer();
+      return false;
+    }
+    const int first = cinfo.output_scanline;
+    const int count = std::min(band_rows, bottom - first);
+    for (int i = 0; i < count; ++i) {
+      rows[i] = direct ? out->data.data() + (first + i) * row_bytes
+                       : band.data() + i * band_row_bytes;
+    }
+    int read = 0;
+    while (read < count) {
+      read += jpeg_read_scanlines(&cinfo, rows.data() + read, count - read);
+    }
+    if (direct) {
+      continue;
+    }
+    // Rows above the crop only come through without libjpeg-turbo.
+    const int begin = std::min(count, std::max(0, top - first));
+    ParallelForRows(count - begin, width, [&](int y0, int y1) {
+      for (int i = begin + y0; i < begin + y1; ++i) {
+        const uint8_t* src = rows[i] + static_cast<size_t>(skip) * components;
+        uint8_t* dst = out->data.data() + (first + i - top) * row_bytes;
+        JpegRowToPixels(cinfo, src, dst, width);
       }
-      size_t idx = static_cast<size_t>((y * width + x) * 4);
-      out->data[idx + 0] = r;
-      out->data[idx + 1] = g;
-      out->data[idx + 2] = b;
-      out->data[idx + 3] = 255;
+    });
+  }
+  // Rows below the crop are never decoded; libjpeg only finishes a
+  // decompression that read every scanline, and a preview would read the
+  // scans it skipped.
+  if (!preview && cinfo.output_scanline == cinfo.output_height) {
+    jpeg_finish_decompress(&cinfo);
+  }
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+struct PngMemoryInput {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  size_t offset = 0;
+};
+
+static void PngReadFromMemory(png_structp png, png_bytep out,
+                              png_size_t length) {
+  auto* input = static_cast<PngMemoryInput*>(png_get_io_ptr(png));
+  if (length > input->size - input->offset) {
+    png_error(png, "PNG data truncated");
+  }
+  std::memcpy(out, input->data + input->offset, length);
+  input->offset += length;
+}
+
+static void PngIgnoreWarning(png_structp, png_const_charp) {}
+
+// gAMA values png_image_finish_read treats as sRGB and leaves alone: within
+// 5% of 1/2.2.
+static bool IsSrgbGamma(png_fixed_point gamma) {
+  const int64_t display = (static_cast<int64_t>(gamma) * 11 + 2) / 5;
+  return display >= PNG_FP_1 - 5000 && display <= PNG_FP_1 + 5000;
+}
+
+struct PngRowReader::State {
+  png_structp png = nullptr;
+  png_infop info = nullptr;
+  PngMemoryInput input;
+  int width = 0;
+  int height = 0;
+  int channels = 0;
+  bool interlaced = false;
+};
+
+PngRowReader::PngRowReader() : state_(new State()) {}
+
+PngRowReader::~PngRowReader() {
+  if (state_->png) {
+    png_destroy_read_struct(&state_->png,
+                            state_->info ? &state_->info : nullptr, nullptr);
+  }
+}
+
+bool PngRowReader::Open(const std::vector<uint8_t>& input, bool* supported) {
+  *supported = true;
+  State& state = *state_;
+  state.input.data = input.data();
+  state.input.size = input.size();
+  state.png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                     PngIgnoreWarning);
+  if (!state.png) {
+    return false;
+  }
+  state.info = png_create_info_struct(state.png);
+  if (!state.info) {
+    return false;
+  }
+  if (setjmp(png_jmpbuf(state.png))) {
+    return false;
+  }
+  png_set_read_fn(state.png, &state.input, PngReadFromMemory);
+  png_read_info(state.png, state.info);
+  png_uint_32 width = 0;
+  png_uint_32 height = 0;
+  int bit_depth = 0;
+  int color_type = 0;
+  int interlace = 0;
+  png_get_IHDR(state.png, state.info, &width, &height, &bit_depth,
+               &color_type, &interlace, nullptr, nullptr);
+  // The simplified API converts 16-bit and non-sRGB gamma images.
+  png_fixed_point gamma = 0;
+  if (bit_depth > 8 ||
+      (!png_get_valid(state.png, state.info, PNG_INFO_sRGB) &&
+       png_get_gAMA_fixed(state.png, state.info, &gamma) &&
+       !IsSrgbGamma(gamma))) {
+    *supported = false;
+    return false;
+  }
+  // Palettes become RGB and a tRNS chunk an alpha channel, as the
+  // simplified API reads them.
+  png_set_expand(state.png);
+  png_read_update_info(state.png, state.info);
+  const int channels = png_get_channels(state.png, state.info);
+  if (png_get_rowbytes(state.png, state.info) !=
+      static_cast<size_t>(width) * channels) {
+    *supported = false;
+    return false;
+  }
+  state.width = static_cast<int>(width);
+  state.height = static_cast<int>(height);
+  state.channels = channels;
+  state.interlaced = interlace != PNG_INTERLACE_NONE;
+  return true;
+}
+
+int PngRowReader::width() const { return state_->width; }
+
+int PngRowReader::height() const { return state_->height; }
+
+int PngRowReader::channels() const { return state_->channels; }
+
+bool PngRowReader::interlaced() const { return state_->interlaced; }
+
+bool PngRowReader::ReadRow(uint8_t* row) {
+  if (setjmp(png_jmpbuf(state_->png))) {
+    return false;
+  }
+  png_read_row(state_->png, row, nullptr);
+  return true;
+}
+
+// Reads rows down to the bottom of the crop and keeps the crop's columns;
+// nothing below it is inflated.
+static bool DecodePngRows(PngRowReader* reader, int x, int y, int w, int h,
+                          ImageBuffer* out, const CancelToken* cancel,
+                          std::string* error) {
+  const int channels = reader->channels();
+  out->width = w;
+  out->height = h;
+  out->channels = channels;
+  out->data.resize(static_cast<size_t>(w) * h * channels);
+  std::vector<uint8_t> row(static_cast<size_t>(reader->width()) * channels);
+  for (int i = 0; i < y + h; ++i) {
+    if (CheckCancelled(cancel, error)) {
+      *out = ImageBuffer();
+      return false;
+    }
+    if (!reader->ReadRow(row.data())) {
+      *out = ImageBuffer();
+      if (error) *error = "PNG decode failed";
+      return false;
+    }
+    if (i >= y) {
+      std::memcpy(
+          out->data.data() + static_cast<size_t>(i - y) * w * channels,
+          row.data() + static_cast<size_t>(x) * channels,
+          static_cast<size_t>(w) * channels);
     }
   }
+  return true;
+}
 
-  jpeg_finish_decompress(&cinfo);
-  jpeg_destroy_decompress(&cinfo);
+// Reads the first Adam7 passes, up to the one that completes the grid of
+// pixels whose coordinates are multiples of |denom|, and decodes to that
+// grid; the later passes are never inflated.
+static bool DecodePngPasses(PngRowReader* reader, int denom, ImageBuffer* out,
+                            const CancelToken* cancel, std::string* error) {
+  const int width = reader->width();
+  const int height = reader->height();
+  const int channels = reader->channels();
+  out->width = (width + denom - 1) / denom;
+  out->height = (height + denom - 1) / denom;
+  out->channels = channels;
+  out->data.resize(static_cast<size_t>(out->width) * out->height * channels);
+  // Passes 1, 3 and 5 complete the grids of 8, 4 and 2.
+  const int last_pass = denom == 8 ? 0 : denom == 4 ? 2 : 4;
+  std::vector<uint8_t> row(static_cast<size_t>(width) * channels);
+  for (int pass = 0; pass <= last_pass; ++pass) {
+    const int cols = PNG_PASS_COLS(width, pass);
+    const int rows = PNG_PASS_ROWS(height, pass);
+    if (cols == 0 || rows == 0) {
+      continue;
+    }
+    for (int r = 0; r < rows; ++r) {
+      if (CheckCancelled(cancel, error)) {
+        *out = ImageBuffer();
+        return false;
+      }
+      if (!reader->ReadRow(row.data())) {
+        *out = ImageBuffer();
+        if (error) *error = "PNG decode failed";
+        return false;
+      }
+      const int y =
+          (PNG_PASS_START_ROW(pass) + (r << PNG_PASS_ROW_SHIFT(pass))) / denom;
+      uint8_t* dst =
+          out->data.data() + static_cast<size_t>(y) * out->width * channels;
+      for (int i = 0; i < cols; ++i) {
+        const int x =
+            (PNG_PASS_START_COL(pass) + (i << PNG_PASS_COL_SHIFT(pass))) /
+            denom;
+        std::memcpy(dst + static_cast<size_t>(x) * channels,
+                    row.data() + i * channels, channels);
+      }
+    }
+  }
   return true;
 }
 
-static bool DecodePng(const std::vector<uint8_t>& input, ImageBuffer* out,
-                      std::string* error) {
+static bool DecodePng(const std::vector<uint8_t>& input,
+                      const DecodeOptions& options, ImageBuffer* out,
+                      const CancelToken* cancel, std::string* error) {
+  int x = 0;
+  int y = 0;
+  int w = 0;
+  int h = 0;
+  const int preview_denom = PngPreviewDenom(options);
+  const bool cropped = options.crop_width > 0 && options.crop_height > 0;
+  if (preview_denom > 1 || cropped) {
+    PngRowReader reader;
+    bool supported = true;
+    if (!reader.Open(input, &supported)) {
+      if (supported) {
+        if (error) *error = "PNG read header failed";
+        return false;
+      }
+    } else if (preview_denom > 1 && reader.interlaced()) {
+      return DecodePngPasses(&reader, preview_denom, out, cancel, error);
+    } else if (preview_denom == 1 && !reader.interlaced()) {
+      if (!CropRect(options, reader.width(), reader.height(), &x, &y, &w,
+                    &h)) {
+        if (error) *error = "Crop rectangle is outside the image";
+        return false;
+      }
+      return DecodePngRows(&reader, x, y, w, h, out, cancel, error);
+    }
+  }
+
   png_image image;
   std::memset(&image, 0, sizeof(image));
   image.version = PNG_IMAGE_VERSION;
@@ -158,11 +1356,17 @@ static bool DecodePng(const std::vector<uint8_t>& input, ImageBuffer* out,
     if (error) *error = "PNG read header failed";
     return false;
   }
+  if (!CropRect(options, image.width, image.height, &x, &y, &w, &h)) {
+    png_image_free(&image);
+    if (error) *error = "Crop rectangle is outside the image";
+    return false;
+  }
 
-  image.format = PNG_FORMAT_RGBA;
+  // 8 bits of the PNG's own gray or RGB, and alpha when it has any.
+  image.format &= PNG_FORMAT_FLAG_ALPHA | PNG_FORMAT_FLAG_COLOR;
   out->width = image.width;
   out->height = image.height;
-  out->channels = 4;
+  out->channels = PNG_IMAGE_SAMPLE_CHANNELS(image.format);
   out->data.resize(PNG_IMAGE_SIZE(image));
 
   if (!png_image_finish_read(&image, nullptr, out->data.data(), 0, nullptr)) {
@@ -171,45 +1375,204 @@ static bool DecodePng(const std::vector<uint8_t>& input, ImageBuffer* out,
     return false;
   }
   png_image_free(&image);
+  // The PNGs the row paths above decline are decoded whole and cropped or
+  // sampled after, to the pixels those would have produced.
+  if (w != out->width || h != out->height) {
+    *out = CropImage(*out, x, y, w, h);
+  }
+  if (preview_denom > 1) {
+    const int channels = out->channels;
+    ImageBuffer grid;
+    grid.width = (out->width + preview_denom - 1) / preview_denom;
+    grid.height = (out->height + preview_denom - 1) / preview_denom;
+    grid.channels = channels;
+    grid.data.resize(static_cast<size_t>(grid.width) * grid.height *
+                     channels);
+    for (int gy = 0; gy < grid.height; ++gy) {
+      const uint8_t* src =
+          out->data.data() +
+          static_cast<size_t>(gy) * preview_denom * out->width * channels;
+      uint8_t* dst =
+          grid.data.data() + static_cast<size_t>(gy) * grid.width * channels;
+      for (int gx = 0; gx < grid.width; ++gx) {
+        std::memcpy(dst + gx * channels,
+                    src + static_cast<size_t>(gx) * preview_denom * channels,
+                    channels);
+      }
+    }
+    *out = std::move(grid);
+  }
   return true;
 }
 
-static bool DecodeWebp(const std::vector<uint8_t>& input, ImageBuffer* out,
+// Decodes straight into |out|, letting libwebp crop, scale and spread the
+// work over its threads, so no full-size copy is made.
+static bool DecodeWebp(const std::vector<uint8_t>& input,
+                       const DecodeOptions& options, ImageBuffer* out,
                        std::string* error) {
-  int width = 0;
-  int height = 0;
-  if (!WebPGetInfo(input.data(), input.size(), &width, &height)) {
+  WebPDecoderConfig config;
+  if (!WebPInitDecoderConfig(&config) ||
+      WebPGetFeatures(input.data(), input.size(), &config.input) !=
+          VP8_STATUS_OK) {
     if (error) *error = "WebP header parse failed";
     return false;
   }
-  uint8_t* rgba = WebPDecodeRGBA(input.data(), input.size(), &width, &height);
-  if (!rgba) {
-    if (error) *error = "WebP decode failed";
+  int crop_x = 0;
+  int crop_y = 0;
+  int crop_w = 0;
+  int crop_h = 0;
+  if (!CropRect(options, config.input.width, config.input.height, &crop_x,
+                &crop_y, &crop_w, &crop_h)) {
+    if (error) *error = "Crop rectangle is outside the image";
     return false;
   }
+  int width = 0;
+  int height = 0;
+  DecodedSize(ImageFormat::kWebp, config.input.width, config.input.height,
+              options, &width, &height);
+  const bool scaled = width != crop_w || height != crop_h;
+  // Lossy images upsample chroma only from inside the crop, so an unscaled
+  // one also decodes a little around it to match a full decode.
+  int left = crop_x;
+  int top = crop_y;
+  int right = crop_x + crop_w;
+  int bottom = crop_y + crop_h;
+  if (!scaled) {
+    const int margin = config.input.format == 2 ? 0 : kWebpCropMargin;
+    left = std::max(0, left - margin) & ~1;
+    top = std::max(0, top - margin) & ~1;
+    right = std::min(config.input.width, right + margin);
+    bottom = std::min(config.input.height, bottom + margin);
+  }
+  if (right - left != config.input.width ||
+      bottom - top != config.input.height) {
+    config.options.use_cropping = 1;
+    config.options.crop_left = left;
+    config.options.crop_top = top;
+    config.options.crop_width = right - left;
+    config.options.crop_height = bottom - top;
+  }
+  if (scaled) {
+    config.options.use_scaling = 1;
+    config.options.scaled_width = width;
+    config.options.scaled_height = height;
+  }
+  config.options.use_threads = 1;
+  const int decoded_w = scaled ? width : right - left;
+  const int decoded_h = scaled ? height : bottom - top;
+  const int channels = config.input.has_alpha ? 4 : 3;
   out->width = width;
   out->height = height;
-  out->channels = 4;
-  out->data.assign(rgba, rgba + (width * height * 4));
-  WebPFree(rgba);
+  out->channels = channels;
+  out->data.resize(static_cast<size_t>(decoded_w) * decoded_h * channels);
+  config.output.colorspace = channels == 4 ? MODE_RGBA : MODE_RGB;
+  config.output.is_external_memory = 1;
+  config.output.u.RGBA.rgba = out->data.data();
+  config.output.u.RGBA.stride = decoded_w * channels;
+  config.output.u.RGBA.size = out->data.size();
+  const VP8StatusCode status =
+      WebPDecode(input.data(), input.size(), &config);
+  WebPFreeDecBuffer(&config.output);
+  if (status != VP8_STATUS_OK) {
+    *out = ImageBuffer();
+    if (error) *error = "WebP decode failed";
+    return false;
+  }
+  if (decoded_w != width || decoded_h != height) {
+    // Rows only move towards the start, so this trims in place.
+    const size_t row_bytes = static_cast<size_t>(width) * channels;
+    const size_t skip_x = crop_x - left;
+    const size_t skip_y = crop_y - top;
+    for (int y = 0; y < height; ++y) {
+      std::memmove(
+          out->data.data() + y * row_bytes,
+          out->data.data() + ((y + skip_y) * decoded_w + skip_x) * channels,
+          row_bytes);
+    }
+    out->data.resize(row_bytes * height);
+  }
   return true;
 }
 
-bool DecodeImage(const std::vector<uint8_t>& input, ImageBuffer* out,
-                 ImageFormat* detected, std::string* error) {
+// Copies the |pixels| gray+alpha or RGBA pixels of |src| to |dst| without
+// their alpha.
+static void StripAlpha(const uint8_t* src, uint8_t* dst, size_t pixels,
+                       int channels) {
+  if (channels == 4) {
+    RgbaToRgb(src, dst, pixels);
+    return;
+  }
+  for (size_t i = 0; i < pixels; ++i) {
+    dst[i] = src[i * 2];
+  }
+}
+
+// Drops the alpha channel of |image| when every pixel is opaque, so the
+// stages after the decode move fewer bytes.
+static void DropOpaqueAlpha(ImageBuffer* image) {
+  const int channels = image->channels;
+  if (channels != 2 && channels != 4) {
+    return;
+  }
+  const size_t width = static_cast<size_t>(image->width);
+  std::atomic<bool> translucent{false};
+  ParallelForRows(image->height, image->width, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      if (translucent.load(std::memory_order_relaxed)) {
+        return;
+      }
+      const uint8_t* alpha =
+          image->data.data() + y * width * channels + channels - 1;
+      uint8_t all = 255;
+      for (size_t x = 0; x < width; ++x) {
+        all &= alpha[x * channels];
+      }
+      if (all != 255) {
+        translucent.store(true, std::memory_order_relaxed);
+        return;
+      }
+    }
+  });
+  if (translucent.load(std::memory_order_relaxed)) {
+    return;
+  }
+  // Packed in place, top to bottom: a row's packed bytes only cover rows
+  // already read, which also keeps this on one thread.
+  const int out_channels = channels - 1;
+  for (int y = 0; y < image->height; ++y) {
+    StripAlpha(image->data.data() + y * width * channels,
+               image->data.data() + y * width * out_channels, width,
+               channels);
+  }
+  image->channels = out_channels;
+  image->data.resize(static_cast<size_t>(image->width) * image->height *
+                     out_channels);
+}
+
+bool DecodeImage(const std::vector<uint8_t>& input,
+                 const DecodeOptions& options, ImageBuffer* out,
+                 ImageFormat* detected, const CancelToken* cancel,
+                 std::string* error) {
   if (input.empty()) {
     if (error) *error = "Empty input";
     return false;
   }
   ImageFormat fmt = DetectImageFormat(input.data(), input.size());
   if (detected) *detected = fmt;
+  if (CheckCancelled(cancel, error)) {
+    return false;
+  }
+  bool ok = false;
   switch (fmt) {
     case ImageFormat::kJpeg:
-      return DecodeJpeg(input, out, error);
+      ok = DecodeJpeg(input, options, out, cancel, error);
+      break;
     case ImageFormat::kPng:
-      return DecodePng(input, out, error);
+      ok = DecodePng(input, options, out, cancel, error);
+      break;
     case ImageFormat::kWebp:
-      return DecodeWebp(input, out, error);
+      ok = DecodeWebp(input, options, out, error);
+      break;
     case ImageFormat::kHeic:
       if (error) *error = "HEIC not supported";
       return false;
@@ -217,10 +1580,26 @@ bool DecodeImage(const std::vector<uint8_t>& input, ImageBuffer* out,
       if (error) *error = "Unknown image format";
       return false;
   }
+  if (ok) {
+    DropOpaqueAlpha(out);
+  }
+  return ok;
+}
+
+// Drops a started compressor. term_destination publishes the buffer the
+// memory destination owns now (it may have grown since jpeg_mem_dest) so it
+// can be freed.
+static void AbortJpegCompress(jpeg_compress_struct* cinfo,
+                              unsigned char** mem) {
+  cinfo->dest->term_destination(cinfo);
+  jpeg_destroy_compress(cinfo);
+  free(*mem);
+  *mem = nullptr;
 }
 
 static bool EncodeJpeg(const ImageBuffer& image, int quality,
-                       std::vector<uint8_t>* out, std::string* error) {
+                       std::vector<uint8_t>* out, const CancelToken* cancel,
+                       std::string* error) {
   jpeg_compress_struct cinfo;
   JpegErrorManager jerr;
   cinfo.err = jpeg_std_error(&jerr.pub);
@@ -236,26 +1615,64 @@ static bool EncodeJpeg(const ImageBuffer& image, int quality,
   unsigned long mem_size = 0;
   jpeg_mem_dest(&cinfo, &mem, &mem_size);
 
+  // Gray and RGB rows go to libjpeg as they are, and so do RGBA rows with
+  // libjpeg-turbo, which skips the alpha. Other rows lose their alpha
+  // first.
+  const int channels = image.channels;
+  const bool gray = channels <= 2;
+  bool direct = channels == 1 || channels == 3;
   cinfo.image_width = image.width;
   cinfo.image_height = image.height;
-  cinfo.input_components = 3;
-  cinfo.in_color_space = JCS_RGB;
+  cinfo.input_components = gray ? 1 : 3;
+  cinfo.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+#ifdef JCS_ALPHA_EXTENSIONS
+  if (channels == 4) {
+    direct = true;
+    cinfo.input_components = 4;
+    cinfo.in_color_space = JCS_EXT_RGBA;
+  }
+#endif
   jpeg_set_defaults(&cinfo);
   jpeg_set_quality(&cinfo, std::max(1, std::min(quality, 100)), TRUE);
 
   jpeg_start_compress(&cinfo, TRUE);
 
-  std::vector<uint8_t> row(image.width * 3);
+  // Rows go to libjpeg a band at a time, stripped of their alpha in
+  // parallel first when they need it.
+  const size_t row_bytes = static_cast<size_t>(image.width) * channels;
+  const size_t band_row_bytes =
+      static_cast<size_t>(image.width) * cinfo.input_components;
+  const int band_rows = std::max(1, std::min(image.height, kJpegBandRows));
+  std::vector<uint8_t> band;
+  if (!direct) {
+    band.resize(band_row_bytes * band_rows);
+  }
+  std::vector<JSAMPROW> rows(band_rows);
   while (cinfo.next_scanline < cinfo.image_height) {
-    int y = cinfo.next_scanline;
-    for (int x = 0; x < image.width; ++x) {
-      size_t idx = static_cast<size_t>((y * image.width + x) * 4);
-      row[x * 3 + 0] = image.data[idx + 0];
-      row[x * 3 + 1] = image.data[idx + 1];
-      row[x * 3 + 2] = image.data[idx + 2];
+    if (CheckCancelled(cancel, error)) {
+      AbortJpegCompress(&cinfo, &mem);
+      return false;
+    }
+    const int first = cinfo.next_scanline;
+    const int count = std::min(band_rows, image.height - first);
+    for (int i = 0; i < count; ++i) {
+      const uint8_t* src = image.data.data() + (first + i) * row_bytes;
+      rows[i] = direct ? const_cast<JSAMPROW>(src)
+                       : band.data() + i * band_row_bytes;
+    }
+    if (!direct) {
+      ParallelForRows(count, image.width, [&](int y0, int y1) {
+        for (int i = y0; i < y1; ++i) {
+          StripAlpha(image.data.data() + (first + i) * row_bytes, rows[i],
+                     image.width, channels);
+        }
+      });
+    }
+    int written = 0;
+    while (written < count) {
+      written += jpeg_write_scanlines(&cinfo, rows.data() + written,
+                                      count - written);
     }
-    JSAMPROW row_pointer = row.data();
-    jpeg_write_scanlines(&cinfo, &row_pointer, 1);
   }
 
   jpeg_finish_compress(&cinfo);
@@ -272,7 +1689,9 @@ static bool EncodePng(const ImageBuffer& image, std::vector<uint8_t>* out,
   img.version = PNG_IMAGE_VERSION;
   img.width = image.width;
   img.height = image.height;
-  img.format = PNG_FORMAT_RGBA;
+  img.format = 0;
+  if (image.channels >= 3) img.format |= PNG_FORMAT_FLAG_COLOR;
+  if (image.channels % 2 == 0) img.format |= PNG_FORMAT_FLAG_ALPHA;
 
   size_t size = 0;
   if (!png_image_write_to_memory(&img, nullptr, &size, 0, image.data.data(), 0,
@@ -290,29 +1709,76 @@ static bool EncodePng(const ImageBuffer& image, std::vector<uint8_t>* out,
   return true;
 }
 
+// Same settings as WebPEncodeRGBA except for the method.
 static bool EncodeWebp(const ImageBuffer& image, int quality,
+                       const EncodeOptions& options,
                        std::vector<uint8_t>* out, std::string* error) {
-  uint8_t* data = nullptr;
-  size_t size = WebPEncodeRGBA(image.data.data(), image.width, image.height,
-                               image.width * 4, quality, &data);
-  if (size == 0 || !data) {
+  WebPConfig config;
+  WebPPicture picture;
+  if (!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT,
+                        static_cast<float>(quality)) ||
+      !WebPPictureInit(&picture)) {
+    if (error) *error = "WebP encode failed";
+    return false;
+  }
+  config.method = std::max(0, std::min(options.webp_method, 6));
+  picture.width = image.width;
+  picture.height = image.height;
+  // libwebp imports RGB and RGBA; gray is widened to RGBA first, with
+  // gray+alpha keeping its alpha.
+  const uint8_t* pixels = image.data.data();
+  std::vector<uint8_t> rgba;
+  if (image.channels <= 2) {
+    const size_t count = static_cast<size_t>(image.width) * image.height;
+    rgba.resize(count * 4);
+    if (image.channels == 1) {
+      GrayToRgba(pixels, rgba.data(), count);
+    } else {
+      for (size_t i = 0; i < count; ++i) {
+        std::memset(&rgba[i * 4], pixels[i * 2], 3);
+        rgba[i * 4 + 3] = pixels[i * 2 + 1];
+      }
+    }
+    pixels = rgba.data();
+  }
+  const bool imported =
+      image.channels == 3
+          ? WebPPictureImportRGB(&picture, pixels, image.width * 3)
+          : WebPPictureImportRGBA(&picture, pixels, image.width * 4);
+  if (!imported) {
+    WebPPictureFree(&picture);
+    if (error) *error = "WebP encode failed";
+    return false;
+  }
+  WebPMemoryWriter writer;
+  WebPMemoryWriterInit(&writer);
+  picture.writer = WebPMemoryWrite;
+  picture.custom_ptr = &writer;
+  bool ok = WebPEncode(&config, &picture);
+  WebPPictureFree(&picture);
+  if (!ok) {
+    WebPMemoryWriterClear(&writer);
     if (error) *error = "WebP encode failed";
     return false;
   }
-  out->assign(data, data + size);
-  WebPFree(data);
+  out->assign(writer.mem, writer.mem + writer.size);
+  WebPMemoryWriterClear(&writer);
   return true;
 }
 
 bool EncodeImage(const ImageBuffer& image, ImageFormat format, int quality,
-                 std::vector<uint8_t>* out, std::string* error) {
+                 const EncodeOptions& options, std::vector<uint8_t>* out,
+                 const CancelToken* cancel, std::string* error) {
+  if (CheckCancelled(cancel, error)) {
+    return false;
+  }
   switch (format) {
     case ImageFormat::kJpeg:
-      return EncodeJpeg(image, quality, out, error);
+      return EncodeJpeg(image, quality, out, cancel, error);
     case ImageFormat::kPng:
       return EncodePng(image, out, error);
     case ImageFormat::kWebp:
-      return EncodeWebp(image, quality, out, error);
+      return EncodeWebp(image, quality, options, out, error);
     case ImageFormat::kHeic:
       if (error) *error = "HEIC not supported";
       return false;
@@ -328,166 +1794,438 @@ static inline uint8_t ClampToByte(float v) {
   return static_cast<uint8_t>(v + 0.5f);
 }
 
+// Calls |kernel| with std::integral_constant<int, |channels|>, so each
+// ImageBuffer layout runs a loop compiled for its pixel size.
+template <typename Kernel>
+static void ForChannels(int channels, const Kernel& kernel) {
+  switch (channels) {
+    case 1:
+      kernel(std::integral_constant<int, 1>());
+      break;
+    case 2:
+      kernel(std::integral_constant<int, 2>());
+      break;
+    case 3:
+      kernel(std::integral_constant<int, 3>());
+      break;
+    default:
+      kernel(std::integral_constant<int, 4>());
+      break;
+  }
+}
+
+// Pixels are copied with memcpy of a constant size, which compiles to a
+// single load and store.
+template <int kChannels>
+static inline void CopyPixel(uint8_t* dst, const uint8_t* src) {
+  std::memcpy(dst, src, kChannels);
+}
+
+template <int kChannels>
+static void ResizeBilinearKernel(const ImageBuffer& src, ImageBuffer* out,
+                                 const CancelToken* cancel) {
+  const float x_scale = static_cast<float>(src.width) / out->width;
+  const float y_scale = static_cast<float>(src.height) / out->height;
+  const size_t src_stride = static_cast<size_t>(src.width) * kChannels;
+
+  ParallelForRows(out->height, out->width, [&](int row_begin, int row_end) {
+    for (int y = row_begin; y < row_end; ++y) {
+      if (cancel && cancel->cancelled()) {
+        return;
+      }
+      float sy = (y + 0.5f) * y_scale - 0.5f;
+      int y0 = static_cast<int>(floorf(sy));
+      int y1 = std::min(y0 + 1, src.height - 1);
+      float fy = sy - y0;
+      y0 = std::max(0, y0);
+      const uint8_t* row0 = src.data.data() + y0 * src_stride;
+      const uint8_t* row1 = src.data.data() + y1 * src_stride;
+      uint8_t* dst = out->data.data() +
+                     static_cast<size_t>(y) * out->width * kChannels;
+
+      for (int x = 0; x < out->width; ++x) {
+        float sx = (x + 0.5f) * x_scale - 0.5f;
+        int x0 = static_cast<int>(floorf(sx));
+        int x1 = std::min(x0 + 1, src.width - 1);
+        float fx = sx - x0;
+        x0 = std::max(0, x0);
+
+        for (int c = 0; c < kChannels; ++c) {
+          float v00 = row0[x0 * kChannels + c];
+          float v10 = row0[x1 * kChannels + c];
+          float v01 = row1[x0 * kChannels + c];
+          float v11 = row1[x1 * kChannels + c];
+
+          float v0 = v00 + (v10 - v00) * fx;
+          float v1 = v01 + (v11 - v01) * fx;
+          float v = v0 + (v1 - v0) * fy;
+          dst[x * kChannels + c] = ClampToByte(v);
+        }
+      }
+    }
+  });
+}
+
 ImageBuffer ResizeImageBilinear(const ImageBuffer& src, int target_w,
-                                int target_h) {
+                                int target_h, const CancelToken* cancel) {
   ImageBuffer out;
   out.width = std::max(1, target_w);
   out.height = std::max(1, target_h);
-  out.channels = 4;
-  out.data.resize(static_cast<size_t>(out.width * out.height * 4));
-
-  const float x_scale = static_cast<float>(src.width) / out.width;
-  const float y_scale = static_cast<float>(src.height) / out.height;
-
-  for (int y = 0; y < out.height; ++y) {
-    float sy = (y + 0.5f) * y_scale - 0.5f;
-    int y0 = static_cast<int>(floorf(sy));
-    int y1 = std::min(y0 + 1, src.height - 1);
-    float fy = sy - y0;
-    y0 = std::max(0, y0);
-
-    for (int x = 0; x < out.width; ++x) {
-      float sx = (x + 0.5f) * x_scale - 0.5f;
-      int x0 = static_cast<int>(floorf(sx));
-      int x1 = std::min(x0 + 1, src.width - 1);
-      float fx = sx - x0;
-      x0 = std::max(0, x0);
-
-      for (int c = 0; c < 4; ++c) {
-        float v00 = src.data[(y0 * src.width + x0) * 4 + c];
-        float v10 = src.data[(y0 * src.width + x1) * 4 + c];
-        float v01 = src.data[(y1 * src.width + x0) * 4 + c];
-        float v11 = src.data[(y1 * src.width + x1) * 4 + c];
-
-        float v0 = v00 + (v10 - v00) * fx;
-        float v1 = v01 + (v11 - v01) * fx;
-        float v = v0 + (v1 - v0) * fy;
-        out.data[(y * out.width + x) * 4 + c] = ClampToByte(v);
-      }
-    }
-  }
+  out.channels = src.channels;
+  out.data.resize(static_cast<size_t>(out.width) * out.height *
+                  out.channels);
+  ForChannels(src.channels, [&](auto channels) {
+    ResizeBilinearKernel<decltype(channels)::value>(src, &out, cancel);
+  });
 
+  if (cancel && cancel->cancelled()) {
+    return ImageBuffer();
+  }
   return out;
 }
 
-ImageBuffer FlipHorizontal(const ImageBuffer& src) {
-  ImageBuffer out = src;
-  for (int y = 0; y < src.height; ++y) {
-    for (int x = 0; x < src.width / 2; ++x) {
-      int x2 = src.width - 1 - x;
-      for (int c = 0; c < 4; ++c) {
-        std::swap(out.data[(y * src.width + x) * 4 + c],
-                  out.data[(y * src.width + x2) * 4 + c]);
+template <int kChannels>
+static void ResizeNearestKernel(const ImageBuffer& src, ImageBuffer* out,
+                                const CancelToken* cancel) {
+  std::vector<int> src_x(out->width);
+  for (int x = 0; x < out->width; ++x) {
+    src_x[x] = std::min(src.width - 1, static_cast<int>(
+                            (static_cast<int64_t>(x) * 2 + 1) * src.width /
+                            (static_cast<int64_t>(out->width) * 2)));
+  }
+  ParallelForRows(out->height, out->width, [&](int row_begin, int row_end) {
+    for (int y = row_begin; y < row_end; ++y) {
+      if (cancel && cancel->cancelled()) {
+        return;
+      }
+      int sy = std::min(src.height - 1, static_cast<int>(
+                            (static_cast<int64_t>(y) * 2 + 1) * src.height /
+                            (static_cast<int64_t>(out->height) * 2)));
+      const uint8_t* src_row =
+          src.data.data() + static_cast<size_t>(sy) * src.width * kChannels;
+      uint8_t* dst_row = out->data.data() +
+                         static_cast<size_t>(y) * out->width * kChannels;
+      for (int x = 0; x < out->width; ++x) {
+        CopyPixel<kChannels>(dst_row + x * kChannels,
+                             src_row + src_x[x] * kChannels);
       }
     }
+  });
+}
+
+ImageBuffer ResizeImageNearest(const ImageBuffer& src, int target_w,
+                               int target_h, const CancelToken* cancel) {
+  ImageBuffer out;
+  out.width = std::max(1, target_w);
+  out.height = std::max(1, target_h);
+  out.channels = src.channels;
+  out.data.resize(static_cast<size_t>(out.width) * out.height *
+                  out.channels);
+  ForChannels(src.channels, [&](auto channels) {
+    ResizeNearestKernel<decltype(channels)::value>(src, &out, cancel);
+  });
+
+  if (cancel && cancel->cancelled()) {
+    return ImageBuffer();
   }
   return out;
 }
 
-ImageBuffer FlipVertical(const ImageBuffer& src) {
-  ImageBuffer out = src;
-  for (int y = 0; y < src.height / 2; ++y) {
-    int y2 = src.height - 1 - y;
-    for (int x = 0; x < src.width; ++x) {
-      for (int c = 0; c < 4; ++c) {
-        std::swap(out.data[(y * src.width + x) * 4 + c],
-                  out.data[(y2 * src.width + x) * 4 + c]);
+ImageBuffer ResizeImage(const ImageBuffer& src, int target_w, int target_h,
+                        ResizeFilter filter, const CancelToken* cancel) {
+  if (filter == ResizeFilter::kNearest) {
+    return ResizeImageNearest(src, target_w, target_h, cancel);
+  }
+  return ResizeImageBilinear(src, target_w, target_h, cancel);
+}
+
+template <int kChannels>
+static inline void SwapPixels(uint8_t* a, uint8_t* b) {
+  uint8_t t[kChannels];
+  std::memcpy(t, a, kChannels);
+  std::memcpy(a, b, kChannels);
+  std::memcpy(b, t, kChannels);
+}
+
+// Pixel x of |row_a| trades places with pixel |width| - 1 - x of |row_b|.
+// With |row_a| == |row_b|, this mirrors the row in place.
+template <int kChannels>
+static void SwapMirroredRows(uint8_t* row_a, uint8_t* row_b, int width) {
+  const int count = row_a == row_b ? width / 2 : width;
+  for (int x = 0; x < count; ++x) {
+    SwapPixels<kChannels>(row_a + x * kChannels,
+                          row_b + (width - 1 - x) * kChannels);
+  }
+}
+
+// Mirrors |image| horizontally and, with |vertical|, vertically too,
+// which turns it by 180 degrees. Row y trades with row height - 1 - y.
+static void MirrorInPlace(ImageBuffer* image, bool vertical) {
+  const size_t row_bytes = static_cast<size_t>(image->width) * image->channels;
+  uint8_t* data = image->data.data();
+  const int height = image->height;
+  const int rows = vertical ? (height + 1) / 2 : height;
+  ForChannels(image->channels, [&](auto channels) {
+    constexpr int kChannels = decltype(channels)::value;
+    ParallelForRows(rows, image->width, [&](int y0, int y1) {
+      for (int y = y0; y < y1; ++y) {
+        const int other = vertical ? height - 1 - y : y;
+        SwapMirroredRows<kChannels>(data + y * row_bytes,
+                                    data + other * row_bytes, image->width);
       }
-    }
+    });
+  });
+}
+
+static int NormalizeAngle(int angle_degrees) {
+  const int angle = angle_degrees % 360;
+  return angle < 0 ? angle + 360 : angle;
+}
+
+// OrientImage reads destination pixel (x, y) from source pixel origin +
+// x * step_x + y * step_y, counting pixels in row order. Orientations 5 to
+// 8 step across source rows with x and along them with y.
+struct OrientationWalk {
+  ptrdiff_t origin;
+  ptrdiff_t step_x;
+  ptrdiff_t step_y;
+};
+
+static OrientationWalk WalkFor(int orientation, int width, int height) {
+  const ptrdiff_t w = width;
+  const ptrdiff_t last_row = (height - 1) * w;
+  switch (orientation) {
+    case 2:
+      return {w - 1, -1, w};
+    case 3:
+      return {last_row + w - 1, -1, -w};
+    case 4:
+      return {last_row, 1, -w};
+    case 5:
+      return {last_row + w - 1, -w, -1};
+    case 6:
+      return {last_row, -w, 1};
+    case 7:
+      return {0, w, 1};
+    case 8:
+      return {w - 1, w, -1};
+    default:
+      return {0, 1, w};
   }
-  return out;
 }
 
-static ImageBuffer RotateImage90(const ImageBuffer& src) {
-  ImageBuffer out;
-  out.width = src.height;
-  out.height = src.width;
-  out.channels = 4;
-  out.data.resize(static_cast<size_t>(out.width * out.height * 4));
+// Orientations 1 to 4 keep rows whole, so each destination row is one
+// source row, copied or mirrored.
+template <int kChannels>
+static void OrientRowsKernel(const ImageBuffer& src,
+                             const OrientationWalk& walk, ImageBuffer* out) {
+  const size_t row_bytes = static_cast<size_t>(out->width) * kChannels;
+  ParallelForRows(out->height, out->width, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      const uint8_t* from =
+          src.data.data() + (walk.origin + y * walk.step_y) * kChannels;
+      uint8_t* to = out->data.data() + y * row_bytes;
+      if (walk.step_x == 1) {
+        std::memcpy(to, from, row_bytes);
+        continue;
+      }
+      for (int x = 0; x < out->width; ++x) {
+        CopyPixel<kChannels>(to + x * kChannels, from - x * kChannels);
+      }
+    }
+  });
+}
 
-  for (int y = 0; y < src.height; ++y) {
-    for (int x = 0; x < src.width; ++x) {
-      int nx = src.height - 1 - y;
-      int ny = x;
-      size_t src_idx = static_cast<size_t>((y * src.width + x) * 4);
-      size_t dst_idx = static_cast<size_t>((ny * out.width + nx) * 4);
-      std::memcpy(&out.data[dst_idx], &src.data[src_idx], 4);
+// Side of the square tiles orientations 5 to 8 are copied in. The source
+// rows a tile reads and the destination rows it writes stay in L1, where
+// a whole column at a time would touch a cache line and a page per pixel.
+constexpr int kOrientTile = 32;
+
+template <int kChannels>
+static void OrientTilesKernel(const ImageBuffer& src,
+                              const OrientationWalk& walk, ImageBuffer* out) {
+  const ptrdiff_t out_w = out->width;
+  const int tile_rows = (out->height + kOrientTile - 1) / kOrientTile;
+  ParallelForRows(tile_rows, out->width * kOrientTile, [&](int t0, int t1) {
+    for (int t = t0; t < t1; ++t) {
+      const int y0 = t * kOrientTile;
+      const int rows = std::min(kOrientTile, out->height - y0);
+      for (int x0 = 0; x0 < out->width; x0 += kOrientTile) {
+        const int cols = std::min(kOrientTile, out->width - x0);
+        if (kChannels == 4) {
+          // The tile's columns are source rows. Starting from its last row
+          // when step_y runs backwards reads them forwards.
+          const int first_y = walk.step_y > 0 ? y0 : y0 + rows - 1;
+          TransposePixels32(
+              src.data.data() +
+                  (walk.origin + x0 * walk.step_x + first_y * walk.step_y) *
+                      4,
+              walk.step_x * 4, out->data.data() + (first_y * out_w + x0) * 4,
+              walk.step_y * out_w * 4, rows, cols);
+          continue;
+        }
+        for (int y = y0; y < y0 + rows; ++y) {
+          const ptrdiff_t from =
+              walk.origin + x0 * walk.step_x + y * walk.step_y;
+          uint8_t* to = out->data.data() + (y * out_w + x0) * kChannels;
+          for (int x = 0; x < cols; ++x) {
+            CopyPixel<kChannels>(
+                to + x * kChannels,
+                src.data.data() + (from + x * walk.step_x) * kChannels);
+          }
+        }
+      }
     }
+  });
+}
+
+ImageBuffer OrientImage(const ImageBuffer& src, int orientation) {
+  if (orientation < 2 || orientation > 8) {
+    return src;
   }
+  const bool transposed = orientation >= 5;
+  ImageBuffer out;
+  out.width = transposed ? src.height : src.width;
+  out.height = transposed ? src.width : src.height;
+  out.channels = src.channels;
+  out.data.resize(src.data.size());
+  const OrientationWalk walk = WalkFor(orientation, src.width, src.height);
+  ForChannels(src.channels, [&](auto channels) {
+    constexpr int kChannels = decltype(channels)::value;
+    if (transposed) {
+      OrientTilesKernel<kChannels>(src, walk, &out);
+    } else {
+      OrientRowsKernel<kChannels>(src, walk, &out);
+    }
+  });
   return out;
 }
 
-static ImageBuffer RotateImage180(const ImageBuffer& src) {
-  ImageBuffer out = src;
-  for (int y = 0; y < src.height; ++y) {
-    for (int x = 0; x < src.width; ++x) {
-      int nx = src.width - 1 - x;
-      int ny = src.height - 1 - y;
-      size_t src_idx = static_cast<size_t>((y * src.width + x) * 4);
-      size_t dst_idx = static_cast<size_t>((ny * src.width + nx) * 4);
-      std::memcpy(&out.data[dst_idx], &src.data[src_idx], 4);
-    }
+ImageBuffer OrientImage(ImageBuffer&& src, int orientation) {
+  switch (orientation) {
+    case 2:
+      return FlipHorizontal(std::move(src));
+    case 3:
+      return RotateImage(std::move(src), 180);
+    case 4:
+      return FlipVertical(std::move(src));
+    case 5:
+    case 6:
+    case 7:
+    case 8:
+      return OrientImage(static_cast<const ImageBuffer&>(src), orientation);
+    default:
+      return std::move(src);
   }
-  return out;
 }
 
-static ImageBuffer RotateImage270(const ImageBuffer& src) {
-  ImageBuffer out;
-  out.width = src.height;
-  out.height = src.width;
-  out.channels = 4;
-  out.data.resize(static_cast<size_t>(out.width * out.height * 4));
+ImageBuffer FlipHorizontal(const ImageBuffer& src) {
+  return OrientImage(src, 2);
+}
 
-  for (int y = 0; y < src.height; ++y) {
-    for (int x = 0; x < src.width; ++x) {
-      int nx = y;
-      int ny = src.width - 1 - x;
-      size_t src_idx = static_cast<size_t>((y * src.width + x) * 4);
-      size_t dst_idx = static_cast<size_t>((ny * out.width + nx) * 4);
-      std::memcpy(&out.data[dst_idx], &src.data[src_idx], 4);
-    }
+ImageBuffer FlipHorizontal(ImageBuffer&& src) {
+  MirrorInPlace(&src, false);
+  return std::move(src);
+}
+
+ImageBuffer CropImage(const ImageBuffer& src, int x, int y, int width,
+                      int height) {
+  ImageBuffer out;
+  out.width = width;
+  out.height = height;
+  out.channels = src.channels;
+  out.data.resize(static_cast<size_t>(width) * height * src.channels);
+  const size_t row_bytes = static_cast<size_t>(width) * src.channels;
+  for (int row = 0; row < height; ++row) {
+    std::memcpy(out.data.data() + row * row_bytes,
+                src.data.data() +
+                    (static_cast<size_t>(y + row) * src.width + x) *
+                        src.channels,
+                row_bytes);
   }
   return out;
 }
 
+ImageBuffer CropImage(ImageBuffer&& src, int x, int y, int width,
+                      int height) {
+  const size_t row_bytes = static_cast<size_t>(width) * src.channels;
+  // A small crop is copied out instead, so the caller can free the frame.
+  if (row_bytes * height * 2 < src.data.size()) {
+    return CropImage(static_cast<const ImageBuffer&>(src), x, y, width,
+                     height);
+  }
+  // Rows only move towards the start, so they are packed top to bottom.
+  for (int row = 0; row < height; ++row) {
+    std::memmove(src.data.data() + row * row_bytes,
+                 src.data.data() +
+                     (static_cast<size_t>(y + row) * src.width + x) *
+                         src.channels,
+                 row_bytes);
+  }
+  src.width = width;
+  src.height = height;
+  src.data.resize(row_bytes * height);
+  return std::move(src);
+}
+
+ImageBuffer FlipVertical(const ImageBuffer& src) {
+  return OrientImage(src, 4);
+}
+
+ImageBuffer FlipVertical(ImageBuffer&& src) {
+  const size_t row_bytes = static_cast<size_t>(src.width) * src.channels;
+  uint8_t* data = src.data.data();
+  ParallelForRows(src.height / 2, src.width, [&](int y0, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      uint8_t* top = data + y * row_bytes;
+      std::swap_ranges(top, top + row_bytes,
+                       data + (src.height - 1 - y) * row_bytes);
+    }
+  });
+  return std::move(src);
+}
+
+// Samples |src| at (x, y) into |out_px|, which has kChannels plus an alpha
+// channel when |src| has none; pixels outside |src| are transparent black.
+template <int kChannels>
 static void SampleBilinear(const ImageBuffer& src, float x, float y,
                            uint8_t* out_px) {
+  constexpr int kOutChannels = kChannels + kChannels % 2;
   int x0 = static_cast<int>(floorf(x));
   int y0 = static_cast<int>(floorf(y));
   int x1 = x0 + 1;
   int y1 = y0 + 1;
 
   if (x0 < 0 || y0 < 0 || x1 >= src.width || y1 >= src.height) {
-    out_px[0] = 0;
-    out_px[1] = 0;
-    out_px[2] = 0;
-    out_px[3] = 0;
+    std::memset(out_px, 0, kOutChannels);
     return;
   }
 
   float fx = x - x0;
   float fy = y - y0;
 
-  for (int c = 0; c < 4; ++c) {
-    float v00 = src.data[(y0 * src.width + x0) * 4 + c];
-    float v10 = src.data[(y0 * src.width + x1) * 4 + c];
-    float v01 = src.data[(y1 * src.width + x0) * 4 + c];
-    float v11 = src.data[(y1 * src.width + x1) * 4 + c];
+  for (int c = 0; c < kChannels; ++c) {
+    float v00 = src.data[(y0 * src.width + x0) * kChannels + c];
+    float v10 = src.data[(y0 * src.width + x1) * kChannels + c];
+    float v01 = src.data[(y1 * src.width + x0) * kChannels + c];
+    float v11 = src.data[(y1 * src.width + x1) * kChannels + c];
 
     float v0 = v00 + (v10 - v00) * fx;
     float v1 = v01 + (v11 - v01) * fx;
     float v = v0 + (v1 - v0) * fy;
     out_px[c] = ClampToByte(v);
   }
+  if (kOutChannels != kChannels) {
+    out_px[kChannels] = 255;
+  }
 }
 
 ImageBuffer RotateImage(const ImageBuffer& src, int angle_degrees) {
-  int angle = angle_degrees % 360;
-  if (angle < 0) angle += 360;
+  const int angle = NormalizeAngle(angle_degrees);
   if (angle == 0) return src;
-  if (angle == 90) return RotateImage90(src);
-  if (angle == 180) return RotateImage180(src);
-  if (angle == 270) return RotateImage270(src);
+  if (angle % 90 == 0) {
+    return OrientImage(src, angle == 90 ? 6 : angle == 180 ? 3 : 8);
+  }
 
   const float rad = angle * static_cast<float>(M_PI) / 180.0f;
   const float cosv = std::cos(rad);
@@ -498,36 +2236,51 @@ ImageBuffer RotateImage(const ImageBuffer& src, int angle_degrees) {
   int new_h = static_cast<int>(std::ceil(std::abs(src.width * sinv) +
                                          std::abs(src.height * cosv)));
 
+  // The corners the turned image leaves are transparent, so gray and RGB
+  // gain an alpha channel.
   ImageBuffer out;
   out.width = std::max(1, new_w);
   out.height = std::max(1, new_h);
-  out.channels = 4;
-  out.data.assign(static_cast<size_t>(out.width * out.height * 4), 0);
+  out.channels = src.channels + src.channels % 2;
+  out.data.assign(static_cast<size_t>(out.width) * out.height * out.channels,
+                  0);
 
   float cx = (src.width - 1) / 2.0f;
   float cy = (src.height - 1) / 2.0f;
   float ncx = (out.width - 1) / 2.0f;
   float ncy = (out.height - 1) / 2.0f;
 
-  for (int y = 0; y < out.height; ++y) {
-    for (int x = 0; x < out.width; ++x) {
-      float dx = x - ncx;
-      float dy = y - ncy;
-      float sx = cosv * dx + sinv * dy + cx;
-      float sy = -sinv * dx + cosv * dy + cy;
-      uint8_t px[4];
-      SampleBilinear(src, sx, sy, px);
-      size_t dst_idx = static_cast<size_t>((y * out.width + x) * 4);
-      out.data[dst_idx + 0] = px[0];
-      out.data[dst_idx + 1] = px[1];
-      out.data[dst_idx + 2] = px[2];
-      out.data[dst_idx + 3] = px[3];
-    }
-  }
+  ForChannels(src.channels, [&](auto channels) {
+    constexpr int kChannels = decltype(channels)::value;
+    constexpr int kOutChannels = kChannels + kChannels % 2;
+    ParallelForRows(out.height, out.width, [&](int y0, int y1) {
+      for (int y = y0; y < y1; ++y) {
+        uint8_t* dst = out.data.data() +
+                       static_cast<size_t>(y) * out.width * kOutChannels;
+        for (int x = 0; x < out.width; ++x) {
+          float dx = x - ncx;
+          float dy = y - ncy;
+          float sx = cosv * dx + sinv * dy + cx;
+          float sy = -sinv * dx + cosv * dy + cy;
+          SampleBilinear<kChannels>(src, sx, sy, dst + x * kOutChannels);
+        }
+      }
+    });
+  });
 
   return out;
 }
 
+ImageBuffer RotateImage(ImageBuffer&& src, int angle_degrees) {
+  const int angle = NormalizeAngle(angle_degrees);
+  if (angle == 180) {
+    MirrorInPlace(&src, true);
+  } else if (angle != 0) {
+    return RotateImage(static_cast<const ImageBuffer&>(src), angle);
+  }
+  return std::move(src);
+}
+
 void CalcTargetSize(int src_w, int src_h, int min_w, int min_h, int in_sample,
                     int* out_w, int* out_h) {
   double scale_w = static_cast<double>(src_w) / std::max(1, min_w);
@@ -0,0 +1,40 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_JOB_REGISTRY_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_JOB_REGISTRY_H_
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "image_compress_core.h"
+
+namespace fic {
+
+// Maps caller-supplied job ids to the cancel tokens of queued and running
+// jobs. Jobs submitted under the same id share one token.
+class JobRegistry {
+ public:
+  // Returns the token for a new job. An empty |job_id| gets a private token
+  // that nothing can cancel.
+  std::shared_ptr<CancelToken> Acquire(const std::string& job_id);
+
+  // Drops one job's hold on |job_id|, forgetting the id with its last job.
+  void Release(const std::string& job_id);
+
+  // Cancels every live job with |job_id|. Returns false if there is none.
+  bool Cancel(const std::string& job_id);
+
+ private:
+  struct Entry {
+    std::shared_ptr<CancelToken> token;
+    size_t jobs = 0;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_JOB_REGISTRY_H_
@@ -0,0 +1,93 @@
+#include "memory_budget.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "resource_limits.h"
+
+namespace fic {
+
+namespace {
+
+// Waiters re-check their cancel token this often.
+constexpr std::chrono::milliseconds kCancelPollInterval(50);
+
+}  // namespace
+
+MemoryBudget::MemoryBudget(uint64_t limit) : limit_(limit) {}
+
+bool MemoryBudget::Acquire(uint64_t bytes, Priority priority,
+                           const CancelToken* cancel) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Admission is first come, first served within a priority so a big image
+  // is not starved by a stream of small ones that would each fit. A
+  // thumbnail does not wait behind a bulk job, as in WorkerPool.
+  const bool interactive = priority == Priority::kInteractive;
+  std::deque<uint64_t>& waiters =
+      interactive ? interactive_waiters_ : background_waiters_;
+  const uint64_t ticket = next_ticket_++;
+  waiters.push_back(ticket);
+  for (;;) {
+    if (cancel && cancel->cancelled()) {
+      waiters.erase(std::find(waiters.begin(), waiters.end(), ticket));
+      lock.unlock();
+      cv_.notify_all();
+      return false;
+    }
+    if (waiters.front() == ticket &&
+        (interactive || interactive_waiters_.empty()) &&
+        (limit_ == 0 || in_use_ == 0 || in_use_ + bytes <= limit_)) {
+      waiters.pop_front();
+      in_use_ += bytes;
+      lock.unlock();
+      cv_.notify_all();
+      return true;
+    }
+    cv_.wait_for(lock, kCancelPollInterval);
+  }
+}
+
+void MemoryBudget::Release(uint64_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_use_ -= std::min(bytes, in_use_);
+  }
+  cv_.notify_all();
+}
+
+void MemoryBudget::SetLimit(uint64_t limit) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    limit_ = limit;
+  }
+  cv_.notify_all();
+}
+
+uint64_t MemoryBudget::limit() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return limit_;
+}
+
+uint64_t MemoryBudget::in_use() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return in_use_;
+}
+
+MemoryReservation::MemoryReservation(MemoryBudget* budget, uint64_t bytes,
+                                     Priority priority,
+                                     const CancelToken* cancel)
+    : budget_(budget), bytes_(bytes) {
+  admitted_ = budget_->Acquire(bytes_, priority, cancel);
+}
+
+MemoryReservation::~MemoryReservation() {
+  if (admitted_) {
+    budget_->Release(bytes_);
+  }
+}
+
+uint64_t DefaultMemoryBudget() {
+  return AvailableMemory() / 2;
+}
+
+}  // namespace fic
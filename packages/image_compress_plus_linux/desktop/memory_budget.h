@@ -0,0 +1,73 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_MEMORY_BUDGET_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_MEMORY_BUDGET_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+#include "image_compress_core.h"
+#include "worker_pool.h"
+
+namespace fic {
+
+// Global byte budget for in-flight jobs. A job reserves its estimated peak
+// before it decodes anything and returns it when done, so the number of
+// images held in memory at once adapts to their size instead of to the
+// worker count.
+class MemoryBudget {
+ public:
+  explicit MemoryBudget(uint64_t limit);
+
+  MemoryBudget(const MemoryBudget&) = delete;
+  MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+  // Blocks until |bytes| fit in the budget and every earlier caller of the
+  // same |priority| has been admitted; background callers also wait for
+  // every interactive one. A job larger than the whole budget is admitted
+  // once nothing else holds a reservation. Returns false, reserving
+  // nothing, if |cancel| fires while waiting.
+  bool Acquire(uint64_t bytes, Priority priority, const CancelToken* cancel);
+  void Release(uint64_t bytes);
+
+  // 0 removes the limit. Lowering it never interrupts admitted jobs.
+  void SetLimit(uint64_t limit);
+  uint64_t limit() const;
+  uint64_t in_use() const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  uint64_t limit_;
+  uint64_t in_use_ = 0;
+  uint64_t next_ticket_ = 0;
+  std::deque<uint64_t> interactive_waiters_;
+  std::deque<uint64_t> background_waiters_;
+};
+
+// Reserves bytes from a MemoryBudget for the lifetime of the scope.
+class MemoryReservation {
+ public:
+  MemoryReservation(MemoryBudget* budget, uint64_t bytes, Priority priority,
+                    const CancelToken* cancel);
+  ~MemoryReservation();
+
+  MemoryReservation(const MemoryReservation&) = delete;
+  MemoryReservation& operator=(const MemoryReservation&) = delete;
+
+  // False when the wait was cancelled.
+  bool admitted() const { return admitted_; }
+
+ private:
+  MemoryBudget* budget_;
+  uint64_t bytes_;
+  bool admitted_;
+};
+
+// Half of AvailableMemory(): the physical memory or the cgroup memory
+// limit, whichever is lower. 0 (no limit) when neither can be queried.
+uint64_t DefaultMemoryBudget();
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_MEMORY_BUDGET_H_
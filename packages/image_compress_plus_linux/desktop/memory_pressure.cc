@@ -0,0 +1,123 @@
+#include "memory_pressure.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <utility>
+
+#include "resource_limits.h"
+
+namespace fic {
+
+namespace {
+
+constexpr char kSystemPressurePath[] = "/proc/pressure/memory";
+
+// 200 ms of stall in a 2 s window. Unprivileged triggers need a window that
+// is a multiple of 2 s.
+constexpr char kTrigger[] = "some 200000 2000000";
+constexpr double kEnterAvg10 = 10.0;
+constexpr double kLeaveAvg10 = 2.0;
+constexpr int kSampleIntervalMs = 2000;
+
+}  // namespace
+
+MemoryPressureMonitor::MemoryPressureMonitor(
+    std::function<void(bool)> on_change)
+    : on_change_(std::move(on_change)) {
+  const std::string cgroup = CgroupDirectory();
+  path_ = cgroup.empty() ? kSystemPressurePath : cgroup + "/memory.pressure";
+  if (!ReadAverage(nullptr)) {
+    path_ = kSystemPressurePath;
+    if (!ReadAverage(nullptr)) {
+      return;
+    }
+  }
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (stop_fd_ < 0) {
+    return;
+  }
+  trigger_fd_ = open(path_.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  // The trigger string is written with its terminator, as the kernel
+  // documentation does.
+  if (trigger_fd_ >= 0 &&
+      write(trigger_fd_, kTrigger, sizeof(kTrigger)) < 0) {
+    close(trigger_fd_);
+    trigger_fd_ = -1;
+  }
+  thread_ = std::thread(&MemoryPressureMonitor::Run, this);
+}
+
+MemoryPressureMonitor::~MemoryPressureMonitor() {
+  if (thread_.joinable()) {
+    const uint64_t one = 1;
+    if (write(stop_fd_, &one, sizeof(one)) < 0) {
+      // eventfd writes only fail on counter overflow.
+    }
+    thread_.join();
+  }
+  if (trigger_fd_ >= 0) {
+    close(trigger_fd_);
+  }
+  if (stop_fd_ >= 0) {
+    close(stop_fd_);
+  }
+}
+
+void MemoryPressureMonitor::Run() {
+  bool under_pressure = false;
+  for (;;) {
+    pollfd fds[2] = {{stop_fd_, POLLIN, 0}, {trigger_fd_, POLLPRI, 0}};
+    const nfds_t count = trigger_fd_ >= 0 ? 2 : 1;
+    // An armed trigger wakes us when pressure starts; only its end needs
+    // sampling.
+    const int timeout =
+        trigger_fd_ >= 0 && !under_pressure ? -1 : kSampleIntervalMs;
+    const int ready = poll(fds, count, timeout);
+    if (ready < 0 && errno != EINTR) {
+      return;
+    }
+    if (fds[0].revents & POLLIN) {
+      return;
+    }
+    if (count == 2 && (fds[1].revents & POLLERR)) {
+      // The cgroup went away; the trigger will never fire again.
+      close(trigger_fd_);
+      trigger_fd_ = -1;
+    }
+    const bool triggered = count == 2 && (fds[1].revents & POLLPRI);
+    double avg10 = 0;
+    const bool sampled = ReadAverage(&avg10);
+    bool next = under_pressure;
+    if (!under_pressure) {
+      next = triggered || (sampled && avg10 >= kEnterAvg10);
+    } else if (sampled && avg10 < kLeaveAvg10) {
+      next = false;
+    }
+    if (next != under_pressure) {
+      under_pressure = next;
+      on_change_(under_pressure);
+    }
+  }
+}
+
+// Reads the 10 s "some" average, in percent, from path_.
+bool MemoryPressureMonitor::ReadAverage(double* some_avg10) const {
+  FILE* file = std::fopen(path_.c_str(), "re");
+  if (!file) {
+    return false;
+  }
+  double avg10 = 0;
+  const bool ok = std::fscanf(file, "some avg10=%lf", &avg10) == 1;
+  std::fclose(file);
+  if (ok && some_avg10) {
+    *some_avg10 = avg10;
+  }
+  return ok;
+}
+
+}  // namespace fic
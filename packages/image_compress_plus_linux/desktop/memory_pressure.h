@@ -0,0 +1,43 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_MEMORY_PRESSURE_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_MEMORY_PRESSURE_H_
+
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace fic {
+
+// Watches memory pressure stall information (PSI) for the process's cgroup,
+// or for the whole system outside cgroup v2, and reports when pressure
+// starts and ends. Pressure starts once tasks stalled on memory for 10% of
+// a 2 s window and ends when the 10 s average drops back under 2%.
+//
+// Where the kernel lets an unprivileged process arm a PSI trigger the
+// thread sleeps until the kernel signals one; otherwise it samples the
+// averages every two seconds. Without PSI the monitor does nothing.
+class MemoryPressureMonitor {
+ public:
+  // |on_change| runs on the monitor's thread with true when pressure
+  // starts and false when it ends.
+  explicit MemoryPressureMonitor(std::function<void(bool)> on_change);
+  ~MemoryPressureMonitor();
+
+  MemoryPressureMonitor(const MemoryPressureMonitor&) = delete;
+  MemoryPressureMonitor& operator=(const MemoryPressureMonitor&) = delete;
+
+ private:
+  void Run();
+  bool ReadAverage(double* some_avg10) const;
+
+  std::function<void(bool)> on_change_;
+  std::string path_;
+  // memory.pressure opened with a trigger armed, or -1 when sampling.
+  int trigger_fd_ = -1;
+  // eventfd that wakes the thread for shutdown.
+  int stop_fd_ = -1;
+  std::thread thread_;
+};
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_MEMORY_PRESSURE_H_
@@ -0,0 +1,34 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_PIXEL_CONVERT_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_PIXEL_CONVERT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace fic {
+
+// Row converters between the packed 8-bit layouts libjpeg, libwebp and
+// ImageBuffer use. They use NEON on ARM, and SSE2 on x86 or AVX2 where
+// the CPU has it, and finish the tail of a row in scalar code. |src| and
+// |dst| must not overlap, except that RgbaToRgb may pack in place, to a
+// |dst| at or before |src|. Alpha is set to 255 when widening and dropped
+// when narrowing.
+void GrayToRgba(const uint8_t* src, uint8_t* dst, size_t pixels);
+void RgbaToRgb(const uint8_t* src, uint8_t* dst, size_t pixels);
+// Converts the CMYK libjpeg outputs for a CMYK or YCCK JPEG to RGB, as
+// R = (255 - C) * (255 - K) / 255 and so on, rounded. |inverted| takes the
+// inks as stored inverted (255 - C), which Adobe's APP14 marker implies.
+void CmykToRgb(const uint8_t* src, uint8_t* dst, size_t pixels,
+               bool inverted);
+
+// Copies a block of |height| rows of |width| 4-byte pixels at |src| to
+// its transpose at |dst|, |width| rows of |height| pixels: pixel x of
+// source row y becomes pixel y of destination row x. Strides are in bytes
+// and may be negative. Runs 4 x 4 blocks with NEON or SSE2, 8 x 8 with
+// AVX2.
+void TransposePixels32(const uint8_t* src, ptrdiff_t src_stride,
+                       uint8_t* dst, ptrdiff_t dst_stride, int width,
+                       int height);
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_PIXEL_CONVERT_H_
@@ -0,0 +1,174 @@
+#include "resource_limits.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+namespace fic {
+
+namespace {
+
+#ifdef __linux__
+
+constexpr char kCgroupRoot[] = "/sys/fs/cgroup";
+
+// First line of |path|, or "" if it cannot be read.
+std::string ReadFirstLine(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
+
+// Calls |visit| with the cgroup's directory and then each ancestor up to
+// the root: a limit anywhere on that path applies to the process.
+template <typename Visit>
+void ForEachCgroupAncestor(Visit visit) {
+  std::string dir = CgroupDirectory();
+  if (dir.empty()) {
+    return;
+  }
+  const std::string root = kCgroupRoot;
+  for (;;) {
+    visit(dir);
+    if (dir.size() <= root.size()) {
+      return;
+    }
+    dir.erase(dir.find_last_of('/'));
+  }
+}
+
+// Parses a cgroup byte limit; "max" and garbage mean none.
+uint64_t ParseByteLimit(const std::string& value) {
+  char* end = nullptr;
+  const unsigned long long bytes = std::strtoull(value.c_str(), &end, 10);
+  return end == value.c_str() ? 0 : static_cast<uint64_t>(bytes);
+}
+
+#endif  // __linux__
+
+// Keeps the smaller non-zero limit; 0 means none.
+template <typename T>
+T MinLimit(T a, T b) {
+  if (a == 0) {
+    return b;
+  }
+  return b == 0 ? a : std::min(a, b);
+}
+
+}  // namespace
+
+std::string CgroupDirectory() {
+#ifdef __linux__
+  // cgroup v2 exposes a single hierarchy, listed as "0::<path>". With a
+  // cgroup namespace, as in most containers, <path> is "/" and the mount
+  // root is the container's own group.
+  std::ifstream in("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 3, "0::") != 0) {
+      continue;
+    }
+    std::string dir = kCgroupRoot + line.substr(3);
+    while (dir.size() > 1 && dir.back() == '/') {
+      dir.pop_back();
+    }
+    if (std::ifstream(dir + "/cgroup.procs").good()) {
+      return dir;
+    }
+    // The path belongs to another namespace's view; the mount root is the
+    // closest group we can see.
+    if (std::ifstream(std::string(kCgroupRoot) + "/cgroup.controllers")
+            .good()) {
+      return kCgroupRoot;
+    }
+  }
+#endif
+  return std::string();
+}
+
+double CgroupCpuLimit() {
+  double limit = 0;
+#ifdef __linux__
+  ForEachCgroupAncestor([&limit](const std::string& dir) {
+    // "<quota> <period>" in microseconds, or "max <period>".
+    const std::string line = ReadFirstLine(dir + "/cpu.max");
+    char* end = nullptr;
+    const double quota = std::strtod(line.c_str(), &end);
+    if (end == line.c_str() || quota <= 0) {
+      return;
+    }
+    const double period = std::strtod(end, nullptr);
+    if (period > 0) {
+      limit = MinLimit(limit, quota / period);
+    }
+  });
+#endif
+  return limit;
+}
+
+uint64_t CgroupMemoryLimit() {
+  uint64_t limit = 0;
+#ifdef __linux__
+  ForEachCgroupAncestor([&limit](const std::string& dir) {
+    // memory.high throttles and reclaims before memory.max kills, so it is
+    // the one a well-behaved process stays under.
+    limit = MinLimit(limit, ParseByteLimit(ReadFirstLine(dir + "/memory.max")));
+    limit =
+        MinLimit(limit, ParseByteLimit(ReadFirstLine(dir + "/memory.high")));
+  });
+#endif
+  return limit;
+}
+
+size_t AvailableCpuCount() {
+  size_t count = std::max(1u, std::thread::hardware_concurrency());
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) {
+    count = std::min(count, static_cast<size_t>(CPU_COUNT(&set)));
+  }
+  const double quota = CgroupCpuLimit();
+  if (quota > 0) {
+    // Rounding a fractional quota up would have every thread throttled for
+    // part of each period.
+    count = std::min(count, std::max<size_t>(
+                                1, static_cast<size_t>(std::floor(quota))));
+  }
+#endif
+  return count;
+}
+
+uint64_t AvailableMemory() {
+#ifdef _WIN32
+  MEMORYSTATUSEX status = {};
+  status.dwLength = sizeof(status);
+  if (!GlobalMemoryStatusEx(&status)) {
+    return 0;
+  }
+  return static_cast<uint64_t>(status.ullTotalPhys);
+#else
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  uint64_t physical = 0;
+  if (pages > 0 && page_size > 0) {
+    physical = static_cast<uint64_t>(pages) * static_cast<uint64_t>(page_size);
+  }
+  return MinLimit(physical, CgroupMemoryLimit());
+#endif
+}
+
+}  // namespace fic
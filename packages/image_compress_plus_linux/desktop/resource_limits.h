@@ -0,0 +1,33 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_RESOURCE_LIMITS_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_RESOURCE_LIMITS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace fic {
+
+// Directory of the calling process's cgroup v2, e.g.
+// "/sys/fs/cgroup/user.slice/app.scope", or "" when cgroup v2 is not
+// mounted (and on Windows).
+std::string CgroupDirectory();
+
+// CPUs the cgroup CPU quota allows (cpu.max quota / period, lowest along
+// the hierarchy), or 0 when unlimited or unknown.
+double CgroupCpuLimit();
+
+// Lowest memory.max or memory.high along the cgroup hierarchy in bytes, or
+// 0 when unlimited or unknown.
+uint64_t CgroupMemoryLimit();
+
+// Threads worth running at once: the hardware threads, narrowed by the CPU
+// affinity mask and the cgroup CPU quota. At least one.
+size_t AvailableCpuCount();
+
+// Physical memory, capped by the cgroup memory limit, or 0 when it cannot
+// be queried.
+uint64_t AvailableMemory();
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_RESOURCE_LIMITS_H_
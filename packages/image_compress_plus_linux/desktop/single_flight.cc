@@ -0,0 +1,37 @@
+#include "single_flight.h"
+
+#include <cstring>
+
+namespace fic {
+
+static uint64_t Mix(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+  return value;
+}
+
+uint64_t HashBytes(const uint8_t* data, size_t size) {
+  constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+  // Four independent lanes keep the multiplies from serializing.
+  uint64_t lanes[4] = {size, kMultiplier, ~size, ~kMultiplier};
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    for (int lane = 0; lane < 4; ++lane) {
+      uint64_t word;
+      std::memcpy(&word, data + i + lane * 8, sizeof(word));
+      lanes[lane] = (lanes[lane] ^ word) * kMultiplier;
+      lanes[lane] ^= lanes[lane] >> 29;
+    }
+  }
+  uint64_t hash = Mix(lanes[0]) ^ Mix(lanes[1] + 1) ^ Mix(lanes[2] + 2) ^
+                  Mix(lanes[3] + 3);
+  for (; i < size; ++i) {
+    hash = (hash ^ data[i]) * kMultiplier;
+  }
+  return Mix(hash);
+}
+
+}  // namespace fic
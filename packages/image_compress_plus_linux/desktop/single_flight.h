@@ -0,0 +1,61 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_SINGLE_FLIGHT_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_SINGLE_FLIGHT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fic {
+
+// Coalesces concurrent calls that would produce the same result. The first
+// call to Join() a key runs the work and hands its result to Complete();
+// calls joining while it runs just wait for that result.
+template <typename Result>
+class SingleFlight {
+ public:
+  using Callback = std::function<void(const Result&)>;
+
+  // Registers |done| under |key|. Returns true when nothing was in flight
+  // for |key|, in which case the caller must run the work and Complete()
+  // it; otherwise |done| runs once the call in flight completes.
+  bool Join(const std::string& key, Callback done) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Callback>& waiters = flights_[key];
+    waiters.push_back(std::move(done));
+    return waiters.size() == 1;
+  }
+
+  // Runs every callback joined under |key| with |result| on this thread.
+  // A later Join() with the same key starts a new flight.
+  void Complete(const std::string& key, const Result& result) {
+    std::vector<Callback> waiters;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = flights_.find(key);
+      if (it == flights_.end()) {
+        return;
+      }
+      waiters.swap(it->second);
+      flights_.erase(it);
+    }
+    for (Callback& done : waiters) {
+      done(result);
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::vector<Callback>> flights_;
+};
+
+// 64-bit hash of |size| bytes, for keying in-memory inputs.
+uint64_t HashBytes(const uint8_t* data, size_t size);
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_SINGLE_FLIGHT_H_
@@ -0,0 +1,618 @@
+#include "stream_compress.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+extern "C" {
+#include <jpeglib.h>
+#include <png.h>
+}
+
+#include "pixel_convert.h"
+
+namespace fic {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double NanosSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+      .count();
+}
+
+// Same rounding as the buffered resize.
+uint8_t ClampToByte(float v) {
+  if (v < 0.0f) return 0;
+  if (v > 255.0f) return 255;
+  return static_cast<uint8_t>(v + 0.5f);
+}
+
+struct JpegError {
+  jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+void JpegErrorExit(j_common_ptr cinfo) {
+  longjmp(reinterpret_cast<JpegError*>(cinfo->err)->jump, 1);
+}
+
+void PngIgnoreWarning(png_structp, png_const_charp) {}
+
+void PngWriteToVector(png_structp png, png_bytep data, png_size_t length) {
+  auto* out = static_cast<std::vector<uint8_t>*>(png_get_io_ptr(png));
+  out->insert(out->end(), data, data + length);
+}
+
+void PngFlush(png_structp) {}
+
+// Same as the buffered encode's: copies |pixels| gray+alpha or RGBA
+// pixels without their alpha.
+void StripAlpha(const uint8_t* src, uint8_t* dst, size_t pixels,
+                int channels) {
+  if (channels == 4) {
+    RgbaToRgb(src, dst, pixels);
+    return;
+  }
+  for (size_t i = 0; i < pixels; ++i) {
+    dst[i] = src[i * 2];
+  }
+}
+
+// Hands out a decoded image one row at a time, top to bottom, in the
+// layout DecodeImage decodes it to.
+class RowSource {
+ public:
+  virtual ~RowSource() = default;
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  int channels() const { return channels_; }
+
+  // Decodes the next row into |row|, width() * channels() bytes.
+  virtual bool ReadRow(uint8_t* row) = 0;
+
+ protected:
+  int width_ = 0;
+  int height_ = 0;
+  int channels_ = 0;
+};
+
+// Set up like DecodeJpeg, so the rows are the ones it decodes.
+class JpegRowSource : public RowSource {
+ public:
+  ~JpegRowSource() override {
+    if (created_) {
+      jpeg_destroy_decompress(&cinfo_);
+    }
+  }
+
+  StreamResult Open(const std::vector<uint8_t>& input,
+                    const DecodeOptions& options) {
+    cinfo_.err = jpeg_std_error(&error_.pub);
+    error_.pub.error_exit = JpegErrorExit;
+    if (setjmp(error_.jump)) {
+      return StreamResult::kFailed;
+    }
+    jpeg_create_decompress(&cinfo_);
+    created_ = true;
+    jpeg_mem_src(&cinfo_, input.data(), input.size());
+    jpeg_read_header(&cinfo_, TRUE);
+    cmyk_ = cinfo_.jpeg_color_space == JCS_CMYK ||
+            cinfo_.jpeg_color_space == JCS_YCCK;
+    if (cinfo_.jpeg_color_space != JCS_YCbCr &&
+        cinfo_.jpeg_color_space != JCS_RGB &&
+        cinfo_.jpeg_color_space != JCS_GRAYSCALE && !cmyk_) {
+      return StreamResult::kUnsupported;
+    }
+    cinfo_.scale_num = std::max(1, options.scale_num);
+    cinfo_.scale_denom = std::max(1, options.scale_denom);
+    cinfo_.dct_method = options.fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+    cinfo_.do_fancy_upsampling = options.fancy_upsampling ? TRUE : FALSE;
+    const bool gray = cinfo_.jpeg_color_space == JCS_GRAYSCALE;
+    if (cmyk_) {
+      cinfo_.out_color_space = JCS_CMYK;
+    } else if (!gray) {
+      cinfo_.out_color_space = JCS_RGB;
+    }
+    jpeg_start_decompress(&cinfo_);
+    width_ = cinfo_.output_width;
+    height_ = cinfo_.output_height;
+    channels_ = gray ? 1 : 3;
+    if (cinfo_.output_components != (cmyk_ ? 4 : channels_)) {
+      return StreamResult::kUnsupported;
+    }
+    if (cmyk_) {
+      packed_.resize(static_cast<size_t>(width_) * 4);
+    }
+    return StreamResult::kDone;
+  }
+
+  bool ReadRow(uint8_t* out) override {
+    if (setjmp(error_.jump)) {
+      return false;
+    }
+    JSAMPROW row = cmyk_ ? packed_.data() : out;
+    if (jpeg_read_scanlines(&cinfo_, &row, 1) != 1) {
+      return false;
+    }
+    if (cmyk_) {
+      CmykToRgb(packed_.data(), out, width_, cinfo_.saw_Adobe_marker);
+    }
+    return true;
+  }
+
+ private:
+  jpeg_decompress_struct cinfo_;
+  JpegError error_;
+  bool created_ = false;
+  bool cmyk_ = false;
+  std::vector<uint8_t> packed_;
+};
+
+class PngRowSource : public RowSource {
+ public:
+  StreamResult Open(const std::vector<uint8_t>& input) {
+    bool supported = true;
+    if (!reader_.Open(input, &supported)) {
+      return supported ? StreamResult::kFailed : StreamResult::kUnsupported;
+    }
+    if (reader_.interlaced()) {
+      return StreamResult::kUnsupported;
+    }
+    width_ = reader_.width();
+    height_ = reader_.height();
+    channels_ = reader_.channels();
+    return StreamResult::kDone;
+  }
+
+  bool ReadRow(uint8_t* row) override { return reader_.ReadRow(row); }
+
+ private:
+  PngRowReader reader_;
+};
+
+// Takes the resized image one row at a time, top to bottom, in the layout
+// given to Begin().
+class RowSink {
+ public:
+  virtual ~RowSink() = default;
+
+  virtual bool Begin(int width, int height, int channels) = 0;
+  virtual bool WriteRow(const uint8_t* row) = 0;
+  virtual bool Finish(std::vector<uint8_t>* out, std::string* error) = 0;
+};
+
+// Set up like EncodeJpeg, so the output is the same byte for byte.
+class JpegRowSink : public RowSink {
+ public:
+  explicit JpegRowSink(int quality) : quality_(quality) {}
+
+  ~JpegRowSink() override {
+    if (created_) {
+      // Publishes the buffer the memory destination owns now, which may
+      // have grown since jpeg_mem_dest, so it can be freed.
+      if (writing_) {
+        cinfo_.dest->term_destination(&cinfo_);
+      }
+      jpeg_destroy_compress(&cinfo_);
+    }
+    free(mem_);
+  }
+
+  bool Begin(int width, int height, int channels) override {
+    channels_ = channels;
+    const bool gray = channels <= 2;
+    direct_ = channels == 1 || channels == 3;
+#ifdef JCS_ALPHA_EXTENSIONS
+    direct_ = direct_ || channels == 4;
+#endif
+    if (!direct_) {
+      packed_.resize(static_cast<size_t>(width) * (gray ? 1 : 3));
+    }
+    cinfo_.err = jpeg_std_error(&error_.pub);
+    error_.pub.error_exit = JpegErrorExit;
+    if (setjmp(error_.jump)) {
+      return false;
+    }
+    jpeg_create_compress(&cinfo_);
+    created_ = true;
+    jpeg_mem_dest(&cinfo_, &mem_, &mem_size_);
+    writing_ = true;
+    cinfo_.image_width = width;
+    cinfo_.image_height = height;
+    cinfo_.input_components = gray ? 1 : 3;
+    cinfo_.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+#ifdef JCS_ALPHA_EXTENSIONS
+    if (channels == 4) {
+      cinfo_.input_components = 4;
+      cinfo_.in_color_space = JCS_EXT_RGBA;
+    }
+#endif
+    jpeg_set_defaults(&cinfo_);
+    jpeg_set_quality(&cinfo_, std::max(1, std::min(quality_, 100)), TRUE);
+    jpeg_start_compress(&cinfo_, TRUE);
+    return true;
+  }
+
+  bool WriteRow(const uint8_t* pixels) override {
+    if (setjmp(error_.jump)) {
+      return false;
+    }
+    JSAMPROW row = const_cast<JSAMPROW>(pixels);
+    if (!direct_) {
+      StripAlpha(pixels, packed_.data(), cinfo_.image_width, channels_);
+      row = packed_.data();
+    }
+    return jpeg_write_scanlines(&cinfo_, &row, 1) == 1;
+  }
+
+  bool Finish(std::vector<uint8_t>* out, std::string* error) override {
+    if (setjmp(error_.jump)) {
+      if (error) *error = "JPEG encode failed";
+      return false;
+    }
+    jpeg_finish_compress(&cinfo_);
+    writing_ = false;
+    out->assign(mem_, mem_ + mem_size_);
+    return true;
+  }
+
+ private:
+  const int quality_;
+  jpeg_compress_struct cinfo_;
+  JpegError error_;
+  bool created_ = false;
+  bool writing_ = false;
+  bool direct_ = false;
+  int channels_ = 0;
+  unsigned char* mem_ = nullptr;
+  unsigned long mem_size_ = 0;
+  std::vector<uint8_t> packed_;
+};
+
+// Writes what png_image_write_to_memory writes for 8-bit pixels.
+class PngRowSink : public RowSink {
+ public:
+  ~PngRowSink() override {
+    if (png_) {
+      png_destroy_write_struct(&png_, info_ ? &info_ : nullptr);
+    }
+  }
+
+  bool Begin(int width, int height, int channels) override {
+    static const int kColorTypes[] = {
+        PNG_COLOR_TYPE_GRAY, PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB,
+        PNG_COLOR_TYPE_RGBA};
+    png_ = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                   PngIgnoreWarning);
+    if (!png_) {
+      return false;
+    }
+    info_ = png_create_info_struct(png_);
+    if (!info_) {
+      return false;
+    }
+    if (setjmp(png_jmpbuf(png_))) {
+      return false;
+    }
+    png_set_write_fn(png_, &encoded_, PngWriteToVector, PngFlush);
+    png_set_IHDR(png_, info_, width, height, 8, kColorTypes[channels - 1],
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_set_sRGB(png_, info_, PNG_sRGB_INTENT_PERCEPTUAL);
+    png_write_info(png_, info_);
+    return true;
+  }
+
+  bool WriteRow(const uint8_t* row) override {
+    if (setjmp(png_jmpbuf(png_))) {
+      return false;
+    }
+    png_write_row(png_, const_cast<png_bytep>(row));
+    return true;
+  }
+
+  bool Finish(std::vector<uint8_t>* out, std::string* error) override {
+    if (setjmp(png_jmpbuf(png_))) {
+      if (error) *error = "PNG encode failed";
+      return false;
+    }
+    png_write_end(png_, nullptr);
+    *out = std::move(encoded_);
+    return true;
+  }
+
+ private:
+  png_structp png_ = nullptr;
+  png_infop info_ = nullptr;
+  std::vector<uint8_t> encoded_;
+};
+
+// Collects the rows at output size for encoders that need the whole image,
+// such as WebP's.
+class BufferRowSink : public RowSink {
+ public:
+  BufferRowSink(const StreamJob& job, const CancelToken* cancel)
+      : job_(job), cancel_(cancel) {}
+
+  bool Begin(int width, int height, int channels) override {
+    image_.width = width;
+    image_.height = height;
+    image_.channels = channels;
+    image_.data.resize(static_cast<size_t>(width) * height * channels);
+    return true;
+  }
+
+  bool WriteRow(const uint8_t* row) override {
+    const size_t row_bytes =
+        static_cast<size_t>(image_.width) * image_.channels;
+    std::memcpy(image_.data.data() + next_row_ * row_bytes, row, row_bytes);
+    ++next_row_;
+    return true;
+  }
+
+  bool Finish(std::vector<uint8_t>* out, std::string* error) override {
+    return EncodeImage(image_, job_.format, job_.quality, job_.encode, out,
+                       cancel_, error);
+  }
+
+ private:
+  const StreamJob& job_;
+  const CancelToken* cancel_;
+  ImageBuffer image_;
+  size_t next_row_ = 0;
+};
+
+// ResizeImageBilinear and ResizeImageNearest over a rolling window: source
+// rows come in top to bottom and each output row goes out as soon as the
+// source rows it samples are in. Only the last two horizontally resampled
+// rows are kept, and source rows no output row samples are skipped.
+class RowResizer {
+ public:
+  RowResizer(int src_w, int src_h, int dst_w, int dst_h, int channels,
+             ResizeFilter filter)
+      : dst_w_(dst_w),
+        dst_h_(dst_h),
+        channels_(channels),
+        copy_(src_w == dst_w && src_h == dst_h),
+        nearest_(filter == ResizeFilter::kNearest),
+        cols_(dst_w),
+        rows_(dst_h),
+        needed_(src_h, false),
+        out_(static_cast<size_t>(dst_w) * channels) {
+    if (nearest_) {
+      for (int x = 0; x < dst_w; ++x) {
+        cols_[x].i0 = NearestIndex(x, src_w, dst_w);
+        cols_[x].i1 = cols_[x].i0;
+      }
+      for (int y = 0; y < dst_h; ++y) {
+        rows_[y].i0 = NearestIndex(y, src_h, dst_h);
+        rows_[y].i1 = rows_[y].i0;
+      }
+    } else {
+      BilinearTaps(src_w, dst_w, &cols_);
+      BilinearTaps(src_h, dst_h, &rows_);
+      for (std::vector<float>& row : window_) {
+        row.resize(static_cast<size_t>(dst_w) * channels);
+      }
+    }
+    for (const Tap& tap : rows_) {
+      needed_[tap.i0] = true;
+      needed_[tap.i1] = true;
+    }
+  }
+
+  // Takes source row |y| and calls |emit| with each output row it
+  // completes. Returns false as soon as |emit| does.
+  bool Push(int y, const uint8_t* row,
+            const std::function<bool(const uint8_t*)>& emit) {
+    if (copy_) {
+      ++next_;
+      return emit(row);
+    }
+    if (!needed_[y]) {
+      return true;
+    }
+    if (nearest_) {
+      for (; next_ < dst_h_ && rows_[next_].i0 == y; ++next_) {
+        for (int x = 0; x < dst_w_; ++x) {
+          std::memcpy(&out_[x * channels_], row + cols_[x].i0 * channels_,
+                      channels_);
+        }
+        if (!emit(out_.data())) {
+          return false;
+        }
+      }
+      return true;
+    }
+    // Rows a tap pair samples are adjacent, so they never share a slot.
+    float* resampled = window_[y & 1].data();
+    for (int x = 0; x < dst_w_; ++x) {
+      const Tap& tap = cols_[x];
+      for (int c = 0; c < channels_; ++c) {
+        float v0 = row[tap.i0 * channels_ + c];
+        float v1 = row[tap.i1 * channels_ + c];
+        resampled[x * channels_ + c] = v0 + (v1 - v0) * tap.f;
+      }
+    }
+    for (; next_ < dst_h_ && rows_[next_].i1 <= y; ++next_) {
+      const Tap& tap = rows_[next_];
+      const float* top = window_[tap.i0 & 1].data();
+      const float* bottom = window_[tap.i1 & 1].data();
+      for (size_t i = 0; i < out_.size(); ++i) {
+        out_[i] = ClampToByte(top[i] + (bottom[i] - top[i]) * tap.f);
+      }
+      if (!emit(out_.data())) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool done() const { return next_ == dst_h_; }
+
+ private:
+  // Source indices an output index samples and the weight of the second.
+  struct Tap {
+    int i0 = 0;
+    int i1 = 0;
+    float f = 0;
+  };
+
+  static int NearestIndex(int i, int src, int dst) {
+    return std::min(src - 1, static_cast<int>(
+                                 (static_cast<int64_t>(i) * 2 + 1) * src /
+                                 (static_cast<int64_t>(dst) * 2)));
+  }
+
+  static void BilinearTaps(int src, int dst, std::vector<Tap>* taps) {
+    const float scale = static_cast<float>(src) / dst;
+    for (int i = 0; i < dst; ++i) {
+      float s = (i + 0.5f) * scale - 0.5f;
+      int i0 = static_cast<int>(floorf(s));
+      Tap& tap = (*taps)[i];
+      tap.i1 = std::min(i0 + 1, src - 1);
+      tap.f = s - i0;
+      tap.i0 = std::max(0, i0);
+    }
+  }
+
+  const int dst_w_;
+  const int dst_h_;
+  const int channels_;
+  const bool copy_;
+  const bool nearest_;
+  std::vector<Tap> cols_;
+  std::vector<Tap> rows_;
+  std::vector<bool> needed_;
+  std::vector<float> window_[2];
+  std::vector<uint8_t> out_;
+  int next_ = 0;
+};
+
+const char* EncodeFailure(ImageFormat format) {
+  switch (format) {
+    case ImageFormat::kJpeg:
+      return "JPEG encode failed";
+    case ImageFormat::kPng:
+      return "PNG encode failed";
+    default:
+      return "WebP encode failed";
+  }
+}
+
+}  // namespace
+
+StreamResult StreamCompress(const std::vector<uint8_t>& input,
+                            const StreamJob& job, std::vector<uint8_t>* out,
+                            StreamTimings* timings, const CancelToken* cancel,
+                            std::string* error) {
+  *timings = StreamTimings();
+  if (job.format != ImageFormat::kJpeg && job.format != ImageFormat::kPng &&
+      job.format != ImageFormat::kWebp) {
+    return StreamResult::kUnsupported;
+  }
+  if (job.decode.crop_width > 0 || job.decode.preview) {
+    return StreamResult::kUnsupported;
+  }
+  const ImageFormat format = DetectImageFormat(input.data(), input.size());
+  auto start = Clock::now();
+  std::unique_ptr<RowSource> source;
+  StreamResult opened = StreamResult::kUnsupported;
+  if (format == ImageFormat::kJpeg) {
+    auto jpeg = std::make_unique<JpegRowSource>();
+    opened = jpeg->Open(input, job.decode);
+    source = std::move(jpeg);
+  } else if (format == ImageFormat::kPng) {
+    auto png = std::make_unique<PngRowSource>();
+    opened = png->Open(input);
+    source = std::move(png);
+  }
+  const char* decode_failure = format == ImageFormat::kJpeg
+                                   ? "JPEG decode failed"
+                                   : "PNG decode failed";
+  if (opened != StreamResult::kDone) {
+    if (opened == StreamResult::kFailed && error) *error = decode_failure;
+    return opened;
+  }
+  timings->decode_nanos = NanosSince(start);
+
+  const int width = source->width();
+  const int height = source->height();
+  const int out_w = std::max(1, std::min(job.target_width, width));
+  const int out_h = std::max(1, std::min(job.target_height, height));
+  timings->decoded_width = width;
+  timings->decoded_height = height;
+  timings->output_width = out_w;
+  timings->output_height = out_h;
+
+  std::unique_ptr<RowSink> sink;
+  if (job.format == ImageFormat::kJpeg) {
+    sink = std::make_unique<JpegRowSink>(job.quality);
+  } else if (job.format == ImageFormat::kPng) {
+    sink = std::make_unique<PngRowSink>();
+  } else {
+    sink = std::make_unique<BufferRowSink>(job, cancel);
+  }
+  start = Clock::now();
+  if (!sink->Begin(out_w, out_h, source->channels())) {
+    if (error) *error = EncodeFailure(job.format);
+    return StreamResult::kFailed;
+  }
+  timings->encode_nanos = NanosSince(start);
+
+  RowResizer resizer(width, height, out_w, out_h, source->channels(),
+                     job.filter);
+  std::vector<uint8_t> row(static_cast<size_t>(width) * source->channels());
+  auto emit = [&sink, timings](const uint8_t* out_row) {
+    const auto write_start = Clock::now();
+    const bool written = sink->WriteRow(out_row);
+    timings->encode_nanos += NanosSince(write_start);
+    return written;
+  };
+  for (int y = 0; y < height; ++y) {
+    if (CheckCancelled(cancel, error)) {
+      return StreamResult::kFailed;
+    }
+    start = Clock::now();
+    if (!source->ReadRow(row.data())) {
+      if (error) *error = decode_failure;
+      return StreamResult::kFailed;
+    }
+    const auto push_start = Clock::now();
+    timings->decode_nanos +=
+        std::chrono::duration<double, std::nano>(push_start - start).count();
+    const double encode_before = timings->encode_nanos;
+    const bool pushed = resizer.Push(y, row.data(), emit);
+    timings->resize_nanos +=
+        NanosSince(push_start) - (timings->encode_nanos - encode_before);
+    if (!pushed) {
+      if (error) *error = EncodeFailure(job.format);
+      return StreamResult::kFailed;
+    }
+  }
+  source.reset();
+  if (!resizer.done()) {
+    if (error) *error = decode_failure;
+    return StreamResult::kFailed;
+  }
+  if (CheckCancelled(cancel, error)) {
+    return StreamResult::kFailed;
+  }
+  start = Clock::now();
+  if (!sink->Finish(out, error)) {
+    return StreamResult::kFailed;
+  }
+  timings->encode_nanos += NanosSince(start);
+  return StreamResult::kDone;
+}
+
+}  // namespace fic
@@ -0,0 +1,60 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_STREAM_COMPRESS_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_STREAM_COMPRESS_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "image_compress_core.h"
+
+namespace fic {
+
+// A compression StreamCompress runs: decode, resize and encode, with no
+// turn in between.
+struct StreamJob {
+  DecodeOptions decode;
+  // Output size; a size above the decoded one is clamped to it.
+  int target_width = 0;
+  int target_height = 0;
+  ResizeFilter filter = ResizeFilter::kBilinear;
+  ImageFormat format = ImageFormat::kJpeg;
+  int quality = 95;
+  EncodeOptions encode;
+};
+
+// Where a StreamCompress call spent its time, for the cost model.
+struct StreamTimings {
+  double decode_nanos = 0;
+  double resize_nanos = 0;
+  double encode_nanos = 0;
+  // Size the decoder produced and size that was encoded.
+  int decoded_width = 0;
+  int decoded_height = 0;
+  int output_width = 0;
+  int output_height = 0;
+};
+
+enum class StreamResult {
+  kDone,
+  // The input cannot be streamed; nothing was written to the output.
+  kUnsupported,
+  // Decoding or encoding failed, or the job was cancelled.
+  kFailed,
+};
+
+// Decodes |input|, resizes it and encodes it a few rows at a time, so the
+// decoded image is never held whole: besides the encoded output, only the
+// rows the resize is sampling stay in memory, plus the resized image for
+// WebP, whose encoder needs all of it. Takes JPEG and non-interlaced PNG
+// of up to 8 bits per channel without a gamma other than sRGB's, with no
+// crop or preview, and returns kUnsupported for anything else. The pixels
+// match DecodeImage, ResizeImage and EncodeImage run one after another,
+// except that an alpha channel stays even when every pixel is opaque.
+StreamResult StreamCompress(const std::vector<uint8_t>& input,
+                            const StreamJob& job, std::vector<uint8_t>* out,
+                            StreamTimings* timings, const CancelToken* cancel,
+                            std::string* error);
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_STREAM_COMPRESS_H_
@@ -0,0 +1,127 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "resource_limits.h"
+
+namespace fic {
+
+namespace {
+
+constexpr double kDefaultBackgroundShare = 0.5;
+
+}  // namespace
+
+WorkerPool::WorkerPool(size_t thread_count) {
+  SetMaxConcurrency(thread_count);
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkerPool::Submit(Priority priority, std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (priority == Priority::kBackground) {
+      background_queue_.push_back(std::move(task));
+    } else {
+      interactive_queue_.push_back(std::move(task));
+    }
+  }
+  cv_.notify_one();
+}
+
+void WorkerPool::SetMaxConcurrency(size_t max_concurrency) {
+  max_concurrency = std::max<size_t>(1, max_concurrency);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_concurrency_ = max_concurrency;
+    while (threads_.size() < max_concurrency_) {
+      threads_.emplace_back([this]() { WorkerLoop(); });
+    }
+  }
+  cv_.notify_all();
+}
+
+size_t WorkerPool::max_concurrency() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return max_concurrency_;
+}
+
+void WorkerPool::SetBackgroundShare(double share) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    background_share_ =
+        share > 0.0 ? std::min(share, 1.0) : kDefaultBackgroundShare;
+  }
+  cv_.notify_all();
+}
+
+double WorkerPool::background_share() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return background_share_;
+}
+
+size_t WorkerPool::BackgroundLimitLocked() const {
+  size_t limit = static_cast<size_t>(max_concurrency_ * background_share_);
+  return std::max<size_t>(1, std::min(limit, max_concurrency_));
+}
+
+bool WorkerPool::CanStartLocked() const {
+  if (running_ >= max_concurrency_) {
+    return false;
+  }
+  if (!interactive_queue_.empty()) {
+    return true;
+  }
+  return !background_queue_.empty() &&
+         background_running_ < BackgroundLimitLocked();
+}
+
+void WorkerPool::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait(lock, [this]() {
+      return (stopping_ && interactive_queue_.empty() &&
+              background_queue_.empty()) ||
+             CanStartLocked();
+    });
+    if (!CanStartLocked()) {
+      // Stopping; wake the idle workers that slept through the last task.
+      cv_.notify_all();
+      return;
+    }
+    const bool background = interactive_queue_.empty();
+    std::deque<std::function<void()>>& queue =
+        background ? background_queue_ : interactive_queue_;
+    std::function<void()> task = std::move(queue.front());
+    queue.pop_front();
+    ++running_;
+    if (background) {
+      ++background_running_;
+    }
+    lock.unlock();
+    task();
+    lock.lock();
+    --running_;
+    if (background) {
+      --background_running_;
+    }
+    cv_.notify_one();
+  }
+}
+
+size_t DefaultWorkerCount() {
+  return AvailableCpuCount();
+}
+
+}  // namespace fic
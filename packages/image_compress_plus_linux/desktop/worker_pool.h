@@ -0,0 +1,70 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_WORKER_POOL_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_WORKER_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fic {
+
+enum class Priority {
+  kInteractive = 0,
+  kBackground = 1,
+};
+
+// Pool of threads that runs compression jobs off the platform thread. Each
+// priority has its own FIFO lane: interactive tasks always start first, and
+// background tasks never hold more than background_share() of the slots, so
+// a late thumbnail does not wait behind a bulk re-encode. At most
+// max_concurrency() tasks run at a time; the destructor drains both lanes
+// before joining.
+class WorkerPool {
+ public:
+  explicit WorkerPool(size_t thread_count);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  void Submit(Priority priority, std::function<void()> task);
+
+  // Caps the number of tasks running at once, spawning threads if the pool
+  // is smaller than |max_concurrency|. Lowering the cap never interrupts
+  // running tasks.
+  void SetMaxConcurrency(size_t max_concurrency);
+  size_t max_concurrency() const;
+
+  // Fraction of max_concurrency() that background tasks may occupy, at most
+  // 1; values <= 0 restore the default of one half. Background work always
+  // keeps at least one slot.
+  void SetBackgroundShare(double share);
+  double background_share() const;
+
+ private:
+  void WorkerLoop();
+  size_t BackgroundLimitLocked() const;
+  bool CanStartLocked() const;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> interactive_queue_;
+  std::deque<std::function<void()>> background_queue_;
+  std::vector<std::thread> threads_;
+  size_t max_concurrency_ = 0;
+  double background_share_ = 0.5;
+  size_t running_ = 0;
+  size_t background_running_ = 0;
+  bool stopping_ = false;
+};
+
+// Number of workers to use when the caller has no preference: one per CPU
+// the process may use; see AvailableCpuCount().
+size_t DefaultWorkerCount();
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_WORKER_POOL_H_
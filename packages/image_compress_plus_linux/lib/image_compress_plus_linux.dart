@@ -65,6 +65,7 @@ class ImageCompressPlusLinux extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     if (numberOfRetries <= 0) {
       throw CompressError("numberOfRetries can't be null or less than 0");
@@ -86,9 +87,10 @@ class ImageCompressPlusLinux extends ImageCompressPlusPlatform {
       _convertTypeToInt(format),
       keepExif,
       inSampleSize,
-      numberOfRetries
+      numberOfRetries,
+      _options(options),
     ]);
-    return result;
+    return _unwrap(result, options.onDegradations);
   }
 
   @override
@@ -100,7 +102,8 @@ class ImageCompressPlusLinux extends ImageCompressPlusPlatform {
       int inSampleSize = 1,
       bool autoCorrectionAngle = true,
       CompressFormat format = CompressFormat.jpeg,
-      bool keepExif = false}) async {
+      bool keepExif = false,
+      CompressOptions options = const CompressOptions()}) async {
     if (image.isEmpty) {
       throw CompressError('The image is empty.');
     }
@@ -118,8 +121,9 @@ class ImageCompressPlusLinux extends ImageCompressPlusPlatform {
       _convertTypeToInt(format),
       keepExif,
       inSampleSize,
+      _options(options),
     ]);
-    return result;
+    return _unwrap(result, options.onDegradations);
   }
 
   @override
@@ -127,6 +131,83 @@ class ImageCompressPlusLinux extends ImageCompressPlusPlatform {
     await _channel.invokeMethod('showLog', value);
   }
 
+  /// Limits how many compressions the native worker pool runs at once.
+  ///
+  /// Defaults to the CPUs the process may use: the hardware threads,
+  /// narrowed by its CPU affinity and cgroup v2 CPU quota. Values `<= 0`
+  /// restore the default. While the cgroup (or the host) is under memory
+  /// pressure the workers in use are halved.
+  Future<void> setMaxConcurrency(int value) async {
+    await _channel.invokeMethod('setMaxConcurrency', value);
+  }
+
+  /// Limits background-priority jobs to [share] of the native workers, so
+  /// interactive jobs always find a free one.
+  ///
+  /// Defaults to `0.5`; values `<= 0` restore the default. Background jobs
+  /// always keep at least one worker.
+  Future<void> setBackgroundShare(double share) async {
+    await _channel.invokeMethod('setBackgroundShare', share);
+  }
+
+  /// Caps the memory, in bytes, that in-flight native jobs may use at once.
+  ///
+  /// Each job reserves its estimated peak (from the image header and the
+  /// requested size) before decoding and waits while the budget is
+  /// exhausted; a job larger than the whole budget runs alone. Defaults to
+  /// half the physical memory or of the cgroup v2 memory limit, whichever is
+  /// lower; values `<= 0` restore the default. The budget is halved while
+  /// under memory pressure.
+  Future<void> setMemoryBudget(int bytes) async {
+    await _channel.invokeMethod('setMemoryBudget', bytes);
+  }
+
+  /// Number of batch jobs currently in each native pipeline stage, summed
+  /// over all running batches: `reading`, `readQueue` (read, waiting for a
+  /// worker), `processing` and `writeQueue` (compressed, waiting for or
+  /// being written).
+  Future<Map<String, int>> getPipelineStats() async {
+    final Map<Object?, Object?>? result =
+        await _channel.invokeMethod('getPipelineStats');
+    return {
+      for (final entry in (result ?? const {}).entries)
+        entry.key as String: entry.value as int,
+    };
+  }
+
+  /// Reads the format, stored size and EXIF orientation of each of [paths]
+  /// from its header alone, without decoding it.
+  ///
+  /// Only a few KB of every file are read, on the native worker threads.
+  /// Results are returned in the same order as [paths]; a file that cannot
+  /// be read or recognised reports the code `probe_error`. [jobId] lets
+  /// [cancel] stop the call, which then throws a [PlatformException] with
+  /// code `cancelled`.
+  @override
+  Future<List<ImageProbeResult>> probe(
+    List<String> paths, {
+    String? jobId,
+    CompressPriority priority = CompressPriority.interactive,
+  }) async {
+    final List<Object?> result = await _channel.invokeMethod(
+      'probe',
+      [paths, _options(CompressOptions(jobId: jobId, priority: priority))],
+    );
+    return [
+      for (final entry in result)
+        ImageProbeResult.fromMap(entry as Map<Object?, Object?>),
+    ];
+  }
+
+  /// Cancels the queued and running calls that were given [jobId].
+  ///
+  /// Returns `false` when no such call is pending.
+  @override
+  Future<bool> cancel(String jobId) async {
+    final bool? result = await _channel.invokeMethod('cancel', jobId);
+    return result ?? false;
+  }
+
   @override
   void ignoreCheckSupportPlatform(bool value) {
     _validator.ignoreCheckSupportPlatform = value;
@@ -145,6 +226,7 @@ class ImageCompressPlusLinux extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     if (numberOfRetries <= 0) {
       throw CompressError("numberOfRetries can't be null or less than 0");
@@ -160,7 +242,7 @@ class ImageCompressPlusLinux extends ImageCompressPlusPlatform {
     if (!support) {
       return null;
     }
-    final String? result = await _channel.invokeMethod(
+    final Object? response = await _channel.invokeMethod(
       'compressWithFileAndGetFile',
       [
         path,
@@ -174,14 +256,93 @@ class ImageCompressPlusLinux extends ImageCompressPlusPlatform {
         keepExif,
         inSampleSize,
         numberOfRetries,
+        _options(options),
       ],
     );
+    final String? result = _unwrap(response, options.onDegradations);
     if (result == null) {
       return null;
     }
     return XFile(result);
   }
 
+  /// [jobId], when given, lets [cancel] stop the whole batch; jobs that had
+  /// not finished report the code `cancelled`. [priority] picks the native
+  /// queue lane for every job of the batch.
+  ///
+  /// Files are read and written on dedicated native threads while the
+  /// workers compress. [readAhead] caps the jobs read ahead of the workers
+  /// and [writeBehind] the compressed jobs waiting to be written; `0` keeps
+  /// the default of 2. See [getPipelineStats].
+  @override
+  Future<List<CompressBatchResult>> compressBatch(
+    List<CompressBatchJob> jobs, {
+    int maxParallel = 0,
+    String? jobId,
+    CompressPriority priority = CompressPriority.interactive,
+    int readAhead = 0,
+    int writeBehind = 0,
+  }) async {
+    for (final job in jobs) {
+      if (job.path == job.targetPath) {
+        throw CompressError('Target path and source path cannot be the same.');
+      }
+      _validator.checkFileNameAndFormat(job.targetPath, job.format);
+    }
+    final List<Object?> result = await _channel.invokeMethod(
+      'compressBatch',
+      [
+        [
+          for (final job in jobs)
+            [
+              job.path,
+              job.minWidth,
+              job.minHeight,
+              job.quality,
+              job.targetPath,
+              job.rotate,
+              job.autoCorrectionAngle,
+              _convertTypeToInt(job.format),
+              job.keepExif,
+              job.inSampleSize,
+            ],
+        ],
+        maxParallel,
+        {
+          ..._options(CompressOptions(jobId: jobId, priority: priority)),
+          'readAhead': readAhead,
+          'writeBehind': writeBehind,
+        },
+      ],
+    );
+    return [
+      for (final entry in result)
+        CompressBatchResult.fromMap(entry as Map<Object?, Object?>),
+    ];
+  }
+
+  /// Trailing options map understood by the native side.
+  Map<String, Object?> _options(CompressOptions options) {
+    return {
+      if (options.jobId != null) 'jobId': options.jobId,
+      'priority': options.priority.index,
+      if (options.deadlineMs > 0) 'deadlineMs': options.deadlineMs,
+      if (options.crop != null) 'crop': options.crop!.toList(),
+      if (options.preview) 'preview': true,
+    };
+  }
+
+  /// Calls with a deadline answer `{result, degradations}`.
+  T _unwrap<T>(Object? response,
+      void Function(List<String> degradations)? onDegradations) {
+    if (response is Map) {
+      onDegradations?.call(
+          (response['degradations'] as List<Object?>).cast<String>());
+      return response['result'] as T;
+    }
+    return response as T;
+  }
+
   int _convertTypeToInt(CompressFormat format) {
     switch (format) {
       case CompressFormat.jpeg:
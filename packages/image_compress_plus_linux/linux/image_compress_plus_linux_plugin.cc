@@ -2,20 +2,106 @@
 
 #include <flutter_linux/flutter_linux.h>
 #include <gtk/gtk.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstring>
+#include <filesystem>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include "../desktop/batch_pipeline.h"
+#include "../desktop/cost_model.h"
 #include "../desktop/image_compress_core.h"
 #include "../desktop/exif_utils.h"
+#include "../desktop/job_registry.h"
+#include "../desktop/memory_budget.h"
+#include "../desktop/memory_pressure.h"
+#include "../desktop/resource_limits.h"
+#include "../desktop/single_flight.h"
+#include "../desktop/stream_compress.h"
+#include "../desktop/task_scheduler.h"
+#include "../desktop/worker_pool.h"
 
 namespace {
 
 constexpr char kChannelName[] = "image_compress_plus";
+constexpr char kCancelledCode[] = "cancelled";
+constexpr char kCropOutsideError[] = "Crop rectangle is outside the image";
+// Largest output side CompressBytes looks for an EXIF thumbnail for. An
+// APP1 segment holds at most 64 KB, so thumbnails stay well below it.
+constexpr int kMaxThumbnailTarget = 640;
+
+struct Runtime;
+static void OnMemoryPressure(Runtime* runtime, bool under_pressure);
+
+// Native state shared by every call to one plugin instance.
+struct Runtime {
+  Runtime()
+      : max_concurrency(fic::DefaultWorkerCount()),
+        memory_budget(fic::DefaultMemoryBudget()),
+        budget(memory_budget),
+        pool(max_concurrency),
+        batches(&pool),
+        pressure([this](bool under) { OnMemoryPressure(this, under); }) {}
+
+  // Limits the app asked for; see ApplyLimitsLocked().
+  std::mutex limits_mutex;
+  size_t max_concurrency;
+  uint64_t memory_budget;
+  bool under_pressure = false;
+  fic::JobRegistry jobs;
+  fic::MemoryBudget budget;
+  // In-flight calls by output identity; see RunInBackground().
+  fic::SingleFlight<FlMethodResponse*> flights;
+  // Destroyed in reverse: running batches finish, then queued jobs drain,
+  // before the rest goes away.
+  fic::WorkerPool pool;
+  fic::BatchPipeline batches;
+  // Last, so that it stops before what it adjusts goes away.
+  fic::MemoryPressureMonitor pressure;
+};
+
+// Sets the pool and budget to the app's limits, halved while the host is
+// under memory pressure: fewer images decoded at once stall less and leave
+// the kernel something to reclaim. The pixel kernels then fan out to half
+// the CPUs as well.
+static void ApplyLimitsLocked(Runtime* runtime) {
+  size_t max_concurrency = runtime->max_concurrency;
+  uint64_t memory_budget = runtime->memory_budget;
+  size_t kernel_threads = fic::AvailableCpuCount();
+  if (runtime->under_pressure) {
+    max_concurrency = std::max<size_t>(1, max_concurrency / 2);
+    memory_budget /= 2;
+    kernel_threads = std::max<size_t>(1, kernel_threads / 2);
+  }
+  runtime->pool.SetMaxConcurrency(max_concurrency);
+  runtime->budget.SetLimit(memory_budget);
+  fic::TaskScheduler::Instance().SetMaxConcurrency(kernel_threads);
+}
+
+static void OnMemoryPressure(Runtime* runtime, bool under_pressure) {
+  {
+    std::lock_guard<std::mutex> lock(runtime->limits_mutex);
+    runtime->under_pressure = under_pressure;
+    ApplyLimitsLocked(runtime);
+  }
+#ifdef __GLIBC__
+  // Hand the pages of buffers freed by finished jobs back to the kernel
+  // instead of keeping them in the malloc arenas.
+  if (under_pressure) {
+    malloc_trim(0);
+  }
+#endif
+}
 
 struct CompressParams {
   int min_width = 1920;
@@ -27,6 +113,21 @@ struct CompressParams {
   bool keep_exif = false;
   int in_sample = 1;
   std::string target_path;
+  std::string job_id;
+  fic::Priority priority = fic::Priority::kInteractive;
+  // With a deadline, CompressBytes trades quality for speed to finish by
+  // |deadline|, |deadline_ms| after the call arrived.
+  int deadline_ms = 0;
+  std::chrono::steady_clock::time_point deadline;
+  // Compress only this rectangle of the image as auto_correction orients
+  // it, before rotate; a width of 0 takes all of it.
+  int crop_x = 0;
+  int crop_y = 0;
+  int crop_width = 0;
+  int crop_height = 0;
+  // Decode progressive JPEGs and interlaced PNGs from their first scans or
+  // passes when those cover the output; see fic::DecodeOptions::preview.
+  bool preview = false;
 };
 
 static bool GetInt(FlValue* value, int* out) {
@@ -45,6 +146,26 @@ static bool GetBool(FlValue* value, bool* out) {
   return true;
 }
 
+static bool GetInt64(FlValue* value, int64_t* out) {
+  if (fl_value_get_type(value) != FL_VALUE_TYPE_INT) {
+    return false;
+  }
+  *out = fl_value_get_int(value);
+  return true;
+}
+
+static bool GetDouble(FlValue* value, double* out) {
+  if (fl_value_get_type(value) == FL_VALUE_TYPE_INT) {
+    *out = static_cast<double>(fl_value_get_int(value));
+    return true;
+  }
+  if (fl_value_get_type(value) != FL_VALUE_TYPE_FLOAT) {
+    return false;
+  }
+  *out = fl_value_get_float(value);
+  return true;
+}
+
 static bool GetString(FlValue* value, std::string* out) {
   if (fl_value_get_type(value) != FL_VALUE_TYPE_STRING) {
     return false;
@@ -77,34 +198,45 @@ static std::string MakeTempPath(const std::string& ext) {
   return out;
 }
 
-static fic::ImageBuffer ApplyOrientation(const fic::ImageBuffer& src,
-                                         int orientation) {
-  switch (orientation) {
-    case 2: {
-      return fic::FlipHorizontal(src);
-    }
-    case 3: {
-      return fic::RotateImage(src, 180);
-    }
-    case 4: {
-      return fic::FlipVertical(src);
-    }
-    case 5: {
-      fic::ImageBuffer flipped = fic::FlipHorizontal(src);
-      return fic::RotateImage(flipped, 90);
-    }
-    case 6: {
-      return fic::RotateImage(src, 90);
-    }
-    case 7: {
-      fic::ImageBuffer flipped = fic::FlipHorizontal(src);
-      return fic::RotateImage(flipped, 270);
-    }
-    case 8: {
-      return fic::RotateImage(src, 270);
-    }
-    default:
-      return src;
+// Reads the optional trailing options map, {jobId, priority, deadlineMs},
+// that follows the positional arguments.
+static void ParseOptions(FlValue* args, CompressParams* params) {
+  if (!args || fl_value_get_type(args) != FL_VALUE_TYPE_LIST ||
+      fl_value_get_length(args) == 0) {
+    return;
+  }
+  FlValue* options =
+      fl_value_get_list_value(args, fl_value_get_length(args) - 1);
+  if (fl_value_get_type(options) != FL_VALUE_TYPE_MAP) {
+    return;
+  }
+  FlValue* job_id = fl_value_lookup_string(options, "jobId");
+  if (job_id) {
+    GetString(job_id, &params->job_id);
+  }
+  FlValue* priority = fl_value_lookup_string(options, "priority");
+  int priority_value = 0;
+  if (priority && GetInt(priority, &priority_value)) {
+    params->priority = priority_value == 1 ? fic::Priority::kBackground
+                                           : fic::Priority::kInteractive;
+  }
+  FlValue* deadline = fl_value_lookup_string(options, "deadlineMs");
+  if (deadline && GetInt(deadline, &params->deadline_ms) &&
+      params->deadline_ms > 0) {
+    params->deadline = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(params->deadline_ms);
+  }
+  FlValue* crop = fl_value_lookup_string(options, "crop");
+  if (crop && fl_value_get_type(crop) == FL_VALUE_TYPE_LIST &&
+      fl_value_get_length(crop) == 4) {
+    GetInt(fl_value_get_list_value(crop, 0), &params->crop_x);
+    GetInt(fl_value_get_list_value(crop, 1), &params->crop_y);
+    GetInt(fl_value_get_list_value(crop, 2), &params->crop_width);
+    GetInt(fl_value_get_list_value(crop, 3), &params->crop_height);
+  }
+  FlValue* preview = fl_value_lookup_string(options, "preview");
+  if (preview) {
+    GetBool(preview, &params->preview);
   }
 }
 
@@ -176,87 +308,692 @@ static bool ParseFileArgs(FlValue* args, std::string* path,
   return true;
 }
 
+static double NanosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// |params|.crop clipped to the image of |info| once it is turned by
+// |orientation|. Returns false when the crop misses the image.
+static bool OrientedCrop(const fic::ImageInfo& info, int orientation,
+                         const CompressParams& params, int* x, int* y,
+                         int* w, int* h) {
+  const bool transposed = orientation >= 5 && orientation <= 8;
+  *x = params.crop_x;
+  *y = params.crop_y;
+  *w = params.crop_width;
+  *h = params.crop_height;
+  return fic::ClipRect(transposed ? info.height : info.width,
+                       transposed ? info.width : info.height, x, y, w, h);
+}
+
+// Points |options| at the rectangle of the stored image that OrientImage
+// turns into |params|.crop. Returns false when the crop misses the image.
+static bool StoredCrop(const fic::ImageInfo& info, int orientation,
+                       const CompressParams& params,
+                       fic::DecodeOptions* options) {
+  int x = 0;
+  int y = 0;
+  int w = 0;
+  int h = 0;
+  if (!OrientedCrop(info, orientation, params, &x, &y, &w, &h)) {
+    return false;
+  }
+  // Stored position of the crop's top-left corner; orientations 5 to 8
+  // also swap its width and height.
+  int stored_x = x;
+  int stored_y = y;
+  switch (orientation) {
+    case 2:
+      stored_x = info.width - x - w;
+      break;
+    case 3:
+      stored_x = info.width - x - w;
+      stored_y = info.height - y - h;
+      break;
+    case 4:
+      stored_y = info.height - y - h;
+      break;
+    case 5:
+      stored_x = info.width - y - h;
+      stored_y = info.height - x - w;
+      break;
+    case 6:
+      stored_x = y;
+      stored_y = info.height - x - w;
+      break;
+    case 7:
+      stored_x = y;
+      stored_y = x;
+      break;
+    case 8:
+      stored_x = info.width - y - h;
+      stored_y = x;
+      break;
+    default:
+      break;
+  }
+  const bool transposed = orientation >= 5 && orientation <= 8;
+  options->crop_x = stored_x;
+  options->crop_y = stored_y;
+  options->crop_width = transposed ? h : w;
+  options->crop_height = transposed ? w : h;
+  return true;
+}
+
+// Size of the image of |info| once CompressBytes has applied |orientation|,
+// |params|.crop and |params|.rotate.
+static void OrientedSize(const fic::ImageInfo& info, int orientation,
+                         const CompressParams& params, int* width,
+                         int* height) {
+  const bool transposed = orientation >= 5 && orientation <= 8;
+  double w = transposed ? info.height : info.width;
+  double h = transposed ? info.width : info.height;
+  int crop_x = 0;
+  int crop_y = 0;
+  int crop_w = 0;
+  int crop_h = 0;
+  if (params.crop_width > 0 &&
+      OrientedCrop(info, orientation, params, &crop_x, &crop_y, &crop_w,
+                   &crop_h)) {
+    w = crop_w;
+    h = crop_h;
+  }
+  int angle = params.rotate % 360;
+  if (angle < 0) angle += 360;
+  if (angle == 90 || angle == 270) {
+    std::swap(w, h);
+  } else if (angle % 90 != 0) {
+    // RotateImage grows the canvas to the rotated bounding box.
+    const double rad = angle * std::acos(-1.0) / 180.0;
+    const double rotated_w =
+        std::abs(w * std::cos(rad)) + std::abs(h * std::sin(rad));
+    h = std::abs(w * std::sin(rad)) + std::abs(h * std::cos(rad));
+    w = rotated_w;
+  }
+  *width = static_cast<int>(std::ceil(w));
+  *height = static_cast<int>(std::ceil(h));
+}
+
+// Size CompressBytes resizes the image of |info| to once it is oriented.
+static void TargetSize(const fic::ImageInfo& info, int orientation,
+                       const CompressParams& params, int* target_w,
+                       int* target_h) {
+  int width = 0;
+  int height = 0;
+  OrientedSize(info, orientation, params, &width, &height);
+  fic::CalcTargetSize(width, height, params.min_width, params.min_height,
+                      params.in_sample, target_w, target_h);
+}
+
+// libwebp scales to an exact size before the image is turned, so the
+// target goes back to stored orientation. Other angles than right ones
+// resize after rotating instead.
+static void PickWebpScale(int orientation, const CompressParams& params,
+                          int target_w, int target_h,
+                          fic::DecodeOptions* options) {
+  int angle = params.rotate % 360;
+  if (angle < 0) angle += 360;
+  if (angle % 90 != 0) {
+    return;
+  }
+  const bool transposed = (orientation >= 5 && orientation <= 8) !=
+                          (angle == 90 || angle == 270);
+  options->scaled_width = transposed ? target_h : target_w;
+  options->scaled_height = transposed ? target_w : target_h;
+}
+
+// Lets the decoder crop and shrink the image while it decodes, so a large
+// photo headed for a small output is never decoded in full: libjpeg to the
+// smallest DCT scale that still covers the target, libwebp to the target
+// itself, and a preview of an interlaced PNG to the fewest Adam7 passes
+// that do. The orientation comes from the image header, ahead of the full
+// EXIF read.
+static fic::DecodeOptions PickDecodeOptions(const fic::ImageInfo& info,
+                                            const CompressParams& params) {
+  fic::DecodeOptions options;
+  if (info.width <= 0 || info.height <= 0) {
+    return options;
+  }
+  const int orientation = params.auto_correction ? info.orientation : 1;
+  int width = 0;
+  int height = 0;
+  int target_w = 0;
+  int target_h = 0;
+  OrientedSize(info, orientation, params, &width, &height);
+  TargetSize(info, orientation, params, &target_w, &target_h);
+  if (params.crop_width > 0) {
+    StoredCrop(info, orientation, params, &options);
+  }
+  if (info.format == fic::ImageFormat::kJpeg) {
+    fic::PickJpegScale(width, height, target_w, target_h, &options);
+  } else if (info.format == fic::ImageFormat::kWebp) {
+    PickWebpScale(orientation, params, target_w, target_h, &options);
+  } else if (info.format == fic::ImageFormat::kPng && params.preview &&
+             info.progressive && params.crop_width <= 0) {
+    fic::PickPngPreviewScale(width, height, target_w, target_h, &options);
+  }
+  options.preview = params.preview && info.progressive;
+  return options;
+}
+
+// Settings that make CompressBytes finish by |params|.deadline on the
+// estimates of |model|.
+static fic::DeadlinePlan PlanCompress(const fic::ImageInfo& info,
+                                      const CompressParams& params,
+                                      const fic::CostModel& model) {
+  fic::DeadlineJob job;
+  job.input_format = info.format;
+  const int orientation = params.auto_correction ? info.orientation : 1;
+  OrientedSize(info, orientation, params, &job.width, &job.height);
+  TargetSize(info, orientation, params, &job.target_width,
+             &job.target_height);
+  job.transform = orientation > 1 || params.rotate != 0;
+  job.scaled_decode = PickDecodeOptions(info, params).scaled_width > 0;
+  job.output_format = static_cast<fic::ImageFormat>(params.format);
+  job.quality = params.quality;
+  double budget_ms = std::chrono::duration<double, std::milli>(
+                         params.deadline - std::chrono::steady_clock::now())
+                         .count();
+  return fic::PlanForDeadline(job, budget_ms, model);
+}
+
+// Whether CompressBytes can hand the image of |info| to StreamCompress: a
+// JPEG or PNG that is not turned, cropped or previewed, going by the
+// orientation in its header. A cropped image is decoded no larger than the
+// crop anyway, and a JPEG DecodeImage splits into bands finishes sooner
+// buffered than streamed through one thread.
+static bool CanStream(const fic::ImageInfo& info,
+                      const CompressParams& params) {
+  if (info.width <= 0 || info.height <= 0 || params.rotate != 0 ||
+      params.crop_width > 0 || (params.preview && info.progressive) ||
+      params.format == static_cast<int>(fic::ImageFormat::kHeic)) {
+    return false;
+  }
+  if (params.auto_correction && info.orientation > 1) {
+    return false;
+  }
+  if (fic::JpegDecodesInBands(info)) {
+    return false;
+  }
+  return info.format == fic::ImageFormat::kJpeg ||
+         info.format == fic::ImageFormat::kPng;
+}
+
+// Feeds the stages of a streamed |job| to |model| as if they had run one
+// after another.
+static void RecordStreamTimings(const fic::ImageInfo& info,
+                                const fic::StreamJob& job,
+                                const fic::StreamTimings& timings,
+                                fic::CostModel* model) {
+  model->Record(fic::CostStage::kDecode, info.format,
+                info.format == fic::ImageFormat::kJpeg
+                    ? fic::DecodeVariant(job.decode)
+                    : 0,
+                fic::DecodeWorkUnits(info.format, info.width, info.height,
+                                     job.decode),
+                timings.decode_nanos);
+  const double pixels =
+      static_cast<double>(timings.output_width) * timings.output_height;
+  if (timings.output_width != timings.decoded_width ||
+      timings.output_height != timings.decoded_height) {
+    model->Record(fic::CostStage::kResize, fic::ImageFormat::kUnknown,
+                  static_cast<int>(job.filter), pixels,
+                  timings.resize_nanos);
+  }
+  model->Record(fic::CostStage::kEncode, job.format,
+                job.format == fic::ImageFormat::kWebp
+                    ? job.encode.webp_method
+                    : 0,
+                pixels, timings.encode_nanos);
+}
+
+// Reads the metadata of |input|, or of |src_path| when given. Returns
+// whether there was any; a file without metadata is not an error.
+static bool ReadExif(const std::vector<uint8_t>& input,
+                     const std::string& src_path, fic::ExifPack* exif) {
+  std::string ignored;
+  return src_path.empty() ? fic::ReadExifFromBytes(input, exif, &ignored)
+                          : fic::ReadExifFromFile(src_path, exif, &ignored);
+}
+
+// Whether the target of the JPEG of |info| is small enough that its EXIF
+// thumbnail may cover it; the metadata is then read before the decode.
+static bool MayUseThumbnail(const fic::ImageInfo& info,
+                            const CompressParams& params) {
+  if (info.format != fic::ImageFormat::kJpeg || info.width <= 0 ||
+      info.height <= 0 || params.crop_width > 0) {
+    return false;
+  }
+  const int orientation = params.auto_correction ? info.orientation : 1;
+  int target_w = 0;
+  int target_h = 0;
+  TargetSize(info, orientation, params, &target_w, &target_h);
+  return std::max(target_w, target_h) <= kMaxThumbnailTarget;
+}
+
+// Takes the JPEG thumbnail in |exif| into |thumbnail|, and its header into
+// |thumb|, when it can stand in for the image of |info|: the same aspect
+// ratio within a pixel, so not a letterboxed one, and at least the target
+// size once turned to |orientation|, the one |exif| gives. Sets |options|
+// to decode it for that target.
+static bool PickThumbnail(const fic::ImageInfo& info, int orientation,
+                          const CompressParams& params,
+                          const fic::ExifPack& exif,
+                          std::vector<uint8_t>* thumbnail,
+                          fic::ImageInfo* thumb,
+                          fic::DecodeOptions* options) {
+  if (!fic::ReadExifThumbnail(exif, thumbnail) ||
+      !fic::ReadImageInfo(*thumbnail, thumb, nullptr) ||
+      thumb->format != fic::ImageFormat::kJpeg) {
+    thumbnail->clear();
+    return false;
+  }
+  const int64_t skew = static_cast<int64_t>(thumb->width) * info.height -
+                       static_cast<int64_t>(thumb->height) * info.width;
+  int width = 0;
+  int height = 0;
+  int target_w = 0;
+  int target_h = 0;
+  OrientedSize(*thumb, orientation, params, &width, &height);
+  TargetSize(info, orientation, params, &target_w, &target_h);
+  if (std::abs(skew) > std::max(info.width, info.height) ||
+      target_w > width || target_h > height) {
+    thumbnail->clear();
+    return false;
+  }
+  *options = fic::DecodeOptions();
+  fic::PickJpegScale(width, height, target_w, target_h, options);
+  return true;
+}
+
+// With keep_exif, writes |exif| into the encoded |output|.
+static bool WriteBackExif(const CompressParams& params, bool has_exif,
+                          fic::ExifPack* exif, std::vector<uint8_t>* output,
+                          std::string* error) {
+  if (!params.keep_exif || !has_exif || exif->empty()) {
+    return true;
+  }
+  if (params.auto_correction || params.rotate != 0) {
+    fic::NormalizeOrientation(exif);
+  }
+  std::string ext = "jpg";
+  if (params.format == static_cast<int>(fic::ImageFormat::kPng)) {
+    ext = "png";
+  } else if (params.format == static_cast<int>(fic::ImageFormat::kWebp)) {
+    ext = "webp";
+  }
+  std::string temp_path = MakeTempPath(ext);
+  if (!fic::WriteBytesToFile(temp_path, *output, error)) {
+    return false;
+  }
+  if (!fic::ApplyExifToFile(temp_path, *exif, error)) {
+    g_remove(temp_path.c_str());
+    return true;
+  }
+  std::vector<uint8_t> final_bytes;
+  if (!fic::ReadFileToBytes(temp_path, &final_bytes, error)) {
+    return false;
+  }
+  g_remove(temp_path.c_str());
+  *output = std::move(final_bytes);
+  return true;
+}
+
+// |degradations|, if not null, receives what a deadline made CompressBytes
+// give up. Every stage's timing feeds the cost model deadlines are planned
+// with.
 static bool CompressBytes(const std::vector<uint8_t>& input,
                           const std::string& src_path,
                           const CompressParams& params,
+                          const fic::CancelToken* cancel,
                           std::vector<uint8_t>* output,
+                          std::vector<std::string>* degradations,
                           std::string* error) {
+  if (fic::CheckCancelled(cancel, error)) {
+    return false;
+  }
+  // Metadata parsing only reads the input, so it runs beside the pixel
+  // decode and the two are joined before the orientation is applied. Until
+  // then the decode scale and a deadline plan use the orientation found in
+  // the JPEG header.
+  const bool read_exif = params.keep_exif || params.auto_correction;
   fic::ExifPack exif;
   bool has_exif = false;
-  if (params.keep_exif || params.auto_correction) {
-    if (!src_path.empty()) {
-      has_exif = fic::ReadExifFromFile(src_path, &exif, error);
-    } else {
-      has_exif = fic::ReadExifFromBytes(input, &exif, error);
+
+  fic::CostModel& model = fic::CostModel::Instance();
+  fic::ImageInfo info;
+  fic::ReadImageInfo(input, &info, nullptr);
+  const int header_orientation = params.auto_correction ? info.orientation : 1;
+  fic::DecodeOptions crop_check;
+  if (params.crop_width > 0 && info.width > 0 && info.height > 0 &&
+      !StoredCrop(info, header_orientation, params, &crop_check)) {
+    if (error) *error = kCropOutsideError;
+    return false;
+  }
+  // A small target is made from the EXIF thumbnail when it covers it, which
+  // takes the metadata read ahead of the decode.
+  bool exif_read = false;
+  std::vector<uint8_t> thumbnail;
+  fic::ImageInfo thumbnail_info;
+  fic::DecodeOptions decode_options;
+  if (MayUseThumbnail(info, params)) {
+    has_exif = ReadExif(input, src_path, &exif);
+    exif_read = true;
+  }
+  // The thumbnail is turned by the orientation in the metadata, which
+  // may not be the one the header showed.
+  const bool use_thumbnail =
+      has_exif &&
+      PickThumbnail(info,
+                    params.auto_correction ? fic::OrientationFromExif(exif)
+                                           : 1,
+                    params, exif, &thumbnail, &thumbnail_info,
+                    &decode_options);
+  const std::vector<uint8_t>& source = use_thumbnail ? thumbnail : input;
+  if (!use_thumbnail) {
+    decode_options = PickDecodeOptions(info, params);
+  }
+  fic::ResizeFilter resize_filter = fic::ResizeFilter::kBilinear;
+  fic::EncodeOptions encode_options;
+  bool planned_scale = false;
+  if (params.deadline_ms > 0 && info.width > 0 && info.height > 0) {
+    fic::DeadlinePlan plan = PlanCompress(info, params, model);
+    // The plan only tunes JPEG decoding, of the image itself.
+    if (info.format == fic::ImageFormat::kJpeg && !use_thumbnail) {
+      plan.decode.crop_x = decode_options.crop_x;
+      plan.decode.crop_y = decode_options.crop_y;
+      plan.decode.crop_width = decode_options.crop_width;
+      plan.decode.crop_height = decode_options.crop_height;
+      plan.decode.preview = decode_options.preview;
+      decode_options = plan.decode;
+      planned_scale =
+          std::find(plan.degradations.begin(), plan.degradations.end(),
+                    "jpegScale") != plan.degradations.end();
     }
+    resize_filter = plan.resize;
+    encode_options = plan.encode;
+    if (degradations) *degradations = plan.degradations;
   }
 
+  // An image that is not turned goes through in rows and is never held
+  // whole; anything StreamCompress declines is decoded in full below.
+  bool try_stream = !use_thumbnail && CanStream(info, params);
+  fic::StreamJob stream_job;
+  if (try_stream) {
+    stream_job.decode = decode_options;
+    TargetSize(info, 1, params, &stream_job.target_width,
+               &stream_job.target_height);
+    stream_job.filter = resize_filter;
+    stream_job.format = static_cast<fic::ImageFormat>(params.format);
+    stream_job.quality = params.quality;
+    stream_job.encode = encode_options;
+  }
+  fic::StreamResult streamed = fic::StreamResult::kUnsupported;
+  fic::StreamTimings stream_timings;
+
   fic::ImageBuffer image;
   fic::ImageFormat detected = fic::ImageFormat::kUnknown;
-  if (!fic::DecodeImage(input, &image, &detected, error)) {
+  auto stage_start = std::chrono::steady_clock::now();
+  double decode_nanos = 0;
+  bool decoded = false;
+  auto decode = [&]() {
+    if (try_stream) {
+      streamed = fic::StreamCompress(input, stream_job, output,
+                                     &stream_timings, cancel, error);
+      if (streamed != fic::StreamResult::kUnsupported) {
+        return;
+      }
+      stage_start = std::chrono::steady_clock::now();
+    }
+    decoded = fic::DecodeImage(source, decode_options, &image, &detected,
+                               cancel, error);
+    decode_nanos = NanosSince(stage_start);
+  };
+  if (read_exif && !exif_read) {
+    // The calling thread takes the decode; a scheduler thread steals the
+    // metadata read, or the caller runs it afterwards if none is free.
+    fic::TaskScheduler::Instance().ParallelFor(
+        2, 1, [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i) {
+            if (i == 0) {
+              decode();
+            } else {
+              has_exif = ReadExif(input, src_path, &exif);
+            }
+          }
+        });
+  } else {
+    decode();
+  }
+  if (streamed == fic::StreamResult::kFailed) {
     return false;
   }
-
-  if (params.auto_correction && has_exif) {
-    int orientation = fic::OrientationFromExif(exif);
-    image = ApplyOrientation(image, orientation);
+  const int orientation = params.auto_correction && has_exif
+                              ? fic::OrientationFromExif(exif)
+                              : 1;
+  // The decoder was given the crop and scale as the header orients the
+  // image. When the EXIF read disagrees, they are picked again for the
+  // target it turns to, keeping a scale the deadline plan lowered, and the
+  // image is decoded again if they changed.
+  bool redecode = false;
+  if (!use_thumbnail && orientation != header_orientation &&
+      info.width > 0 && info.height > 0) {
+    fic::ImageInfo exif_info = info;
+    exif_info.orientation = orientation;
+    if (params.crop_width > 0 &&
+        !StoredCrop(exif_info, orientation, params, &crop_check)) {
+      if (error) *error = kCropOutsideError;
+      return false;
+    }
+    const fic::DecodeOptions picked = PickDecodeOptions(exif_info, params);
+    if (!planned_scale) {
+      redecode = picked.scale_num * decode_options.scale_denom !=
+                 decode_options.scale_num * picked.scale_denom;
+      decode_options.scale_num = picked.scale_num;
+      decode_options.scale_denom = picked.scale_denom;
+    }
+    redecode = redecode ||
+               picked.scaled_width != decode_options.scaled_width ||
+               picked.scaled_height != decode_options.scaled_height ||
+               picked.crop_x != decode_options.crop_x ||
+               picked.crop_y != decode_options.crop_y ||
+               picked.crop_width != decode_options.crop_width ||
+               picked.crop_height != decode_options.crop_height;
+    decode_options.scaled_width = picked.scaled_width;
+    decode_options.scaled_height = picked.scaled_height;
+    decode_options.crop_x = picked.crop_x;
+    decode_options.crop_y = picked.crop_y;
+    decode_options.crop_width = picked.crop_width;
+    decode_options.crop_height = picked.crop_height;
   }
+  if (streamed == fic::StreamResult::kDone) {
+    if (orientation == 1) {
+      RecordStreamTimings(info, stream_job, stream_timings, &model);
+      return WriteBackExif(params, has_exif, &exif, output, error);
+    }
+    // The full metadata read found an orientation the header did not show.
+    output->clear();
+    try_stream = false;
+    stage_start = std::chrono::steady_clock::now();
+    decode();
+  } else if (decoded && redecode) {
+    stage_start = std::chrono::steady_clock::now();
+    decode();
+  }
+  if (decoded && params.crop_width > 0 && decode_options.crop_width <= 0) {
+    // The header could not be read, so the whole image was decoded and is
+    // cropped here.
+    fic::ImageInfo decoded_info = info;
+    if (info.width <= 0 || info.height <= 0) {
+      decoded_info.width = image.width;
+      decoded_info.height = image.height;
+    }
+    fic::DecodeOptions crop;
+    if (!StoredCrop(decoded_info, orientation, params, &crop)) {
+      if (error) *error = kCropOutsideError;
+      return false;
+    }
+    image = fic::CropImage(std::move(image), crop.crop_x, crop.crop_y,
+                           crop.crop_width, crop.crop_height);
+  }
+  if (!decoded) {
+    return false;
+  }
+  int decoded_w = info.width > 0 ? info.width : image.width;
+  int decoded_h = info.height > 0 ? info.height : image.height;
+  if (use_thumbnail) {
+    decoded_w = thumbnail_info.width;
+    decoded_h = thumbnail_info.height;
+  }
+  if (decode_options.crop_width > 0) {
+    decoded_w = decode_options.crop_width;
+    decoded_h = decode_options.crop_height;
+  }
+  model.Record(fic::CostStage::kDecode, detected,
+               detected == fic::ImageFormat::kJpeg || decode_options.preview
+                   ? fic::DecodeVariant(decode_options)
+                   : 0,
+               fic::DecodeWorkUnits(detected, decoded_w, decoded_h,
+                                    decode_options),
+               decode_nanos);
 
-  if (params.rotate != 0) {
-    image = fic::RotateImage(image, params.rotate);
+  if (orientation > 1 || params.rotate != 0) {
+    stage_start = std::chrono::steady_clock::now();
+    const double pixels = static_cast<double>(image.width) * image.height;
+    if (orientation > 1) {
+      image = fic::OrientImage(std::move(image), orientation);
+    }
+    if (params.rotate != 0) {
+      image = fic::RotateImage(std::move(image), params.rotate);
+    }
+    model.Record(fic::CostStage::kTransform, fic::ImageFormat::kUnknown, 0,
+                 pixels, NanosSince(stage_start));
+  }
+  if (fic::CheckCancelled(cancel, error)) {
+    return false;
   }
 
+  // The target is relative to the full-size image; a DCT-scaled decode is
+  // never scaled back up.
   int target_w = image.width;
   int target_h = image.height;
-  fic::CalcTargetSize(image.width, image.height, params.min_width,
-                      params.min_height, params.in_sample, &target_w,
-                      &target_h);
+  if (info.width > 0 && info.height > 0) {
+    TargetSize(info, orientation, params, &target_w, &target_h);
+  } else {
+    fic::CalcTargetSize(image.width, image.height, params.min_width,
+                        params.min_height, params.in_sample, &target_w,
+                        &target_h);
+  }
+  target_w = std::min(target_w, image.width);
+  target_h = std::min(target_h, image.height);
   if (target_w != image.width || target_h != image.height) {
-    image = fic::ResizeImageBilinear(image, target_w, target_h);
+    stage_start = std::chrono::steady_clock::now();
+    image = fic::ResizeImage(image, target_w, target_h, resize_filter,
+                             cancel);
+    if (fic::CheckCancelled(cancel, error)) {
+      return false;
+    }
+    model.Record(fic::CostStage::kResize, fic::ImageFormat::kUnknown,
+                 static_cast<int>(resize_filter),
+                 static_cast<double>(target_w) * target_h,
+                 NanosSince(stage_start));
   }
 
   fic::ImageFormat out_format =
       static_cast<fic::ImageFormat>(params.format);
-  if (!fic::EncodeImage(image, out_format, params.quality, output, error)) {
+  stage_start = std::chrono::steady_clock::now();
+  if (!fic::EncodeImage(image, out_format, params.quality, encode_options,
+                        output, cancel, error)) {
+    return false;
+  }
+  model.Record(fic::CostStage::kEncode, out_format,
+               out_format == fic::ImageFormat::kWebp
+                   ? encode_options.webp_method
+                   : 0,
+               static_cast<double>(image.width) * image.height,
+               NanosSince(stage_start));
+  image = fic::ImageBuffer();
+  if (fic::CheckCancelled(cancel, error)) {
     return false;
   }
+  return WriteBackExif(params, has_exif, &exif, output, error);
+}
 
-  if (params.keep_exif && has_exif && !exif.empty()) {
-    if (params.auto_correction || params.rotate != 0) {
-      fic::NormalizeOrientation(&exif);
-    }
-    std::string ext = "jpg";
-    if (out_format == fic::ImageFormat::kPng) {
-      ext = "png";
-    } else if (out_format == fic::ImageFormat::kWebp) {
-      ext = "webp";
-    }
-    std::string temp_path = MakeTempPath(ext);
-    if (!fic::WriteBytesToFile(temp_path, *output, error)) {
-      return false;
-    }
-    if (!fic::ApplyExifToFile(temp_path, exif, error)) {
-      g_remove(temp_path.c_str());
-      return true;
-    }
-    std::vector<uint8_t> final_bytes;
-    if (!fic::ReadFileToBytes(temp_path, &final_bytes, error)) {
-      return false;
-    }
-    g_remove(temp_path.c_str());
-    *output = std::move(final_bytes);
+// Upper bound on the bytes CompressBytes holds at once for an image with
+// header |info| and |input_size| encoded bytes. Each stage keeps its input
+// alive while it allocates its output:
+//   decode      decoded, at the size the decoder scales to
+//   transform   decoded, plus a second frame for a quarter turn or the
+//               bounding box of another angle; flips and half turns run in
+//               place
+//   resize      decoded + resized
+//   encode      resized + an output of at most the same size, copied once
+//               more when EXIF is written back.
+// A streamed image holds a band of decoded rows instead of the stages up to
+// the encode. Pixels take the channels the header says the image decodes
+// to.
+static uint64_t EstimatePeakMemory(const fic::ImageInfo& info,
+                                   uint64_t input_size,
+                                   const CompressParams& params) {
+  if (info.width <= 0 || info.height <= 0) {
+    return input_size;
   }
+  const fic::DecodeOptions decode_options = PickDecodeOptions(info, params);
+  int decoded_w = 0;
+  int decoded_h = 0;
+  fic::DecodedSize(info.format, info.width, info.height, decode_options,
+                   &decoded_w, &decoded_h);
+  const uint64_t decoded = static_cast<uint64_t>(decoded_w) *
+                           static_cast<uint64_t>(decoded_h) * info.channels;
+  int target_w = info.width;
+  int target_h = info.height;
+  TargetSize(info, params.auto_correction ? info.orientation : 1, params,
+             &target_w, &target_h);
+  // RotateImage gives gray and RGB an alpha channel for the corners an
+  // angle other than a right one leaves.
+  int angle = params.rotate % 360;
+  if (angle < 0) angle += 360;
+  const int output_channels =
+      info.channels + (angle % 90 != 0 ? info.channels % 2 : 0);
+  const uint64_t resized = static_cast<uint64_t>(target_w) *
+                           static_cast<uint64_t>(target_h) * output_channels;
 
-  return true;
+  if (CanStream(info, params)) {
+    const uint64_t band =
+        static_cast<uint64_t>(decoded_w) * info.channels * 16;
+    return input_size + band + resized * (params.keep_exif ? 3 : 2);
+  }
+  uint64_t peak = decoded;
+  const int orientation = params.auto_correction ? info.orientation : 1;
+  if (angle % 90 != 0) {
+    fic::ImageInfo decoded_info = info;
+    decoded_info.width = decoded_w;
+    decoded_info.height = decoded_h;
+    CompressParams turn;
+    turn.rotate = angle;
+    int turned_w = 0;
+    int turned_h = 0;
+    OrientedSize(decoded_info, orientation, turn, &turned_w, &turned_h);
+    peak = decoded + static_cast<uint64_t>(turned_w) *
+                         static_cast<uint64_t>(turned_h) * output_channels;
+  } else if ((orientation >= 5 && orientation <= 8) || angle == 90 ||
+             angle == 270) {
+    peak = decoded * 2;
+  }
+  peak = std::max(peak, decoded + resized);
+  peak = std::max(peak, resized * (params.keep_exif ? 3 : 2));
+  return input_size + peak;
 }
 
-static bool CompressToFile(const std::vector<uint8_t>& input,
-                           const std::string& src_path,
-                           const CompressParams& params, std::string* error) {
-  std::vector<uint8_t> output;
-  if (!CompressBytes(input, src_path, params, &output, error)) {
-    return false;
-  }
+// Stores |output| at |params|.target_path and, with keep_exif, copies the
+// EXIF of the source over to it.
+static bool WriteOutputFile(const std::vector<uint8_t>& input,
+                            const std::string& src_path,
+                            const CompressParams& params,
+                            const std::vector<uint8_t>& output,
+                            std::string* error) {
   if (!fic::WriteBytesToFile(params.target_path, output, error)) {
     return false;
   }
@@ -278,31 +1015,243 @@ static bool CompressToFile(const std::vector<uint8_t>& input,
   return true;
 }
 
-static FlMethodResponse* HandleCompressWithList(FlValue* args) {
-  std::vector<uint8_t> input;
-  CompressParams params;
+static bool CompressToFile(const std::vector<uint8_t>& input,
+                           const std::string& src_path,
+                           const CompressParams& params,
+                           const fic::CancelToken* cancel,
+                           std::vector<std::string>* degradations,
+                           std::string* error) {
+  std::vector<uint8_t> output;
+  if (!CompressBytes(input, src_path, params, cancel, &output, degradations,
+                     error)) {
+    return false;
+  }
+  return WriteOutputFile(input, src_path, params, output, error);
+}
+
+// A finished job waiting to be answered on the GTK main context.
+struct PendingResponse {
+  FlMethodCall* method_call;
+  FlMethodResponse* response;
+};
+
+static gboolean RespondOnMainContext(gpointer user_data) {
+  auto* pending = static_cast<PendingResponse*>(user_data);
+  fl_method_call_respond(pending->method_call, pending->response, nullptr);
+  g_object_unref(pending->response);
+  g_object_unref(pending->method_call);
+  delete pending;
+  return G_SOURCE_REMOVE;
+}
+
+// Hands |response| to the main context. Takes over the reference to
+// |method_call| taken when the job was queued.
+static void PostResponse(FlMethodCall* method_call,
+                         FlMethodResponse* response) {
+  g_idle_add(RespondOnMainContext,
+             new PendingResponse{method_call, response});
+}
+
+// Error code for a failed stage; cancellation wins over |code|.
+static const char* FailureCode(const fic::CancelToken* cancel,
+                               const char* code) {
+  return cancel && cancel->cancelled() ? kCancelledCode : code;
+}
+
+static FlMethodResponse* CancelledResponse() {
+  return FL_METHOD_RESPONSE(fl_method_error_response_new(
+      kCancelledCode, fic::kCancelledError, nullptr));
+}
+
+// A call queued by RunInBackground().
+struct BackgroundCall {
+  Runtime* runtime;
+  FlMethodCall* method_call;
+  std::string job_id;
+  fic::Priority priority;
+  std::shared_ptr<fic::CancelToken> cancel;
+  std::function<std::string()> key;
+  std::function<FlMethodResponse*(const fic::CancelToken*)> work;
+};
+
+static void RunCall(const std::shared_ptr<BackgroundCall>& call);
+
+static bool IsCancelledResponse(FlMethodResponse* response) {
+  return FL_IS_METHOD_ERROR_RESPONSE(response) &&
+         strcmp(fl_method_error_response_get_code(
+                    FL_METHOD_ERROR_RESPONSE(response)),
+                kCancelledCode) == 0;
+}
+
+// Answers |call| with |response|, which may be shared with other calls.
+static void FinishCall(const std::shared_ptr<BackgroundCall>& call,
+                       FlMethodResponse* response) {
+  if (call->cancel->cancelled()) {
+    response = CancelledResponse();
+  } else if (IsCancelledResponse(response)) {
+    // The shared run was cancelled by another caller; run again for this
+    // one.
+    call->runtime->pool.Submit(call->priority, [call]() { RunCall(call); });
+    return;
+  } else {
+    g_object_ref(response);
+  }
+  call->runtime->jobs.Release(call->job_id);
+  PostResponse(call->method_call, response);
+}
+
+static void RunCall(const std::shared_ptr<BackgroundCall>& call) {
+  Runtime* runtime = call->runtime;
+  std::string key = call->key ? call->key() : std::string();
+  if (key.empty()) {
+    FlMethodResponse* response = call->work(call->cancel.get());
+    FinishCall(call, response);
+    g_object_unref(response);
+    return;
+  }
+  if (!runtime->flights.Join(key, [call](FlMethodResponse* response) {
+        FinishCall(call, response);
+      })) {
+    return;
+  }
+  FlMethodResponse* response = call->work(call->cancel.get());
+  runtime->flights.Complete(key, response);
+  g_object_unref(response);
+}
+
+// Runs |work| on the pool lane for |params|.priority and responds to
+// |method_call| from the main context once it finishes. FlValue arguments
+// must be parsed beforehand, on the main thread. |params|.job_id is
+// registered right away so that `cancel` also reaches jobs still waiting in
+// the queue.
+// Calls whose |key|, computed on the worker, matches a call still running
+// attach to it and get its response instead of running |work| again; an
+// empty key opts out.
+static void RunInBackground(
+    Runtime* runtime, FlMethodCall* method_call, const CompressParams& params,
+    std::function<std::string()> key,
+    std::function<FlMethodResponse*(const fic::CancelToken*)> work) {
+  g_object_ref(method_call);
+  auto call = std::make_shared<BackgroundCall>();
+  call->runtime = runtime;
+  call->method_call = method_call;
+  call->job_id = params.job_id;
+  call->priority = params.priority;
+  call->cancel = runtime->jobs.Acquire(params.job_id);
+  call->key = std::move(key);
+  call->work = std::move(work);
+  runtime->pool.Submit(params.priority, [call]() { RunCall(call); });
+}
+
+// Everything in |params| that shapes the output.
+static std::string ParamsKey(const CompressParams& params) {
+  return std::to_string(params.min_width) + "x" +
+         std::to_string(params.min_height) + "|q" +
+         std::to_string(params.quality) + "|r" +
+         std::to_string(params.rotate) + "|a" +
+         std::to_string(params.auto_correction) + "|f" +
+         std::to_string(params.format) + "|e" +
+         std::to_string(params.keep_exif) + "|s" +
+         std::to_string(params.in_sample) + "|d" +
+         std::to_string(params.deadline_ms) + "|c" +
+         std::to_string(params.crop_x) + "," + std::to_string(params.crop_y) +
+         "," + std::to_string(params.crop_width) + "," +
+         std::to_string(params.crop_height) + "|p" +
+         std::to_string(params.preview) + "|" + params.target_path;
+}
+
+// Identifies the file by path, size and modification time, so an edited
+// file never joins a run on its old contents. Empty when it cannot be
+// stat'ed.
+static std::string FileKey(const std::string& path,
+                           const CompressParams& params) {
+  std::error_code ec;
+  uint64_t size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return std::string();
+  }
+  auto mtime = std::filesystem::last_write_time(path, ec);
+  if (ec) {
+    return std::string();
+  }
+  return "file|" + path + "|" + std::to_string(size) + "|" +
+         std::to_string(mtime.time_since_epoch().count()) + "|" +
+         ParamsKey(params);
+}
+
+static std::string BytesKey(const std::vector<uint8_t>& input,
+                            const CompressParams& params) {
+  return "bytes|" + std::to_string(input.size()) + "|" +
+         std::to_string(fic::HashBytes(input.data(), input.size())) + "|" +
+         ParamsKey(params);
+}
+
+// Answers with |result|, or with {result, degradations} for a call made
+// with a deadline.
+static FlMethodResponse* SuccessResponse(
+    FlValue* result, const CompressParams& params,
+    const std::vector<std::string>& degradations) {
+  if (params.deadline_ms <= 0) {
+    return FL_METHOD_RESPONSE(fl_method_success_response_new(result));
+  }
+  FlValue* list = fl_value_new_list();
+  for (const std::string& degradation : degradations) {
+    fl_value_append_take(list, fl_value_new_string(degradation.c_str()));
+  }
+  FlValue* map = fl_value_new_map();
+  fl_value_set_string_take(map, "result", result);
+  fl_value_set_string_take(map, "degradations", list);
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(map));
+}
+
+static FlMethodResponse* CompressWithList(const std::vector<uint8_t>& input,
+                                          const CompressParams& params,
+                                          fic::MemoryBudget* budget,
+                                          const fic::CancelToken* cancel) {
   std::string error;
-  if (!ParseListArgs(args, &input, &params, &error)) {
-    return FL_METHOD_RESPONSE(fl_method_error_response_new(
-        "bad_args", error.c_str(), nullptr));
+  fic::ImageInfo info;
+  fic::ReadImageInfo(input, &info, nullptr);
+  fic::MemoryReservation reservation(
+      budget, EstimatePeakMemory(info, input.size(), params), params.priority,
+      cancel);
+  if (!reservation.admitted()) {
+    return CancelledResponse();
   }
   std::vector<uint8_t> output;
-  if (!CompressBytes(input, std::string(), params, &output, &error)) {
+  std::vector<std::string> degradations;
+  if (!CompressBytes(input, std::string(), params, cancel, &output,
+                     &degradations, &error)) {
     return FL_METHOD_RESPONSE(fl_method_error_response_new(
-        "compress_error", error.c_str(), nullptr));
+        FailureCode(cancel, "compress_error"), error.c_str(), nullptr));
   }
   FlValue* result =
       fl_value_new_uint8_list(output.data(), output.size());
-  return FL_METHOD_RESPONSE(fl_method_success_response_new(result));
+  return SuccessResponse(result, params, degradations);
 }
 
-static FlMethodResponse* HandleCompressWithFile(FlValue* args) {
-  std::string path;
-  CompressParams params;
+// Estimated peak memory of compressing the file at |path|, from its size
+// and header alone.
+static uint64_t EstimateFileJobMemory(const std::string& path,
+                                      const CompressParams& params) {
+  std::error_code ec;
+  uint64_t input_size = std::filesystem::file_size(path, ec);
+  fic::ImageInfo info;
+  fic::ReadImageInfoFromFile(path, &info, nullptr);
+  return EstimatePeakMemory(info, ec ? 0 : input_size, params);
+}
+
+static FlMethodResponse* CompressWithFile(const std::string& path,
+                                          const CompressParams& params,
+                                          fic::MemoryBudget* budget,
+                                          const fic::CancelToken* cancel) {
   std::string error;
-  if (!ParseFileArgs(args, &path, &params, &error, false)) {
-    return FL_METHOD_RESPONSE(fl_method_error_response_new(
-        "bad_args", error.c_str(), nullptr));
+  if (fic::CheckCancelled(cancel, &error)) {
+    return CancelledResponse();
+  }
+  fic::MemoryReservation reservation(
+      budget, EstimateFileJobMemory(path, params), params.priority, cancel);
+  if (!reservation.admitted()) {
+    return CancelledResponse();
   }
   std::vector<uint8_t> input;
   if (!fic::ReadFileToBytes(path, &input, &error)) {
@@ -310,40 +1259,426 @@ static FlMethodResponse* HandleCompressWithFile(FlValue* args) {
         "read_error", error.c_str(), nullptr));
   }
   std::vector<uint8_t> output;
-  if (!CompressBytes(input, path, params, &output, &error)) {
+  std::vector<std::string> degradations;
+  if (!CompressBytes(input, path, params, cancel, &output, &degradations,
+                     &error)) {
     return FL_METHOD_RESPONSE(fl_method_error_response_new(
-        "compress_error", error.c_str(), nullptr));
+        FailureCode(cancel, "compress_error"), error.c_str(), nullptr));
   }
   FlValue* result =
       fl_value_new_uint8_list(output.data(), output.size());
-  return FL_METHOD_RESPONSE(fl_method_success_response_new(result));
+  return SuccessResponse(result, params, degradations);
+}
+
+static bool CompressFileToFile(const std::string& path,
+                               const CompressParams& params,
+                               fic::MemoryBudget* budget,
+                               const fic::CancelToken* cancel,
+                               std::vector<std::string>* degradations,
+                               std::string* error_code, std::string* error) {
+  if (fic::CheckCancelled(cancel, error)) {
+    *error_code = kCancelledCode;
+    return false;
+  }
+  fic::MemoryReservation reservation(
+      budget, EstimateFileJobMemory(path, params), params.priority, cancel);
+  if (!reservation.admitted()) {
+    *error_code = kCancelledCode;
+    fic::CheckCancelled(cancel, error);
+    return false;
+  }
+  std::vector<uint8_t> input;
+  if (!fic::ReadFileToBytes(path, &input, error)) {
+    *error_code = "read_error";
+    return false;
+  }
+  if (!CompressToFile(input, path, params, cancel, degradations, error)) {
+    *error_code = FailureCode(cancel, "compress_error");
+    return false;
+  }
+  return true;
 }
 
-static FlMethodResponse* HandleCompressAndGetFile(FlValue* args) {
+static FlMethodResponse* CompressAndGetFile(const std::string& path,
+                                            const CompressParams& params,
+                                            fic::MemoryBudget* budget,
+                                            const fic::CancelToken* cancel) {
+  std::vector<std::string> degradations;
+  std::string error_code;
+  std::string error;
+  if (!CompressFileToFile(path, params, budget, cancel, &degradations,
+                          &error_code, &error)) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new(
+        error_code.c_str(), error.c_str(), nullptr));
+  }
+  FlValue* result = fl_value_new_string(params.target_path.c_str());
+  return SuccessResponse(result, params, degradations);
+}
+
+struct BatchJob {
   std::string path;
   CompressParams params;
+  // Carried between the pipeline stages.
+  uint64_t reserved = 0;
+  std::vector<uint8_t> input;
+  std::vector<uint8_t> output;
+  bool ok = false;
+  std::string error_code;
   std::string error;
+};
+
+// One map per job, in request order: {ok, path[, code, message]}.
+static FlMethodResponse* BatchResponse(const std::vector<BatchJob>& jobs) {
+  FlValue* results = fl_value_new_list();
+  for (const BatchJob& job : jobs) {
+    FlValue* entry = fl_value_new_map();
+    fl_value_set_string_take(entry, "ok", fl_value_new_bool(job.ok));
+    fl_value_set_string_take(
+        entry, "path", fl_value_new_string(job.params.target_path.c_str()));
+    if (!job.ok) {
+      fl_value_set_string_take(entry, "code",
+                               fl_value_new_string(job.error_code.c_str()));
+      fl_value_set_string_take(entry, "message",
+                               fl_value_new_string(job.error.c_str()));
+    }
+    fl_value_append_take(results, entry);
+  }
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(results));
+}
+
+// The Handle* functions return an error response when the arguments are
+// invalid, or nullptr once the job has been queued on the runtime's pool.
+static FlMethodResponse* HandleCompressWithList(Runtime* runtime,
+                                                FlMethodCall* method_call) {
+  std::vector<uint8_t> input;
+  CompressParams params;
+  std::string error;
+  FlValue* args = fl_method_call_get_args(method_call);
+  if (!ParseListArgs(args, &input, &params, &error)) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new(
+        "bad_args", error.c_str(), nullptr));
+  }
+  ParseOptions(args, &params);
+  auto shared_input =
+      std::make_shared<const std::vector<uint8_t>>(std::move(input));
+  RunInBackground(
+      runtime, method_call, params,
+      [shared_input, params]() { return BytesKey(*shared_input, params); },
+      [runtime, shared_input, params](const fic::CancelToken* cancel) {
+        return CompressWithList(*shared_input, params, &runtime->budget,
+                                cancel);
+      });
+  return nullptr;
+}
+
+static FlMethodResponse* HandleCompressWithFile(Runtime* runtime,
+                                                FlMethodCall* method_call) {
+  std::string path;
+  CompressParams params;
+  std::string error;
+  FlValue* args = fl_method_call_get_args(method_call);
+  if (!ParseFileArgs(args, &path, &params, &error, false)) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new(
+        "bad_args", error.c_str(), nullptr));
+  }
+  ParseOptions(args, &params);
+  RunInBackground(
+      runtime, method_call, params,
+      [path, params]() { return FileKey(path, params); },
+      [runtime, path, params](const fic::CancelToken* cancel) {
+        return CompressWithFile(path, params, &runtime->budget, cancel);
+      });
+  return nullptr;
+}
+
+static FlMethodResponse* HandleCompressAndGetFile(Runtime* runtime,
+                                                  FlMethodCall* method_call) {
+  std::string path;
+  CompressParams params;
+  std::string error;
+  FlValue* args = fl_method_call_get_args(method_call);
   if (!ParseFileArgs(args, &path, &params, &error, true)) {
     return FL_METHOD_RESPONSE(fl_method_error_response_new(
         "bad_args", error.c_str(), nullptr));
   }
-  std::vector<uint8_t> input;
-  if (!fic::ReadFileToBytes(path, &input, &error)) {
+  ParseOptions(args, &params);
+  RunInBackground(
+      runtime, method_call, params,
+      [path, params]() { return FileKey(path, params); },
+      [runtime, path, params](const fic::CancelToken* cancel) {
+        return CompressAndGetFile(path, params, &runtime->budget, cancel);
+      });
+  return nullptr;
+}
+
+// Reads the pipeline queue bounds, {readAhead, writeBehind}, from the batch
+// options map.
+static void ParsePipelineDepths(FlValue* args, fic::PipelineDepths* depths) {
+  FlValue* options =
+      fl_value_get_list_value(args, fl_value_get_length(args) - 1);
+  if (fl_value_get_type(options) != FL_VALUE_TYPE_MAP) {
+    return;
+  }
+  int value = 0;
+  FlValue* read_ahead = fl_value_lookup_string(options, "readAhead");
+  if (read_ahead && GetInt(read_ahead, &value) && value > 0) {
+    depths->read_ahead = static_cast<size_t>(value);
+  }
+  FlValue* write_behind = fl_value_lookup_string(options, "writeBehind");
+  if (write_behind && GetInt(write_behind, &value) && value > 0) {
+    depths->write_behind = static_cast<size_t>(value);
+  }
+}
+
+// Arguments: [jobs, maxParallel, options], where every job is a
+// compressAndGetFile argument list and the options apply to every job.
+// Files are read and written on the pipeline's own threads while the pool
+// compresses, so disk and CPU stay busy together.
+static FlMethodResponse* HandleCompressBatch(Runtime* runtime,
+                                             FlMethodCall* method_call) {
+  FlValue* args = fl_method_call_get_args(method_call);
+  if (!args || fl_value_get_type(args) != FL_VALUE_TYPE_LIST ||
+      fl_value_get_length(args) < 1 ||
+      fl_value_get_type(fl_value_get_list_value(args, 0)) !=
+          FL_VALUE_TYPE_LIST) {
     return FL_METHOD_RESPONSE(fl_method_error_response_new(
-        "read_error", error.c_str(), nullptr));
+        "bad_args", "Invalid arguments", nullptr));
+  }
+  FlValue* job_args = fl_value_get_list_value(args, 0);
+  int max_parallel = 0;
+  if (fl_value_get_length(args) > 1) {
+    GetInt(fl_value_get_list_value(args, 1), &max_parallel);
   }
-  if (!CompressToFile(input, path, params, &error)) {
+
+  auto jobs = std::make_shared<std::vector<BatchJob>>(
+      fl_value_get_length(job_args));
+  for (size_t i = 0; i < jobs->size(); ++i) {
+    BatchJob& job = (*jobs)[i];
+    std::string error;
+    if (!ParseFileArgs(fl_value_get_list_value(job_args, i), &job.path,
+                       &job.params, &error, true)) {
+      std::string message = "Job " + std::to_string(i) + ": " + error;
+      return FL_METHOD_RESPONSE(fl_method_error_response_new(
+          "bad_args", message.c_str(), nullptr));
+    }
+  }
+
+  CompressParams options;
+  ParseOptions(args, &options);
+  fic::PipelineDepths depths;
+  ParsePipelineDepths(args, &depths);
+  std::shared_ptr<fic::CancelToken> cancel =
+      runtime->jobs.Acquire(options.job_id);
+  std::string job_id = options.job_id;
+
+  fic::BatchStages stages;
+  stages.cost = [jobs](size_t i) -> uint64_t {
+    std::error_code ec;
+    uint64_t size = std::filesystem::file_size((*jobs)[i].path, ec);
+    return ec ? 0 : size;
+  };
+  stages.read = [jobs, cancel](size_t i) {
+    BatchJob& job = (*jobs)[i];
+    if (fic::CheckCancelled(cancel.get(), &job.error)) {
+      job.error_code = kCancelledCode;
+      return false;
+    }
+    if (!fic::ReadFileToBytes(job.path, &job.input, &job.error)) {
+      job.error_code = "read_error";
+      return false;
+    }
+    return true;
+  };
+  // The budget is reserved on the pool slot, like a single call's: a job
+  // that holds memory while it waits for a slot could wait on the calls
+  // that fill every slot waiting for that memory.
+  stages.process = [runtime, jobs, cancel](size_t i) {
+    BatchJob& job = (*jobs)[i];
+    fic::ImageInfo info;
+    fic::ReadImageInfo(job.input, &info, nullptr);
+    uint64_t bytes = EstimatePeakMemory(info, job.input.size(), job.params);
+    if (!runtime->budget.Acquire(bytes, job.params.priority, cancel.get())) {
+      job.error_code = kCancelledCode;
+      fic::CheckCancelled(cancel.get(), &job.error);
+      return false;
+    }
+    job.reserved = bytes;
+    if (!CompressBytes(job.input, job.path, job.params, cancel.get(),
+                       &job.output, nullptr, &job.error)) {
+      job.error_code = FailureCode(cancel.get(), "compress_error");
+      return false;
+    }
+    return true;
+  };
+  stages.write = [jobs](size_t i) {
+    BatchJob& job = (*jobs)[i];
+    job.ok = WriteOutputFile(job.input, job.path, job.params, job.output,
+                             &job.error);
+    if (!job.ok) {
+      job.error_code = "compress_error";
+    }
+  };
+  stages.finish = [runtime, jobs](size_t i) {
+    BatchJob& job = (*jobs)[i];
+    std::vector<uint8_t>().swap(job.input);
+    std::vector<uint8_t>().swap(job.output);
+    runtime->budget.Release(job.reserved);
+    job.reserved = 0;
+  };
+  g_object_ref(method_call);
+  stages.on_done = [runtime, jobs, job_id, method_call]() {
+    runtime->jobs.Release(job_id);
+    PostResponse(method_call, BatchResponse(*jobs));
+  };
+  runtime->batches.Run(options.priority, jobs->size(),
+                       static_cast<size_t>(std::max(0, max_parallel)), depths,
+                       std::move(stages));
+  return nullptr;
+}
+
+// One map per path, in request order: {ok, path, format, width, height,
+// orientation} or {ok, path, code, message}.
+static FlMethodResponse* ProbeFiles(const std::vector<std::string>& paths,
+                                    const fic::CancelToken* cancel) {
+  std::vector<fic::ProbedImage> probed;
+  fic::ReadImageInfoFromFiles(paths, cancel, &probed);
+  if (cancel->cancelled()) {
+    return CancelledResponse();
+  }
+  FlValue* results = fl_value_new_list();
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const fic::ProbedImage& image = probed[i];
+    FlValue* entry = fl_value_new_map();
+    fl_value_set_string_take(entry, "ok", fl_value_new_bool(image.ok));
+    fl_value_set_string_take(entry, "path",
+                             fl_value_new_string(paths[i].c_str()));
+    if (image.ok) {
+      fl_value_set_string_take(
+          entry, "format",
+          fl_value_new_int(static_cast<int>(image.info.format)));
+      fl_value_set_string_take(entry, "width",
+                               fl_value_new_int(image.info.width));
+      fl_value_set_string_take(entry, "height",
+                               fl_value_new_int(image.info.height));
+      fl_value_set_string_take(entry, "orientation",
+                               fl_value_new_int(image.info.orientation));
+    } else {
+      fl_value_set_string_take(entry, "code",
+                               fl_value_new_string("probe_error"));
+      fl_value_set_string_take(entry, "message",
+                               fl_value_new_string(image.error.c_str()));
+    }
+    fl_value_append_take(results, entry);
+  }
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(results));
+}
+
+// Arguments: [paths, options]. Reads only the header of every file, a few
+// KB each, for its format, size and EXIF orientation.
+static FlMethodResponse* HandleProbe(Runtime* runtime,
+                                     FlMethodCall* method_call) {
+  FlValue* args = fl_method_call_get_args(method_call);
+  if (!args || fl_value_get_type(args) != FL_VALUE_TYPE_LIST ||
+      fl_value_get_length(args) < 1 ||
+      fl_value_get_type(fl_value_get_list_value(args, 0)) !=
+          FL_VALUE_TYPE_LIST) {
     return FL_METHOD_RESPONSE(fl_method_error_response_new(
-        "compress_error", error.c_str(), nullptr));
+        "bad_args", "Invalid arguments", nullptr));
   }
-  FlValue* result = fl_value_new_string(params.target_path.c_str());
+  FlValue* path_args = fl_value_get_list_value(args, 0);
+  std::vector<std::string> paths(fl_value_get_length(path_args));
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!GetString(fl_value_get_list_value(path_args, i), &paths[i])) {
+      std::string message = "Path " + std::to_string(i) + " is not a string";
+      return FL_METHOD_RESPONSE(fl_method_error_response_new(
+          "bad_args", message.c_str(), nullptr));
+    }
+  }
+  CompressParams params;
+  ParseOptions(args, &params);
+  RunInBackground(runtime, method_call, params, nullptr,
+                  [paths](const fic::CancelToken* cancel) {
+                    return ProbeFiles(paths, cancel);
+                  });
+  return nullptr;
+}
+
+// Responds with the number of batch jobs in each pipeline stage, summed
+// over all running batches: {reading, readQueue, processing, writeQueue}.
+static FlMethodResponse* HandleGetPipelineStats(fic::BatchPipeline* batches) {
+  fic::PipelineStats stats = batches->stats();
+  FlValue* result = fl_value_new_map();
+  fl_value_set_string_take(result, "reading",
+                           fl_value_new_int(stats.reading));
+  fl_value_set_string_take(result, "readQueue",
+                           fl_value_new_int(stats.read_queue));
+  fl_value_set_string_take(result, "processing",
+                           fl_value_new_int(stats.processing));
+  fl_value_set_string_take(result, "writeQueue",
+                           fl_value_new_int(stats.write_queue));
   return FL_METHOD_RESPONSE(fl_method_success_response_new(result));
 }
 
+// Argument: the jobId given to the jobs to stop. Responds with whether any
+// queued or running job had that id.
+static FlMethodResponse* HandleCancel(fic::JobRegistry* jobs, FlValue* args) {
+  std::string job_id;
+  if (!args || !GetString(args, &job_id)) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new(
+        "bad_args", "Invalid arguments", nullptr));
+  }
+  return FL_METHOD_RESPONSE(
+      fl_method_success_response_new(fl_value_new_bool(jobs->Cancel(job_id))));
+}
+
+static FlMethodResponse* HandleSetBackgroundShare(fic::WorkerPool* pool,
+                                                 FlValue* args) {
+  double share = 0;
+  if (!args || !GetDouble(args, &share)) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new(
+        "bad_args", "Invalid arguments", nullptr));
+  }
+  pool->SetBackgroundShare(share);
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(nullptr));
+}
+
+// Argument: the byte budget shared by all in-flight jobs; values <= 0
+// restore the default of half the available memory.
+static FlMethodResponse* HandleSetMemoryBudget(Runtime* runtime,
+                                              FlValue* args) {
+  int64_t bytes = 0;
+  if (!args || !GetInt64(args, &bytes)) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new(
+        "bad_args", "Invalid arguments", nullptr));
+  }
+  std::lock_guard<std::mutex> lock(runtime->limits_mutex);
+  runtime->memory_budget = bytes > 0 ? static_cast<uint64_t>(bytes)
+                                     : fic::DefaultMemoryBudget();
+  ApplyLimitsLocked(runtime);
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(nullptr));
+}
+
+static FlMethodResponse* HandleSetMaxConcurrency(Runtime* runtime,
+                                                 FlValue* args) {
+  int max_concurrency = 0;
+  if (!args || !GetInt(args, &max_concurrency)) {
+    return FL_METHOD_RESPONSE(fl_method_error_response_new(
+        "bad_args", "Invalid arguments", nullptr));
+  }
+  std::lock_guard<std::mutex> lock(runtime->limits_mutex);
+  runtime->max_concurrency = max_concurrency > 0
+                                 ? static_cast<size_t>(max_concurrency)
+                                 : fic::DefaultWorkerCount();
+  ApplyLimitsLocked(runtime);
+  return FL_METHOD_RESPONSE(fl_method_success_response_new(nullptr));
+}
+
 }  // namespace
 
 struct _ImageCompressPlusLinuxPlugin {
   GObject parent_instance;
+
+  Runtime* runtime;
 };
 
 G_DEFINE_TYPE(ImageCompressPlusLinuxPlugin,
@@ -353,16 +1688,33 @@ G_DEFINE_TYPE(ImageCompressPlusLinuxPlugin,
 static void image_compress_plus_linux_plugin_handle_method_call(
     ImageCompressPlusLinuxPlugin* self, FlMethodCall* method_call) {
   const gchar* method = fl_method_call_get_name(method_call);
-  FlValue* args = fl_method_call_get_args(method_call);
 
   FlMethodResponse* response = nullptr;
   if (strcmp(method, "compressWithList") == 0) {
-    response = HandleCompressWithList(args);
+    response = HandleCompressWithList(self->runtime, method_call);
   } else if (strcmp(method, "compressWithFile") == 0) {
-    response = HandleCompressWithFile(args);
+    response = HandleCompressWithFile(self->runtime, method_call);
   } else if (strcmp(method, "compressWithFileAndGetFile") == 0 ||
              strcmp(method, "compressAndGetFile") == 0) {
-    response = HandleCompressAndGetFile(args);
+    response = HandleCompressAndGetFile(self->runtime, method_call);
+  } else if (strcmp(method, "compressBatch") == 0) {
+    response = HandleCompressBatch(self->runtime, method_call);
+  } else if (strcmp(method, "probe") == 0) {
+    response = HandleProbe(self->runtime, method_call);
+  } else if (strcmp(method, "getPipelineStats") == 0) {
+    response = HandleGetPipelineStats(&self->runtime->batches);
+  } else if (strcmp(method, "cancel") == 0) {
+    response = HandleCancel(&self->runtime->jobs,
+                            fl_method_call_get_args(method_call));
+  } else if (strcmp(method, "setMaxConcurrency") == 0) {
+    response = HandleSetMaxConcurrency(self->runtime,
+                                       fl_method_call_get_args(method_call));
+  } else if (strcmp(method, "setBackgroundShare") == 0) {
+    response = HandleSetBackgroundShare(&self->runtime->pool,
+                                        fl_method_call_get_args(method_call));
+  } else if (strcmp(method, "setMemoryBudget") == 0) {
+    response = HandleSetMemoryBudget(self->runtime,
+                                     fl_method_call_get_args(method_call));
   } else if (strcmp(method, "showLog") == 0) {
     response = FL_METHOD_RESPONSE(fl_method_success_response_new(nullptr));
   } else if (strcmp(method, "getSystemVersion") == 0) {
@@ -372,10 +1724,18 @@ static void image_compress_plus_linux_plugin_handle_method_call(
     response = FL_METHOD_RESPONSE(fl_method_not_implemented_response_new());
   }
 
+  if (response == nullptr) {
+    return;
+  }
   fl_method_call_respond(method_call, response, nullptr);
+  g_object_unref(response);
 }
 
 static void image_compress_plus_linux_plugin_dispose(GObject* object) {
+  ImageCompressPlusLinuxPlugin* self = IMAGE_COMPRESS_PLUS_LINUX_PLUGIN(object);
+  delete self->runtime;
+  self->runtime = nullptr;
+
   G_OBJECT_CLASS(image_compress_plus_linux_plugin_parent_class)
       ->dispose(object);
 }
@@ -387,10 +1747,14 @@ static void image_compress_plus_linux_plugin_class_init(
 }
 
 static void image_compress_plus_linux_plugin_init(
-    ImageCompressPlusLinuxPlugin* self) {}
+    ImageCompressPlusLinuxPlugin* self) {
+  self->runtime = new Runtime();
+}
 
 void image_compress_plus_linux_plugin_register_with_registrar(
     FlPluginRegistrar* registrar) {
+  fic::InitExifLibrary();
+
   ImageCompressPlusLinuxPlugin* plugin =
       IMAGE_COMPRESS_PLUS_LINUX_PLUGIN(
           g_object_new(image_compress_plus_linux_plugin_get_type(),
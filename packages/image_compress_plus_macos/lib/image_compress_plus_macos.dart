@@ -31,6 +31,7 @@ class ImageCompressPlusMacos extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     await checkSupport(format);
 
@@ -96,6 +97,7 @@ class ImageCompressPlusMacos extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     await checkSupport(format);
 
@@ -130,6 +132,7 @@ class ImageCompressPlusMacos extends ImageCompressPlusPlatform {
     bool autoCorrectionAngle = true,
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
+    CompressOptions options = const CompressOptions(),
   }) async {
     await checkSupport(format);
 
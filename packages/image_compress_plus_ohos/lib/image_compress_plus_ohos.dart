@@ -31,6 +31,7 @@ class ImageCompressPlusOhos extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = true,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     await checkSupport(format);
 
@@ -98,6 +99,7 @@ class ImageCompressPlusOhos extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = true,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     await checkSupport(format);
 
@@ -133,6 +135,7 @@ class ImageCompressPlusOhos extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = true,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) async {
     await checkSupport(format);
 
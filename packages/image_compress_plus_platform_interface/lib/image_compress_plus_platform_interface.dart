@@ -2,11 +2,20 @@ import 'package:cross_file/cross_file.dart';
 import 'package:plugin_platform_interface/plugin_platform_interface.dart';
 import 'dart:typed_data' as typed_data;
 
+import 'src/batch.dart';
 import 'src/compress_format.dart';
+import 'src/options.dart';
+import 'src/priority.dart';
+import 'src/probe.dart';
 import 'src/validator.dart';
 
+export 'src/batch.dart';
 export 'src/compress_format.dart';
+export 'src/crop.dart';
 export 'src/errors.dart';
+export 'src/options.dart';
+export 'src/priority.dart';
+export 'src/probe.dart';
 export 'src/validator.dart';
 export 'package:cross_file/cross_file.dart';
 
@@ -31,6 +40,7 @@ abstract class ImageCompressPlusPlatform extends PlatformInterface {
     bool autoCorrectionAngle = true,
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
+    CompressOptions options = const CompressOptions(),
   });
 
   Future<typed_data.Uint8List?> compressWithFile(
@@ -44,6 +54,7 @@ abstract class ImageCompressPlusPlatform extends PlatformInterface {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   });
 
   Future<XFile?> compressAndGetFile(
@@ -58,6 +69,7 @@ abstract class ImageCompressPlusPlatform extends PlatformInterface {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   });
 
   Future<typed_data.Uint8List?> compressAssetImage(
@@ -71,6 +83,34 @@ abstract class ImageCompressPlusPlatform extends PlatformInterface {
     bool keepExif = false,
   });
 
+  /// Compresses every job from file to file in one native call.
+  ///
+  /// At most [maxParallel] jobs run at once; `0` leaves the limit to the
+  /// platform. Failures are reported per job instead of failing the batch.
+  /// [jobId] and [priority] are as in [CompressOptions], for the whole batch.
+  Future<List<CompressBatchResult>> compressBatch(
+    List<CompressBatchJob> jobs, {
+    int maxParallel = 0,
+    String? jobId,
+    CompressPriority priority = CompressPriority.interactive,
+  }) =>
+      throw UnimplementedError('compressBatch is not supported.');
+
+  /// Reads the format, stored size and EXIF orientation of each of [paths]
+  /// from its header alone. [jobId] and [priority] are as in
+  /// [CompressOptions].
+  Future<List<ImageProbeResult>> probe(
+    List<String> paths, {
+    String? jobId,
+    CompressPriority priority = CompressPriority.interactive,
+  }) =>
+      throw UnimplementedError('probe is not supported.');
+
+  /// Cancels the pending calls that were given [jobId] in their
+  /// [CompressOptions], where the platform can. Returns `false` when none
+  /// was cancelled.
+  Future<bool> cancel(String jobId) async => false;
+
   void ignoreCheckSupportPlatform(bool value);
 }
 
@@ -96,7 +136,8 @@ class UnsupportedImageCompressPlus extends ImageCompressPlusPlatform {
           bool autoCorrectionAngle = true,
           CompressFormat format = CompressFormat.jpeg,
           bool keepExif = false,
-          int numberOfRetries = 5}) =>
+          int numberOfRetries = 5,
+          CompressOptions options = const CompressOptions()}) =>
       throw UnimplementedError();
 
   @override
@@ -109,7 +150,8 @@ class UnsupportedImageCompressPlus extends ImageCompressPlusPlatform {
           bool autoCorrectionAngle = true,
           CompressFormat format = CompressFormat.jpeg,
           bool keepExif = false,
-          int numberOfRetries = 5}) =>
+          int numberOfRetries = 5,
+          CompressOptions options = const CompressOptions()}) =>
       throw UnimplementedError();
 
   @override
@@ -121,7 +163,8 @@ class UnsupportedImageCompressPlus extends ImageCompressPlusPlatform {
           int inSampleSize = 1,
           bool autoCorrectionAngle = true,
           CompressFormat format = CompressFormat.jpeg,
-          bool keepExif = false}) =>
+          bool keepExif = false,
+          CompressOptions options = const CompressOptions()}) =>
       throw UnimplementedError();
 
   @override
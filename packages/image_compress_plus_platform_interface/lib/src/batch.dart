@@ -0,0 +1,61 @@
+import 'compress_format.dart';
+
+/// A single file-to-file job for `compressBatch`.
+///
+/// The parameters have the same meaning as in `compressAndGetFile`.
+class CompressBatchJob {
+  const CompressBatchJob(
+    this.path,
+    this.targetPath, {
+    this.minWidth = 1920,
+    this.minHeight = 1080,
+    this.inSampleSize = 1,
+    this.quality = 95,
+    this.rotate = 0,
+    this.autoCorrectionAngle = true,
+    this.format = CompressFormat.jpeg,
+    this.keepExif = false,
+  });
+
+  final String path;
+  final String targetPath;
+  final int minWidth;
+  final int minHeight;
+  final int inSampleSize;
+  final int quality;
+  final int rotate;
+  final bool autoCorrectionAngle;
+  final CompressFormat format;
+  final bool keepExif;
+}
+
+/// The outcome of one [CompressBatchJob].
+///
+/// Results are returned in the same order as the jobs were given.
+class CompressBatchResult {
+  const CompressBatchResult({
+    required this.targetPath,
+    required this.success,
+    this.errorCode,
+    this.errorMessage,
+  });
+
+  factory CompressBatchResult.fromMap(Map<Object?, Object?> map) {
+    return CompressBatchResult(
+      targetPath: map['path'] as String,
+      success: map['ok'] as bool,
+      errorCode: map['code'] as String?,
+      errorMessage: map['message'] as String?,
+    );
+  }
+
+  final String targetPath;
+  final bool success;
+  final String? errorCode;
+  final String? errorMessage;
+
+  @override
+  String toString() => success
+      ? 'CompressBatchResult($targetPath)'
+      : 'CompressBatchResult($targetPath, $errorCode: $errorMessage)';
+}
@@ -0,0 +1,21 @@
+/// A rectangle of the image to compress, for platforms that decode only
+/// part of an image (Linux and Windows). Other platforms ignore it.
+///
+/// The coordinates are in pixels of the image as `autoCorrectionAngle`
+/// orients it, before `rotate` turns it; `minWidth` and `minHeight` of the
+/// compress call then apply to the cropped image. A rectangle that reaches
+/// past the edge is clipped to it; one that misses the image fails the call.
+class CompressCrop {
+  const CompressCrop(this.x, this.y, this.width, this.height);
+
+  final int x;
+  final int y;
+  final int width;
+  final int height;
+
+  /// The form the native side reads from the `crop` option.
+  List<int> toList() => [x, y, width, height];
+
+  @override
+  String toString() => 'CompressCrop($x, $y, ${width}x$height)';
+}
@@ -0,0 +1,41 @@
+import 'crop.dart';
+import 'priority.dart';
+
+/// Options a compress call understands on platforms with a native job queue
+/// (Linux and Windows). Other platforms ignore them.
+class CompressOptions {
+  const CompressOptions({
+    this.jobId,
+    this.priority = CompressPriority.interactive,
+    this.deadlineMs = 0,
+    this.crop,
+    this.preview = false,
+    this.onDegradations,
+  });
+
+  /// When given, lets `cancel` stop the call; a cancelled call throws a
+  /// `PlatformException` with code `cancelled`.
+  final String? jobId;
+
+  /// The native queue lane of the call.
+  final CompressPriority priority;
+
+  /// When positive, asks for the result within that many milliseconds of
+  /// the call, trading quality for speed where the native cost model
+  /// expects to need it.
+  final int deadlineMs;
+
+  /// Compresses only this rectangle; the decoders skip what lies outside
+  /// it where the format allows.
+  final CompressCrop? crop;
+
+  /// Decodes a progressive JPEG or an interlaced PNG from its first scans
+  /// or passes when the output is small enough for them, trading some
+  /// fidelity for a much faster thumbnail.
+  final bool preview;
+
+  /// Receives what a call with [deadlineMs] gave up: `fastDct`,
+  /// `noFancyUpsampling`, `webpMethod`, `nearestResize` and `jpegScale`
+  /// (output smaller than requested).
+  final void Function(List<String> degradations)? onDegradations;
+}
@@ -0,0 +1,10 @@
+/// Scheduling lane for a compression on platforms with a native job queue
+/// (Linux and Windows). Other platforms ignore it.
+enum CompressPriority {
+  /// Latency-sensitive work such as thumbnails; starts ahead of any queued
+  /// background job.
+  interactive,
+
+  /// Bulk work; limited to a share of the native workers.
+  background,
+}
@@ -0,0 +1,65 @@
+import 'compress_format.dart';
+
+/// What the header of one file says about its image, as returned by the
+/// desktop plugins' `probe`.
+///
+/// [width] and [height] are the stored size, before [orientation] is
+/// applied; orientations 5 to 8 swap them on display.
+class ImageProbeResult {
+  const ImageProbeResult({
+    required this.path,
+    required this.success,
+    this.format,
+    this.width = 0,
+    this.height = 0,
+    this.orientation = 1,
+    this.errorCode,
+    this.errorMessage,
+  });
+
+  factory ImageProbeResult.fromMap(Map<Object?, Object?> map) {
+    final int? format = map['format'] as int?;
+    return ImageProbeResult(
+      path: map['path'] as String,
+      success: map['ok'] as bool,
+      format: _formatFromInt(format),
+      width: map['width'] as int? ?? 0,
+      height: map['height'] as int? ?? 0,
+      orientation: map['orientation'] as int? ?? 1,
+      errorCode: map['code'] as String?,
+      errorMessage: map['message'] as String?,
+    );
+  }
+
+  final String path;
+  final bool success;
+  final CompressFormat? format;
+  final int width;
+  final int height;
+
+  /// EXIF orientation, 1 to 8; 1 when the file has none. A JPEG's comes
+  /// from its first `Exif` APP1 segment; XMP segments are not read.
+  final int orientation;
+  final String? errorCode;
+  final String? errorMessage;
+
+  /// The native side numbers formats as the compress calls do.
+  static CompressFormat? _formatFromInt(int? value) {
+    switch (value) {
+      case 0:
+        return CompressFormat.jpeg;
+      case 1:
+        return CompressFormat.png;
+      case 2:
+        return CompressFormat.heic;
+      case 3:
+        return CompressFormat.webp;
+    }
+    return null;
+  }
+
+  @override
+  String toString() => success
+      ? 'ImageProbeResult($path, $format, ${width}x$height, $orientation)'
+      : 'ImageProbeResult($path, $errorCode: $errorMessage)';
+}
@@ -26,6 +26,7 @@ class ImageCompressPlusWeb extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) {
     throw UnimplementedError('The method not support web');
   }
@@ -64,6 +65,7 @@ class ImageCompressPlusWeb extends ImageCompressPlusPlatform {
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
     int numberOfRetries = 5,
+    CompressOptions options = const CompressOptions(),
   }) {
     throw UnimplementedError('The method not support web');
   }
@@ -79,6 +81,7 @@ class ImageCompressPlusWeb extends ImageCompressPlusPlatform {
     bool autoCorrectionAngle = true,
     CompressFormat format = CompressFormat.jpeg,
     bool keepExif = false,
+    CompressOptions options = const CompressOptions(),
   }) {
     return resizeWithList(
       buffer: image,
@@ -0,0 +1,101 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_BATCH_PIPELINE_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_BATCH_PIPELINE_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "worker_pool.h"
+
+namespace fic {
+
+// Per-job callbacks of a batch, each given the job index. A read or process
+// stage returning false fails the job and skips the stages after it.
+struct BatchStages {
+  // Evaluated once per job on the reader thread to order the batch.
+  std::function<uint64_t(size_t)> cost;
+  // Reader thread: fetch the job's input.
+  std::function<bool(size_t)> read;
+  // Worker pool: the CPU-bound part. Anything the job has to wait for that
+  // pool tasks hold, such as its share of a memory budget, is taken here;
+  // a job queued for a slot must not hold it.
+  std::function<bool(size_t)> process;
+  // Writer thread: store the job's output.
+  std::function<void(size_t)> write;
+  // Any thread: the job left the pipeline, successfully or not.
+  std::function<void(size_t)> finish;
+  // Any thread: every job has finished.
+  std::function<void()> on_done;
+};
+
+// Bounds on the queues between stages. |read_ahead| counts jobs being read
+// or read and waiting for a worker; |write_behind| counts jobs processed and
+// waiting for, or in, the writer.
+struct PipelineDepths {
+  size_t read_ahead = 2;
+  size_t write_behind = 2;
+};
+
+// Jobs currently in each stage, summed over all running batches.
+struct PipelineStats {
+  size_t reading = 0;
+  size_t read_queue = 0;
+  size_t processing = 0;
+  size_t write_queue = 0;
+};
+
+// Runs batches as a three-stage pipeline: one reader thread, the CPU stage
+// on a WorkerPool lane and one writer thread, joined by bounded queues, so
+// the next file's read and the previous file's write overlap with the
+// current encode. Jobs enter in descending |cost| order so the biggest
+// images never end up running alone at the tail of a batch. The pipeline
+// never blocks a pool slot: a CPU runner that finds its input queue empty,
+// or its output queue full, returns the slot and is restarted by the stage
+// that unblocks it.
+class BatchPipeline {
+ public:
+  explicit BatchPipeline(WorkerPool* cpu_pool);
+  // Waits for every running batch to finish.
+  ~BatchPipeline();
+
+  BatchPipeline(const BatchPipeline&) = delete;
+  BatchPipeline& operator=(const BatchPipeline&) = delete;
+
+  // Runs |job_count| jobs with at most |max_parallel| in the CPU stage at
+  // once (0 means the pool's own limit).
+  void Run(Priority priority, size_t job_count, size_t max_parallel,
+           PipelineDepths depths, BatchStages stages);
+
+  PipelineStats stats() const;
+
+ private:
+  struct Batch;
+
+  void PumpLocked(const std::shared_ptr<Batch>& batch);
+  void Read(const std::shared_ptr<Batch>& batch, size_t job);
+  void RunCpuStage(const std::shared_ptr<Batch>& batch);
+  void Write(const std::shared_ptr<Batch>& batch, size_t job);
+  void Finish(const std::shared_ptr<Batch>& batch, size_t job,
+              std::unique_lock<std::mutex>* lock);
+
+  WorkerPool* cpu_pool_;
+  WorkerPool reader_;
+  WorkerPool writer_;
+
+  std::atomic<size_t> reading_{0};
+  std::atomic<size_t> read_queue_{0};
+  std::atomic<size_t> processing_{0};
+  std::atomic<size_t> write_queue_{0};
+
+  std::mutex live_mutex_;
+  std::condition_variable live_cv_;
+  size_t live_batches_ = 0;
+};
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_BATCH_PIPELINE_H_
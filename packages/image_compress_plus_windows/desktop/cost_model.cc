@@ -0,0 +1,194 @@
+#include "cost_model.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace fic {
+
+namespace {
+
+// Exponential moving average weight of a new measurement.
+constexpr double kLearningRate = 0.2;
+// Share of a JPEG decode spent entropy-decoding, which DCT scaling keeps.
+constexpr double kJpegEntropyShare = 0.25;
+constexpr int kFastWebpMethod = 2;
+constexpr int kFastestWebpMethod = 0;
+
+// Rough single-core figures, in nanoseconds per work unit, used until the
+// first measurements arrive.
+double DefaultNanosPerUnit(CostStage stage, ImageFormat format, int variant) {
+  switch (stage) {
+    case CostStage::kDecode:
+      if (format == ImageFormat::kJpeg) {
+        double nanos = 10.0;
+        if (variant & kDecodeFastDct) nanos -= 2.0;
+        if (variant & kDecodeNoFancyUpsampling) nanos -= 1.5;
+        if (variant & kDecodePreview) nanos *= 0.5;
+        return nanos;
+      }
+      return format == ImageFormat::kPng ? 14.0 : 12.0;
+    case CostStage::kTransform:
+      return 2.0;
+    case CostStage::kResize:
+      return variant == static_cast<int>(ResizeFilter::kNearest) ? 1.5 : 8.0;
+    case CostStage::kEncode:
+      if (format == ImageFormat::kWebp) {
+        static const double kByMethod[] = {20, 28, 40, 55, 75, 100, 150};
+        return kByMethod[std::max(0, std::min(variant, 6))];
+      }
+      return format == ImageFormat::kPng ? 45.0 : 12.0;
+  }
+  return 10.0;
+}
+
+}  // namespace
+
+CostModel& CostModel::Instance() {
+  static CostModel model;
+  return model;
+}
+
+double CostModel::NanosPerUnit(CostStage stage, ImageFormat format,
+                               int variant) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = nanos_per_unit_.find(Key(static_cast<int>(stage),
+                                     static_cast<int>(format), variant));
+  if (it != nanos_per_unit_.end()) {
+    return it->second;
+  }
+  return DefaultNanosPerUnit(stage, format, variant);
+}
+
+void CostModel::Record(CostStage stage, ImageFormat format, int variant,
+                       double units, double nanos) {
+  if (units < 1.0) {
+    return;
+  }
+  const double sample = nanos / units;
+  std::lock_guard<std::mutex> lock(mutex_);
+  Key key(static_cast<int>(stage), static_cast<int>(format), variant);
+  auto it = nanos_per_unit_.find(key);
+  if (it == nanos_per_unit_.end()) {
+    nanos_per_unit_.emplace(key, sample);
+  } else {
+    it->second += (sample - it->second) * kLearningRate;
+  }
+}
+
+int DecodeVariant(const DecodeOptions& options) {
+  return (options.fast_dct ? kDecodeFastDct : 0) |
+         (options.fancy_upsampling ? 0 : kDecodeNoFancyUpsampling) |
+         (options.preview ? kDecodePreview : 0);
+}
+
+double DecodeWorkUnits(ImageFormat format, int width, int height,
+                       const DecodeOptions& options) {
+  const double pixels = static_cast<double>(width) * height;
+  if (format == ImageFormat::kPng && options.preview &&
+      options.crop_width <= 0 && options.scale_num < options.scale_denom) {
+    // A preview inflates only the pixels it outputs.
+    const double denom =
+        static_cast<double>(options.scale_denom) / options.scale_num;
+    return std::ceil(width / denom) * std::ceil(height / denom);
+  }
+  if (format != ImageFormat::kJpeg ||
+      options.scale_num >= options.scale_denom) {
+    return pixels;
+  }
+  const double linear =
+      static_cast<double>(options.scale_num) / options.scale_denom;
+  const double scale = linear * linear;
+  return pixels * (kJpegEntropyShare + (1.0 - kJpegEntropyShare) * scale);
+}
+
+double EstimateMillis(const DeadlineJob& job, const DeadlinePlan& plan,
+                      const CostModel& model) {
+  const bool jpeg_in = job.input_format == ImageFormat::kJpeg;
+  int decoded_w =
+      jpeg_in ? JpegScaledSize(job.width, plan.decode) : job.width;
+  int decoded_h =
+      jpeg_in ? JpegScaledSize(job.height, plan.decode) : job.height;
+  if (job.scaled_decode) {
+    decoded_w = std::min(job.target_width, decoded_w);
+    decoded_h = std::min(job.target_height, decoded_h);
+  }
+  const int out_w = std::min(job.target_width, decoded_w);
+  const int out_h = std::min(job.target_height, decoded_h);
+  const double decoded = static_cast<double>(decoded_w) * decoded_h;
+  const double output = static_cast<double>(out_w) * out_h;
+
+  double nanos =
+      model.NanosPerUnit(CostStage::kDecode, job.input_format,
+                         DecodeVariant(plan.decode)) *
+      DecodeWorkUnits(job.input_format, job.width, job.height, plan.decode);
+  if (job.transform) {
+    nanos += model.NanosPerUnit(CostStage::kTransform, ImageFormat::kUnknown,
+                                0) *
+             decoded;
+  }
+  if (out_w != decoded_w || out_h != decoded_h) {
+    nanos += model.NanosPerUnit(CostStage::kResize, ImageFormat::kUnknown,
+                                static_cast<int>(plan.resize)) *
+             output;
+  }
+  const int encode_variant = job.output_format == ImageFormat::kWebp
+                                 ? plan.encode.webp_method
+                                 : 0;
+  nanos += model.NanosPerUnit(CostStage::kEncode, job.output_format,
+                              encode_variant) *
+           output;
+  return nanos / 1e6;
+}
+
+DeadlinePlan PlanForDeadline(const DeadlineJob& job, double budget_ms,
+                             const CostModel& model) {
+  DeadlinePlan plan;
+  const bool jpeg_in = job.input_format == ImageFormat::kJpeg;
+  if (jpeg_in) {
+    PickJpegScale(job.width, job.height, job.target_width, job.target_height,
+                  &plan.decode);
+  }
+  auto fits = [&]() {
+    plan.estimated_ms = EstimateMillis(job, plan, model);
+    return plan.estimated_ms <= budget_ms;
+  };
+  if (fits()) {
+    return plan;
+  }
+  if (jpeg_in) {
+    plan.decode.fast_dct = true;
+    plan.degradations.push_back("fastDct");
+    if (fits()) return plan;
+    plan.decode.fancy_upsampling = false;
+    plan.degradations.push_back("noFancyUpsampling");
+    if (fits()) return plan;
+  }
+  if (job.output_format == ImageFormat::kWebp) {
+    plan.degradations.push_back("webpMethod");
+    plan.encode.webp_method = kFastWebpMethod;
+    if (fits()) return plan;
+    plan.encode.webp_method = kFastestWebpMethod;
+    if (fits()) return plan;
+  }
+  if (!job.scaled_decode &&
+      (job.target_width < job.width || job.target_height < job.height)) {
+    plan.resize = ResizeFilter::kNearest;
+    plan.degradations.push_back("nearestResize");
+    if (fits()) return plan;
+  }
+  // Halve the scale, in eighths, down to 1/8. Halving keeps a power of two
+  // for builds without M/8 scaling.
+  int eighths = plan.decode.scale_num * 8 / plan.decode.scale_denom;
+  if (jpeg_in && eighths > 1) {
+    plan.degradations.push_back("jpegScale");
+    while (eighths > 1) {
+      eighths /= 2;
+      plan.decode.scale_num = eighths;
+      plan.decode.scale_denom = 8;
+      if (fits()) return plan;
+    }
+  }
+  return plan;
+}
+
+}  // namespace fic
@@ -0,0 +1,94 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_COST_MODEL_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_COST_MODEL_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "image_compress_core.h"
+
+namespace fic {
+
+enum class CostStage {
+  kDecode,
+  kTransform,
+  kResize,
+  kEncode,
+};
+
+// Variant bits of a JPEG decode; kDecodePreview also applies to PNG.
+constexpr int kDecodeFastDct = 1;
+constexpr int kDecodeNoFancyUpsampling = 2;
+constexpr int kDecodePreview = 4;
+
+// Wall time per unit of work for each stage, learned from the timings of
+// finished jobs. |variant| separates the settings of one stage: the JPEG
+// decode bits above, the ResizeFilter, or the WebP method. Work units are
+// output pixels, except for decoding (see DecodeWorkUnits()).
+class CostModel {
+ public:
+  static CostModel& Instance();
+
+  double NanosPerUnit(CostStage stage, ImageFormat format, int variant) const;
+  // Folds one measurement into the estimate.
+  void Record(CostStage stage, ImageFormat format, int variant, double units,
+              double nanos);
+
+ private:
+  using Key = std::tuple<int, int, int>;
+
+  mutable std::mutex mutex_;
+  std::map<Key, double> nanos_per_unit_;
+};
+
+// CostModel variant of a JPEG or PNG decode with |options|.
+int DecodeVariant(const DecodeOptions& options);
+
+// Decoding work of a |width| x |height| image decoded with |options|. A
+// scaled JPEG decode still entropy-decodes every coefficient, so only part
+// of its cost shrinks with the output; a PNG preview costs what it outputs.
+double DecodeWorkUnits(ImageFormat format, int width, int height,
+                       const DecodeOptions& options);
+
+// Shape of a job as known before decoding.
+struct DeadlineJob {
+  ImageFormat input_format = ImageFormat::kUnknown;
+  // Source size after EXIF orientation.
+  int width = 0;
+  int height = 0;
+  // Output size CalcTargetSize asks for.
+  int target_width = 0;
+  int target_height = 0;
+  bool transform = false;
+  // The decoder scales straight to the target (WebP), leaving no resize.
+  bool scaled_decode = false;
+  ImageFormat output_format = ImageFormat::kJpeg;
+  int quality = 95;
+};
+
+struct DeadlinePlan {
+  DecodeOptions decode;
+  ResizeFilter resize = ResizeFilter::kBilinear;
+  EncodeOptions encode;
+  // What was given up, cheapest loss first: fastDct, noFancyUpsampling,
+  // webpMethod, nearestResize, jpegScale (output smaller than asked).
+  std::vector<std::string> degradations;
+  double estimated_ms = 0;
+};
+
+double EstimateMillis(const DeadlineJob& job, const DeadlinePlan& plan,
+                      const CostModel& model);
+
+// Picks the least lossy settings |model| expects to finish |job| within
+// |budget_ms|. JPEG is always decoded at the smallest DCT scale that still
+// covers the target, which costs nothing visible; every further step is
+// listed in the plan's degradations. Returns the cheapest plan when even
+// that misses the budget.
+DeadlinePlan PlanForDeadline(const DeadlineJob& job, double budget_ms,
+                             const CostModel& model);
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_COST_MODEL_H_
@@ -5,6 +5,10 @@
 
 namespace fic {
 
+void InitExifLibrary() {
+  Exiv2::XmpParser::initialize();
+}
+
 bool ReadExifFromFile(const std::string& path, ExifPack* out,
                       std::string* error) {
   try {
@@ -57,6 +61,24 @@ int OrientationFromExif(const ExifPack& exif) {
   return 1;
 }
 
+bool ReadExifThumbnail(const ExifPack& exif, std::vector<uint8_t>* out) {
+  try {
+    Exiv2::ExifThumbC thumb(exif.exif);
+    if (std::string(thumb.mimeType()) != "image/jpeg") {
+      return false;
+    }
+    Exiv2::DataBuf buf = thumb.copy();
+    if (buf.empty()) {
+      return false;
+    }
+    out->assign(buf.c_data(), buf.c_data() + buf.size());
+    return true;
+  } catch (const Exiv2::Error&) {
+  } catch (const std::exception&) {
+  }
+  return false;
+}
+
 void NormalizeOrientation(ExifPack* exif) {
   try {
     Exiv2::ExifData& data = exif->exif;
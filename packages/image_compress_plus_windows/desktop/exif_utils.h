@@ -18,11 +18,17 @@ struct ExifPack {
   }
 };
 
+// Must run once before metadata is read from more than one thread.
+void InitExifLibrary();
+
 bool ReadExifFromFile(const std::string& path, ExifPack* out,
                       std::string* error);
 bool ReadExifFromBytes(const std::vector<uint8_t>& data, ExifPack* out,
                        std::string* error);
 int OrientationFromExif(const ExifPack& exif);
+// Copies the JPEG thumbnail IFD1 of |exif| holds into |out|. Returns false
+// when there is none.
+bool ReadExifThumbnail(const ExifPack& exif, std::vector<uint8_t>* out);
 void NormalizeOrientation(ExifPack* exif);
 bool ApplyExifToFile(const std::string& path, const ExifPack& exif,
                      std::string* error);
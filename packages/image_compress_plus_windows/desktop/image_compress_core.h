@@ -1,7 +1,9 @@
 #ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_IMAGE_COMPRESS_CORE_H_
 #define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_IMAGE_COMPRESS_CORE_H_
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -15,6 +17,9 @@ enum class ImageFormat {
   kUnknown = 99,
 };
 
+// Decoded pixels, 8 bits per sample, row after row with no padding. A
+// pixel is gray (1 channel), gray+alpha (2), RGB (3) or RGBA (4), in the
+// layout the image came in; transforms keep it.
 struct ImageBuffer {
   int width = 0;
   int height = 0;
@@ -22,24 +27,219 @@ struct ImageBuffer {
   std::vector<uint8_t> data;
 };
 
+// Cooperative cancellation flag for one job. Long-running stages poll it
+// and bail out with kCancelledError once it is set.
+class CancelToken {
+ public:
+  void Cancel() { cancelled_.store(true, std::memory_order_relaxed); }
+  bool cancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<bool> cancelled_{false};
+};
+
+extern const char kCancelledError[];
+
+// Returns true and fills |error| when |cancel| is set and cancelled. A null
+// token never cancels.
+bool CheckCancelled(const CancelToken* cancel, std::string* error);
+
+// What the container header says about an image, read without decoding.
+struct ImageInfo {
+  ImageFormat format = ImageFormat::kUnknown;
+  int width = 0;
+  int height = 0;
+  // EXIF orientation (1-8) from a JPEG's APP1 segment, a PNG's eXIf chunk
+  // or a WebP's EXIF chunk; 1 when there is none.
+  int orientation = 1;
+  // A progressive JPEG or an Adam7-interlaced PNG, whose first scans or
+  // passes already hold a coarse image; see DecodeOptions::preview.
+  bool progressive = false;
+  // JPEG: MCUs between restart markers (DRI); 0 when there are none.
+  int restart_interval = 0;
+  // Samples per pixel DecodeImage decodes to, as in ImageBuffer::channels,
+  // counting an alpha channel it may then drop as opaque; 4 when the
+  // header does not tell.
+  int channels = 4;
+};
+
 ImageFormat DetectImageFormat(const uint8_t* data, size_t size);
 
+// Reads the size of a JPEG (SOFn), PNG (IHDR) or WebP (VP8/VP8L/VP8X)
+// image from its header, and its EXIF orientation.
+bool ReadImageInfo(const std::vector<uint8_t>& input, ImageInfo* info,
+                   std::string* error);
+// Same as ReadImageInfo, but only reads the header bytes of |path|.
+bool ReadImageInfoFromFile(const std::string& path, ImageInfo* info,
+                           std::string* error);
+
+// Outcome of one file of ReadImageInfoFromFiles().
+struct ProbedImage {
+  bool ok = false;
+  ImageInfo info;
+  std::string error;
+};
+
+// Runs ReadImageInfoFromFile() over |paths| on the TaskScheduler and fills
+// |results| in the same order. Files not reached before |cancel| fires fail
+// with kCancelledError.
+void ReadImageInfoFromFiles(const std::vector<std::string>& paths,
+                            const CancelToken* cancel,
+                            std::vector<ProbedImage>* results);
+
 bool ReadFileToBytes(const std::string& path, std::vector<uint8_t>* out,
                      std::string* error);
 bool WriteBytesToFile(const std::string& path, const std::vector<uint8_t>& data,
                       std::string* error);
 
-bool DecodeImage(const std::vector<uint8_t>& input, ImageBuffer* out,
-                 ImageFormat* detected, int in_sample, std::string* error);
+// Speed/quality trade-offs for DecodeImage; the defaults decode exactly.
+struct DecodeOptions {
+  // JPEG: let libjpeg scale the image by scale_num/scale_denom while it
+  // decodes; see PickJpegScale().
+  int scale_num = 1;
+  int scale_denom = 1;
+  // JPEG: the fast integer IDCT instead of the accurate one.
+  bool fast_dct = false;
+  // JPEG: smooth chroma upsampling instead of pixel replication.
+  bool fancy_upsampling = true;
+  // WebP: let libwebp scale the image to exactly scaled_width x
+  // scaled_height, in stored orientation, while it decodes. 0 (or a size
+  // that is not smaller) decodes at full size.
+  int scaled_width = 0;
+  int scaled_height = 0;
+  // Decode only this rectangle, in stored orientation and full-size pixels;
+  // the scaling above then applies to it. A width of 0 decodes the whole
+  // image. JPEG skips the rows above it and the MCU columns beside it, WebP
+  // decodes it alone (at full size when it starts on an odd column or row),
+  // and PNG stops after its last row.
+  int crop_x = 0;
+  int crop_y = 0;
+  int crop_width = 0;
+  int crop_height = 0;
+  // Decode a coarse image from the first scans or passes only, when the
+  // output needs no more. A progressive JPEG scaled below 1 stops reading
+  // once every coefficient the scaled IDCT uses has arrived at some
+  // precision. An uncropped PNG with a scale of 1/2, 1/4 or 1/8 (see
+  // PickPngPreviewScale()) decodes to its pixels whose coordinates are
+  // multiples of 2, 4 or 8; an Adam7 one reads only the passes holding
+  // them. Other images decode in full.
+  bool preview = false;
+};
+
+// Speed/quality trade-offs for EncodeImage.
+struct EncodeOptions {
+  // WebP: encoder effort, 0 (fastest) to 6 (smallest output).
+  int webp_method = 4;
+};
+
+// The DCT scale denominator that implements |in_sample| for JPEG.
+int PickJpegScaleDenom(int in_sample);
+
+// Sets |options| to the smallest scale libjpeg can decode a |width| x
+// |height| JPEG at whose output still covers |target_w| x |target_h|: any
+// M/8 with libjpeg-turbo or libjpeg 7+, otherwise 1/8, 1/4, 1/2 or 1.
+void PickJpegScale(int width, int height, int target_w, int target_h,
+                   DecodeOptions* options);
+// Length |size| becomes when a JPEG is decoded with |options|.
+int JpegScaledSize(int size, const DecodeOptions& options);
+// Sets |options| to the fewest Adam7 passes whose pixels still cover
+// |target_w| x |target_h| in a preview decode of a |width| x |height| PNG:
+// scale 1/8 (pass 1), 1/4 (passes 1-3), 1/2 (passes 1-5) or 1 (all).
+void PickPngPreviewScale(int width, int height, int target_w, int target_h,
+                         DecodeOptions* options);
+// Clips the rectangle (*x, *y, *w, *h) to a |width| x |height| image.
+// Returns false when nothing of it is left.
+bool ClipRect(int width, int height, int* x, int* y, int* w, int* h);
+// Whether DecodeImage may split the JPEG of |info| at its restart markers
+// and decode the pieces on the TaskScheduler: a large baseline image with
+// restart markers, decoded uncropped, when there is more than one thread.
+bool JpegDecodesInBands(const ImageInfo& info);
+// Size DecodeImage outputs for a |width| x |height| image of |format|
+// decoded with |options|; 0 x 0 when the crop misses the image.
+void DecodedSize(ImageFormat format, int width, int height,
+                 const DecodeOptions& options, int* out_w, int* out_h);
+
+// Decodes to the image's own layout: gray or RGB for a JPEG (CMYK becomes
+// RGB), RGB or RGBA for a WebP, and any of the four for a PNG, with
+// palettes expanded. An alpha channel whose every pixel is 255 is dropped.
+bool DecodeImage(const std::vector<uint8_t>& input,
+                 const DecodeOptions& options, ImageBuffer* out,
+                 ImageFormat* detected, const CancelToken* cancel,
+                 std::string* error);
+
+// Reads a PNG one 8-bit row at a time, as DecodeImage decodes it before
+// it drops an opaque alpha channel.
+// Takes PNGs of up to 8 bits per channel with no gamma other than sRGB's,
+// which libpng's simplified API would convert. Rows come top to bottom, or
+// for an interlaced PNG pass by pass as Adam7 stores them: pass p holds
+// PNG_PASS_ROWS(height(), p) rows of PNG_PASS_COLS(width(), p) pixels, and
+// passes with none are skipped.
+class PngRowReader {
+ public:
+  PngRowReader();
+  ~PngRowReader();
+
+  // Reads the header. Returns false when it fails to parse or, with
+  // |*supported| false, when the PNG is not one this reader takes.
+  bool Open(const std::vector<uint8_t>& input, bool* supported);
+  int width() const;
+  int height() const;
+  bool interlaced() const;
+  // Samples per pixel, as in ImageBuffer::channels.
+  int channels() const;
+  // Decodes the next row into |row|, width() * channels() bytes.
+  bool ReadRow(uint8_t* row);
+
+ private:
+  struct State;
+  std::unique_ptr<State> state_;
+};
 
 bool EncodeImage(const ImageBuffer& image, ImageFormat format, int quality,
-                 std::vector<uint8_t>* out, std::string* error);
+                 const EncodeOptions& options, std::vector<uint8_t>* out,
+                 const CancelToken* cancel, std::string* error);
 
+enum class ResizeFilter {
+  kBilinear,
+  kNearest,
+};
+
+// Returns an empty buffer when |cancel| fires mid-way.
+ImageBuffer ResizeImage(const ImageBuffer& src, int target_w, int target_h,
+                        ResizeFilter filter, const CancelToken* cancel);
 ImageBuffer ResizeImageBilinear(const ImageBuffer& src, int target_w,
-                                int target_h);
+                                int target_h, const CancelToken* cancel);
+ImageBuffer ResizeImageNearest(const ImageBuffer& src, int target_w,
+                               int target_h, const CancelToken* cancel);
+// Angles other than multiples of 90 leave transparent corners, so a gray
+// or RGB image gains an alpha channel.
 ImageBuffer RotateImage(const ImageBuffer& src, int angle_degrees);
 ImageBuffer FlipHorizontal(const ImageBuffer& src);
 ImageBuffer FlipVertical(const ImageBuffer& src);
+// The |width| x |height| rectangle of |src| at (|x|, |y|), which must lie
+// inside it.
+ImageBuffer CropImage(const ImageBuffer& src, int x, int y, int width,
+                      int height);
+
+// Applies EXIF |orientation| to |src| in one pass: 2 mirrors it, 3 turns
+// it by 180 degrees, 4 flips it, 6 and 8 turn it by 90 and 270 degrees,
+// and 5 and 7 mirror it and turn it by 90 and 270 degrees. 5 to 8 copy
+// square tiles, with SIMD transposes for RGBA. Other values return |src|.
+ImageBuffer OrientImage(const ImageBuffer& src, int orientation);
+
+// The same transforms on an image the caller gives up, whose storage they
+// reuse: flips and turns by 0 or 180 degrees, which covers orientations 1
+// to 4, work in place, and a crop keeping at least half the image packs
+// its rows in place. Other turns and smaller crops allocate their output
+// once.
+ImageBuffer RotateImage(ImageBuffer&& src, int angle_degrees);
+ImageBuffer FlipHorizontal(ImageBuffer&& src);
+ImageBuffer FlipVertical(ImageBuffer&& src);
+ImageBuffer CropImage(ImageBuffer&& src, int x, int y, int width,
+                      int height);
+ImageBuffer OrientImage(ImageBuffer&& src, int orientation);
 
 void CalcTargetSize(int src_w, int src_h, int min_w, int min_h, int in_sample,
                     int* out_w, int* out_h);
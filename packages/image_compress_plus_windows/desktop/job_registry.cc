@@ -0,0 +1,40 @@
+#include "job_registry.h"
+
+namespace fic {
+
+std::shared_ptr<CancelToken> JobRegistry::Acquire(const std::string& job_id) {
+  if (job_id.empty()) {
+    return std::make_shared<CancelToken>();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry = entries_[job_id];
+  // An id reused after a cancel starts over instead of inheriting it.
+  if (!entry.token || entry.token->cancelled()) {
+    entry.token = std::make_shared<CancelToken>();
+  }
+  ++entry.jobs;
+  return entry.token;
+}
+
+void JobRegistry::Release(const std::string& job_id) {
+  if (job_id.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(job_id);
+  if (it != entries_.end() && --it->second.jobs == 0) {
+    entries_.erase(it);
+  }
+}
+
+bool JobRegistry::Cancel(const std::string& job_id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(job_id);
+  if (it == entries_.end()) {
+    return false;
+  }
+  it->second.token->Cancel();
+  return true;
+}
+
+}  // namespace fic
@@ -0,0 +1,437 @@
+#include "pixel_convert.h"
+
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FIC_PIXEL_NEON 1
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <immintrin.h>
+#define FIC_PIXEL_SSE2 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// AVX2 kernels are compiled for that target alone and only called after a
+// CPU check, so the rest of the library keeps the baseline instruction set.
+#if defined(__GNUC__) || defined(__clang__)
+#define FIC_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define FIC_TARGET_AVX2
+#endif
+
+namespace fic {
+
+namespace {
+
+// Each kernel converts a prefix of the row and returns its length in
+// pixels; the scalar loops finish the rest.
+
+#if FIC_PIXEL_NEON
+
+size_t GrayToRgbaNeon(const uint8_t* src, uint8_t* dst, size_t pixels) {
+  size_t x = 0;
+  for (; x + 16 <= pixels; x += 16) {
+    const uint8x16_t gray = vld1q_u8(src + x);
+    uint8x16x4_t rgba;
+    rgba.val[0] = gray;
+    rgba.val[1] = gray;
+    rgba.val[2] = gray;
+    rgba.val[3] = vdupq_n_u8(255);
+    vst4q_u8(dst + x * 4, rgba);
+  }
+  return x;
+}
+
+size_t RgbaToRgbNeon(const uint8_t* src, uint8_t* dst, size_t pixels) {
+  size_t x = 0;
+  for (; x + 16 <= pixels; x += 16) {
+    const uint8x16x4_t rgba = vld4q_u8(src + x * 4);
+    uint8x16x3_t rgb;
+    rgb.val[0] = rgba.val[0];
+    rgb.val[1] = rgba.val[1];
+    rgb.val[2] = rgba.val[2];
+    vst3q_u8(dst + x * 3, rgb);
+  }
+  return x;
+}
+
+// a * b / 255 rounded, for eight byte pairs: with t = a * b,
+// (t + ((t + 128) >> 8) + 128) >> 8.
+uint8x8_t MulDiv255Neon(uint8x8_t a, uint8x8_t b) {
+  const uint16x8_t t = vmull_u8(a, b);
+  return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+size_t CmykToRgbNeon(const uint8_t* src, uint8_t* dst, size_t pixels,
+                     bool inverted) {
+  size_t x = 0;
+  for (; x + 16 <= pixels; x += 16) {
+    uint8x16x4_t v = vld4q_u8(src + x * 4);
+    if (!inverted) {
+      for (int i = 0; i < 4; ++i) {
+        v.val[i] = vmvnq_u8(v.val[i]);
+      }
+    }
+    const uint8x8_t k_lo = vget_low_u8(v.val[3]);
+    const uint8x8_t k_hi = vget_high_u8(v.val[3]);
+    uint8x16x3_t rgb;
+    for (int i = 0; i < 3; ++i) {
+      rgb.val[i] = vcombine_u8(MulDiv255Neon(vget_low_u8(v.val[i]), k_lo),
+                               MulDiv255Neon(vget_high_u8(v.val[i]), k_hi));
+    }
+    vst3q_u8(dst + x * 3, rgb);
+  }
+  return x;
+}
+
+// Transposes the 4 x 4 block of 32-bit pixels at |src| into |dst|.
+void Transpose4x4Neon(const uint8_t* src, ptrdiff_t src_stride, uint8_t* dst,
+                      ptrdiff_t dst_stride) {
+  uint32x4_t r[4];
+  for (int i = 0; i < 4; ++i) {
+    r[i] = vreinterpretq_u32_u8(vld1q_u8(src + i * src_stride));
+  }
+  // Pairs of rows trade odd and even lanes, then 64-bit halves.
+  const uint32x4x2_t p01 = vtrnq_u32(r[0], r[1]);
+  const uint32x4x2_t p23 = vtrnq_u32(r[2], r[3]);
+  const uint32x4_t out[4] = {
+      vcombine_u32(vget_low_u32(p01.val[0]), vget_low_u32(p23.val[0])),
+      vcombine_u32(vget_low_u32(p01.val[1]), vget_low_u32(p23.val[1])),
+      vcombine_u32(vget_high_u32(p01.val[0]), vget_high_u32(p23.val[0])),
+      vcombine_u32(vget_high_u32(p01.val[1]), vget_high_u32(p23.val[1]))};
+  for (int i = 0; i < 4; ++i) {
+    vst1q_u8(dst + i * dst_stride, vreinterpretq_u8_u32(out[i]));
+  }
+}
+
+#elif FIC_PIXEL_SSE2
+
+bool DetectAvx2() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  __cpuid(info, 1);
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  const bool avx = (info[2] & (1 << 28)) != 0;
+  // The OS must save the YMM registers on context switches.
+  if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool HasAvx2() {
+  static const bool has_avx2 = DetectAvx2();
+  return has_avx2;
+}
+
+size_t GrayToRgbaSse2(const uint8_t* src, uint8_t* dst, size_t pixels) {
+  const __m128i opaque = _mm_set1_epi8(static_cast<char>(0xFF));
+  size_t x = 0;
+  for (; x + 16 <= pixels; x += 16) {
+    const __m128i gray =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+    // (g, g) and (g, 255) byte pairs interleave into g g g 255.
+    const __m128i gg_lo = _mm_unpacklo_epi8(gray, gray);
+    const __m128i gg_hi = _mm_unpackhi_epi8(gray, gray);
+    const __m128i ga_lo = _mm_unpacklo_epi8(gray, opaque);
+    const __m128i ga_hi = _mm_unpackhi_epi8(gray, opaque);
+    __m128i* out = reinterpret_cast<__m128i*>(dst + x * 4);
+    _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(gg_lo, ga_lo));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(gg_hi, ga_hi));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(gg_hi, ga_hi));
+  }
+  return x;
+}
+
+// Moves the RGB of four RGBA pixels into the low 12 bytes.
+__m128i PackRgbSse2(__m128i v) {
+  const __m128i bytes0 =
+      _mm_setr_epi8(-1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i bytes1 =
+      _mm_setr_epi8(0, 0, 0, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i bytes2 =
+      _mm_setr_epi8(0, 0, 0, 0, 0, 0, -1, -1, -1, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i bytes3 =
+      _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1, 0, 0, 0, 0);
+  __m128i out = _mm_and_si128(v, bytes0);
+  out = _mm_or_si128(out, _mm_and_si128(_mm_srli_si128(v, 1), bytes1));
+  out = _mm_or_si128(out, _mm_and_si128(_mm_srli_si128(v, 2), bytes2));
+  return _mm_or_si128(out, _mm_and_si128(_mm_srli_si128(v, 3), bytes3));
+}
+
+size_t RgbaToRgbSse2(const uint8_t* src, uint8_t* dst, size_t pixels) {
+  size_t x = 0;
+  // Each 16-byte store writes four pixels and four bytes the next one
+  // overwrites, so stop while it fits.
+  for (; x + 6 <= pixels; x += 4) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 3), PackRgbSse2(v));
+  }
+  return x;
+}
+
+// Each 16-bit lane of a CMYK pixel is multiplied by its K spread over the
+// lanes, and the K * K product is dropped with the packing to RGB. a * b /
+// 255 rounds as (t + (t >> 8)) >> 8 with t = a * b + 128, which stays
+// within 16 bits.
+size_t CmykToRgbSse2(const uint8_t* src, uint8_t* dst, size_t pixels,
+                     bool inverted) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i flip =
+      inverted ? zero : _mm_set1_epi8(static_cast<char>(0xFF));
+  const __m128i half = _mm_set1_epi16(128);
+  size_t x = 0;
+  // Stores overrun like RgbaToRgbSse2's.
+  for (; x + 6 <= pixels; x += 4) {
+    const __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4)), flip);
+    __m128i halves[2] = {_mm_unpacklo_epi8(v, zero),
+                         _mm_unpackhi_epi8(v, zero)};
+    for (__m128i& h : halves) {
+      const __m128i k = _mm_shufflehi_epi16(
+          _mm_shufflelo_epi16(h, _MM_SHUFFLE(3, 3, 3, 3)),
+          _MM_SHUFFLE(3, 3, 3, 3));
+      const __m128i t = _mm_add_epi16(_mm_mullo_epi16(h, k), half);
+      h = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 3),
+                     PackRgbSse2(_mm_packus_epi16(halves[0], halves[1])));
+  }
+  return x;
+}
+
+void Transpose4x4Sse2(const uint8_t* src, ptrdiff_t src_stride, uint8_t* dst,
+                      ptrdiff_t dst_stride) {
+  __m128i r[4];
+  for (int i = 0; i < 4; ++i) {
+    r[i] = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(src + i * src_stride));
+  }
+  const __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+  const __m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+  const __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+  const __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+  const __m128i out[4] = {
+      _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+      _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+  for (int i = 0; i < 4; ++i) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * dst_stride),
+                     out[i]);
+  }
+}
+
+FIC_TARGET_AVX2 size_t GrayToRgbaAvx2(const uint8_t* src, uint8_t* dst,
+                                      size_t pixels) {
+  const __m256i low = _mm256_setr_epi8(
+      0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3, -1,
+      4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7, -1);
+  const __m256i high = _mm256_setr_epi8(
+      8, 8, 8, -1, 9, 9, 9, -1, 10, 10, 10, -1, 11, 11, 11, -1,
+      12, 12, 12, -1, 13, 13, 13, -1, 14, 14, 14, -1, 15, 15, 15, -1);
+  const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xFF000000u));
+  size_t x = 0;
+  for (; x + 16 <= pixels; x += 16) {
+    const __m256i gray = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x)));
+    __m256i* out = reinterpret_cast<__m256i*>(dst + x * 4);
+    _mm256_storeu_si256(out + 0,
+                        _mm256_or_si256(_mm256_shuffle_epi8(gray, low), alpha));
+    _mm256_storeu_si256(
+        out + 1, _mm256_or_si256(_mm256_shuffle_epi8(gray, high), alpha));
+  }
+  return x;
+}
+
+// Moves the RGB of eight RGBA pixels into the low 24 bytes. The AVX2 byte
+// shuffle works within 128-bit halves, so the packed halves are gathered
+// with a 32-bit permute.
+FIC_TARGET_AVX2 __m256i PackRgbAvx2(__m256i v) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+      0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  const __m256i gather = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+  return _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle), gather);
+}
+
+FIC_TARGET_AVX2 size_t RgbaToRgbAvx2(const uint8_t* src, uint8_t* dst,
+                                     size_t pixels) {
+  size_t x = 0;
+  // Each 32-byte store writes eight pixels and eight spare bytes.
+  for (; x + 11 <= pixels; x += 8) {
+    const __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x * 4));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 3),
+                        PackRgbAvx2(v));
+  }
+  return x;
+}
+
+FIC_TARGET_AVX2 size_t CmykToRgbAvx2(const uint8_t* src, uint8_t* dst,
+                                     size_t pixels, bool inverted) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i flip =
+      inverted ? zero : _mm256_set1_epi8(static_cast<char>(0xFF));
+  const __m256i half = _mm256_set1_epi16(128);
+  // Spreads K, bytes 6-7 and 14-15 of each half, over its pixel's lanes.
+  const __m256i spread_k = _mm256_setr_epi8(
+      6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+      6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+  size_t x = 0;
+  for (; x + 11 <= pixels; x += 8) {
+    const __m256i v = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x * 4)),
+        flip);
+    __m256i halves[2] = {_mm256_unpacklo_epi8(v, zero),
+                         _mm256_unpackhi_epi8(v, zero)};
+    for (__m256i& h : halves) {
+      const __m256i k = _mm256_shuffle_epi8(h, spread_k);
+      const __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(h, k), half);
+      h = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+    }
+    // The unpacks and the pack both work within 128-bit halves, so the
+    // pixels come back in order.
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(dst + x * 3),
+        PackRgbAvx2(_mm256_packus_epi16(halves[0], halves[1])));
+  }
+  return x;
+}
+
+// 32-bit lanes interleave within 128-bit halves, then 64-bit lanes, and
+// the halves are swapped across registers last.
+FIC_TARGET_AVX2 void Transpose8x8Avx2(const uint8_t* src,
+                                      ptrdiff_t src_stride, uint8_t* dst,
+                                      ptrdiff_t dst_stride) {
+  __m256i r[8];
+  for (int i = 0; i < 8; ++i) {
+    r[i] = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(src + i * src_stride));
+  }
+  __m256i t[8];
+  for (int i = 0; i < 8; i += 2) {
+    t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+    t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+  }
+  __m256i u[8];
+  for (int i = 0; i < 8; i += 4) {
+    u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+    u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+    u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+    u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+  }
+  for (int i = 0; i < 4; ++i) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i * dst_stride),
+                        _mm256_permute2x128_si256(u[i], u[i + 4], 0x20));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i*>(dst + (i + 4) * dst_stride),
+        _mm256_permute2x128_si256(u[i], u[i + 4], 0x31));
+  }
+}
+
+#endif
+
+}  // namespace
+
+void GrayToRgba(const uint8_t* src, uint8_t* dst, size_t pixels) {
+  size_t x = 0;
+#if FIC_PIXEL_NEON
+  x = GrayToRgbaNeon(src, dst, pixels);
+#elif FIC_PIXEL_SSE2
+  x = HasAvx2() ? GrayToRgbaAvx2(src, dst, pixels)
+                : GrayToRgbaSse2(src, dst, pixels);
+#endif
+  for (; x < pixels; ++x) {
+    dst[x * 4 + 0] = src[x];
+    dst[x * 4 + 1] = src[x];
+    dst[x * 4 + 2] = src[x];
+    dst[x * 4 + 3] = 255;
+  }
+}
+
+void RgbaToRgb(const uint8_t* src, uint8_t* dst, size_t pixels) {
+  size_t x = 0;
+#if FIC_PIXEL_NEON
+  x = RgbaToRgbNeon(src, dst, pixels);
+#elif FIC_PIXEL_SSE2
+  x = HasAvx2() ? RgbaToRgbAvx2(src, dst, pixels)
+                : RgbaToRgbSse2(src, dst, pixels);
+#endif
+  for (; x < pixels; ++x) {
+    dst[x * 3 + 0] = src[x * 4 + 0];
+    dst[x * 3 + 1] = src[x * 4 + 1];
+    dst[x * 3 + 2] = src[x * 4 + 2];
+  }
+}
+
+void CmykToRgb(const uint8_t* src, uint8_t* dst, size_t pixels,
+               bool inverted) {
+  size_t x = 0;
+#if FIC_PIXEL_NEON
+  x = CmykToRgbNeon(src, dst, pixels, inverted);
+#elif FIC_PIXEL_SSE2
+  x = HasAvx2() ? CmykToRgbAvx2(src, dst, pixels, inverted)
+                : CmykToRgbSse2(src, dst, pixels, inverted);
+#endif
+  const uint8_t flip = inverted ? 0 : 255;
+  for (; x < pixels; ++x) {
+    const int k = src[x * 4 + 3] ^ flip;
+    for (int c = 0; c < 3; ++c) {
+      const int t = (src[x * 4 + c] ^ flip) * k + 128;
+      dst[x * 3 + c] = static_cast<uint8_t>((t + (t >> 8)) >> 8);
+    }
+  }
+}
+
+void TransposePixels32(const uint8_t* src, ptrdiff_t src_stride,
+                       uint8_t* dst, ptrdiff_t dst_stride, int width,
+                       int height) {
+  // Whole blocks first, then the right and bottom edges pixel by pixel.
+  int full_w = 0;
+  int full_h = 0;
+#if FIC_PIXEL_NEON || FIC_PIXEL_SSE2
+#if FIC_PIXEL_NEON
+  const int block = 4;
+#else
+  const bool avx2 = HasAvx2();
+  const int block = avx2 ? 8 : 4;
+#endif
+  full_w = width - width % block;
+  full_h = height - height % block;
+  for (int y = 0; y < full_h; y += block) {
+    for (int x = 0; x < full_w; x += block) {
+      const uint8_t* s = src + y * src_stride + x * 4;
+      uint8_t* d = dst + x * dst_stride + y * 4;
+#if FIC_PIXEL_NEON
+      Transpose4x4Neon(s, src_stride, d, dst_stride);
+#else
+      if (avx2) {
+        Transpose8x8Avx2(s, src_stride, d, dst_stride);
+      } else {
+        Transpose4x4Sse2(s, src_stride, d, dst_stride);
+      }
+#endif
+    }
+  }
+#endif
+  for (int y = 0; y < height; ++y) {
+    for (int x = y < full_h ? full_w : 0; x < width; ++x) {
+      std::memcpy(dst + x * dst_stride + y * 4, src + y * src_stride + x * 4,
+                  4);
+    }
+  }
+}
+
+}  // namespace fic
@@ -0,0 +1,207 @@
+#include "task_scheduler.h"
+
+#include <algorithm>
+
+#include "resource_limits.h"
+
+namespace fic {
+
+namespace {
+
+// Below this many pixels a kernel runs on the calling thread.
+constexpr size_t kMinParallelPixels = 512 * 512;
+// Smallest band handed to another thread.
+constexpr size_t kMinBandPixels = 32 * 1024;
+// Chunks per thread; a few extra lets fast threads steal from slow ones.
+constexpr size_t kChunksPerThread = 4;
+
+thread_local const TaskScheduler* tls_scheduler = nullptr;
+thread_local size_t tls_worker_index = 0;
+
+}  // namespace
+
+struct TaskScheduler::Group {
+  std::atomic<size_t> remaining{0};
+  std::mutex mutex;
+  std::condition_variable cv;
+};
+
+TaskScheduler& TaskScheduler::Instance() {
+  // Leaked on purpose: worker pools may still run kernels during static
+  // destruction. The calling thread is one of the CPUs the process may use.
+  static TaskScheduler* scheduler =
+      new TaskScheduler(AvailableCpuCount() - 1);
+  return *scheduler;
+}
+
+TaskScheduler::TaskScheduler(size_t worker_count)
+    : active_workers_(worker_count) {
+  queues_.reserve(worker_count);
+  for (size_t i = 0; i < worker_count; ++i) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  threads_.reserve(worker_count);
+  for (size_t i = 0; i < worker_count; ++i) {
+    threads_.emplace_back([this, i]() { WorkerLoop(i); });
+  }
+}
+
+TaskScheduler::~TaskScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    stopping_ = true;
+    // Every worker helps drain what is left.
+    active_workers_ = queues_.size();
+  }
+  idle_cv_.notify_all();
+  for (std::thread& thread : threads_) {
+    thread.join();
+  }
+}
+
+void TaskScheduler::SetMaxConcurrency(size_t max_concurrency) {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    active_workers_ =
+        std::min(std::max<size_t>(1, max_concurrency) - 1, queues_.size());
+  }
+  idle_cv_.notify_all();
+}
+
+void TaskScheduler::ParallelFor(
+    size_t count, size_t grain,
+    const std::function<void(size_t, size_t)>& body) {
+  if (count == 0) {
+    return;
+  }
+  grain = std::max<size_t>(1, grain);
+  size_t chunks = std::min((count + grain - 1) / grain,
+                           concurrency() * kChunksPerThread);
+  const size_t active = active_workers_.load();
+  if (chunks <= 1 || active == 0) {
+    body(0, count);
+    return;
+  }
+
+  auto group = std::make_shared<Group>();
+  group->remaining = chunks;
+  const bool on_worker = tls_scheduler == this;
+  const size_t chunk_size = count / chunks;
+  const size_t extra = count % chunks;
+
+  // The calling thread keeps the first chunk; the rest go to the deques,
+  // all to its own deque when called from a worker (nested loops).
+  Task first{group, &body, 0, chunk_size + (extra > 0 ? 1 : 0)};
+  size_t begin = first.end;
+  for (size_t i = 1; i < chunks; ++i) {
+    size_t end = begin + chunk_size + (i < extra ? 1 : 0);
+    size_t queue_index = on_worker
+                             ? tls_worker_index
+                             : next_queue_.fetch_add(1) % active;
+    Push(queue_index, Task{group, &body, begin, end});
+    begin = end;
+  }
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+  }
+  idle_cv_.notify_all();
+
+  Run(first);
+  Task task;
+  while (group->remaining.load() > 0) {
+    if (PopOrSteal(on_worker ? tls_worker_index : queues_.size(), &task)) {
+      Run(task);
+      continue;
+    }
+    // Everything left is already running elsewhere.
+    std::unique_lock<std::mutex> lock(group->mutex);
+    group->cv.wait(lock, [&group]() { return group->remaining.load() == 0; });
+  }
+}
+
+void TaskScheduler::WorkerLoop(size_t index) {
+  tls_scheduler = this;
+  tls_worker_index = index;
+  Task task;
+  // A worker above the cap leaves the deques, its own included, to the
+  // others.
+  for (;;) {
+    if (index < active_workers_.load() && PopOrSteal(index, &task)) {
+      Run(task);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(idle_mutex_);
+    idle_cv_.wait(lock, [this, index]() {
+      return stopping_ ||
+             (queued_.load() > 0 && index < active_workers_.load());
+    });
+    if (stopping_ && queued_.load() == 0) {
+      return;
+    }
+  }
+}
+
+void TaskScheduler::Push(size_t queue_index, const Task& task) {
+  Queue& queue = *queues_[queue_index];
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  queue.tasks.push_back(task);
+  queued_.fetch_add(1);
+}
+
+bool TaskScheduler::PopOrSteal(size_t home, Task* task) {
+  if (queued_.load() == 0) {
+    return false;
+  }
+  if (home < queues_.size()) {
+    Queue& queue = *queues_[home];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      *task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  const size_t start = home < queues_.size() ? home + 1 : 0;
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    Queue& victim = *queues_[(start + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.tasks.empty()) {
+      *task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      queued_.fetch_sub(1);
+      return true;
+    }
+  }
+  return false;
+}
+
+void TaskScheduler::Run(const Task& task) {
+  (*task.body)(task.begin, task.end);
+  std::shared_ptr<Group> group = task.group;
+  if (group->remaining.fetch_sub(1) == 1) {
+    std::lock_guard<std::mutex> lock(group->mutex);
+    group->cv.notify_all();
+  }
+}
+
+void ParallelForRows(int rows, int row_pixels,
+                     const std::function<void(int, int)>& body) {
+  if (rows <= 0) {
+    return;
+  }
+  const size_t pixels = static_cast<size_t>(rows) *
+                        static_cast<size_t>(std::max(1, row_pixels));
+  if (pixels < kMinParallelPixels) {
+    body(0, rows);
+    return;
+  }
+  size_t grain = std::max<size_t>(
+      1, kMinBandPixels / static_cast<size_t>(std::max(1, row_pixels)));
+  TaskScheduler::Instance().ParallelFor(
+      static_cast<size_t>(rows), grain, [&body](size_t begin, size_t end) {
+        body(static_cast<int>(begin), static_cast<int>(end));
+      });
+}
+
+}  // namespace fic
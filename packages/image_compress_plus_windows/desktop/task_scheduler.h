@@ -0,0 +1,80 @@
+#ifndef FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_TASK_SCHEDULER_H_
+#define FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_TASK_SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fic {
+
+// Work-stealing scheduler shared by the pixel kernels. Each worker owns a
+// deque: it pops its own tasks LIFO and steals other workers' tasks FIFO.
+// Threads outside the scheduler (e.g. WorkerPool jobs) push to a worker
+// deque and help by stealing until their loop completes, so a loop always
+// makes progress even when every scheduler thread is busy.
+class TaskScheduler {
+ public:
+  static TaskScheduler& Instance();
+
+  explicit TaskScheduler(size_t worker_count);
+  ~TaskScheduler();
+
+  TaskScheduler(const TaskScheduler&) = delete;
+  TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+  // Threads available to a loop, including the calling thread.
+  size_t concurrency() const { return active_workers_.load() + 1; }
+
+  // Caps concurrency() at |max_concurrency|, at least 1 and at most the
+  // workers the scheduler was built with plus one. Workers above the cap
+  // finish the task they run and then stay idle until it is raised again.
+  void SetMaxConcurrency(size_t max_concurrency);
+
+  // Calls body(begin, end) over disjoint chunks covering [0, count), each
+  // at least |grain| long, and returns once all of them ran.
+  void ParallelFor(size_t count, size_t grain,
+                   const std::function<void(size_t, size_t)>& body);
+
+ private:
+  struct Group;
+  struct Task {
+    std::shared_ptr<Group> group;
+    const std::function<void(size_t, size_t)>* body;
+    size_t begin;
+    size_t end;
+  };
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  void WorkerLoop(size_t index);
+  void Push(size_t queue_index, const Task& task);
+  bool PopOrSteal(size_t home, Task* task);
+  void Run(const Task& task);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> active_workers_{0};
+  std::atomic<size_t> next_queue_{0};
+  std::atomic<size_t> queued_{0};
+  std::mutex idle_mutex_;
+  std::condition_variable idle_cv_;
+  bool stopping_ = false;
+};
+
+// Runs body(y0, y1) over row bands of an image with |rows| rows of
+// |row_pixels| pixels. Images under a few hundred thousand pixels run on
+// the calling thread, where dispatch would cost more than it saves.
+void ParallelForRows(int rows, int row_pixels,
+                     const std::function<void(int, int)>& body);
+
+}  // namespace fic
+
+#endif  // FLUTTER_IMAGE_COMPRESS_COMMON_DESKTOP_TASK_SCHEDULER_H_
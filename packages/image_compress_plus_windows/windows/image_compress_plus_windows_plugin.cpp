@@ -4,10 +4,14 @@
 #include <flutter/plugin_registrar_windows.h>
 #include <flutter/standard_method_codec.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <filesystem>
 #include <memory>
 #include <string>
 #include <utility>
@@ -21,14 +25,32 @@
 #endif
 #include <windows.h>
 
+#include "../desktop/batch_pipeline.h"
+#include "../desktop/cost_model.h"
 #include "../desktop/image_compress_core.h"
 #include "../desktop/exif_utils.h"
+#include "../desktop/job_registry.h"
+#include "../desktop/memory_budget.h"
+#include "../desktop/single_flight.h"
+#include "../desktop/stream_compress.h"
+#include "../desktop/task_scheduler.h"
+#include "../desktop/worker_pool.h"
 
 namespace image_compress_plus_windows {
 
 namespace {
 
 constexpr char kChannelName[] = "image_compress_plus";
+constexpr wchar_t kTaskWindowClassName[] =
+    L"ImageCompressPlusPlatformTaskWindow";
+constexpr UINT kRunPlatformTasksMessage = WM_APP + 1;
+constexpr char kCancelledCode[] = "cancelled";
+constexpr char kCropOutsideError[] = "Crop rectangle is outside the image";
+// Largest output side CompressBytes looks for an EXIF thumbnail for. An
+// APP1 segment holds at most 64 KB, so thumbnails stay well below it.
+constexpr int kMaxThumbnailTarget = 640;
+
+using CallOutcome = ImageCompressPlusWindowsPlugin::CallOutcome;
 
 struct CompressParams {
   int min_width = 1920;
@@ -40,6 +62,21 @@ struct CompressParams {
   bool keep_exif = false;
   int in_sample = 1;
   std::string target_path;
+  std::string job_id;
+  fic::Priority priority = fic::Priority::kInteractive;
+  // With a deadline, CompressBytes trades quality for speed to finish by
+  // |deadline|, |deadline_ms| after the call arrived.
+  int deadline_ms = 0;
+  std::chrono::steady_clock::time_point deadline;
+  // Compress only this rectangle of the image as auto_correction orients
+  // it, before rotate; a width of 0 takes all of it.
+  int crop_x = 0;
+  int crop_y = 0;
+  int crop_width = 0;
+  int crop_height = 0;
+  // Decode progressive JPEGs and interlaced PNGs from their first scans or
+  // passes when those cover the output; see fic::DecodeOptions::preview.
+  bool preview = false;
 };
 
 static bool GetInt(const flutter::EncodableValue& value, int* out) {
@@ -62,6 +99,31 @@ static bool GetBool(const flutter::EncodableValue& value, bool* out) {
   return false;
 }
 
+static bool GetInt64(const flutter::EncodableValue& value, int64_t* out) {
+  if (std::holds_alternative<int32_t>(value)) {
+    *out = std::get<int32_t>(value);
+    return true;
+  }
+  if (std::holds_alternative<int64_t>(value)) {
+    *out = std::get<int64_t>(value);
+    return true;
+  }
+  return false;
+}
+
+static bool GetDouble(const flutter::EncodableValue& value, double* out) {
+  if (std::holds_alternative<double>(value)) {
+    *out = std::get<double>(value);
+    return true;
+  }
+  int int_value = 0;
+  if (GetInt(value, &int_value)) {
+    *out = static_cast<double>(int_value);
+    return true;
+  }
+  return false;
+}
+
 static bool GetString(const flutter::EncodableValue& value, std::string* out) {
   if (std::holds_alternative<std::string>(value)) {
     *out = std::get<std::string>(value);
@@ -85,35 +147,56 @@ static std::string MakeTempPath(const std::string& ext) {
   if (len == 0 || len > MAX_PATH) {
     return "";
   }
+  // Jobs run concurrently, so the tick count alone is not unique.
+  static std::atomic<unsigned long> counter{0};
   char filename[MAX_PATH];
-  std::snprintf(filename, sizeof(filename), "fic_%lu.%s",
-                static_cast<unsigned long>(GetTickCount()), ext.c_str());
+  std::snprintf(filename, sizeof(filename), "fic_%lu_%lu_%lu.%s",
+                static_cast<unsigned long>(GetCurrentProcessId()),
+                static_cast<unsigned long>(GetTickCount()),
+                counter.fetch_add(1), ext.c_str());
   return std::string(temp_path) + filename;
 }
 
-static fic::ImageBuffer ApplyOrientation(const fic::ImageBuffer& src,
-                                         int orientation) {
-  switch (orientation) {
-    case 2:
-      return fic::FlipHorizontal(src);
-    case 3:
-      return fic::RotateImage(src, 180);
-    case 4:
-      return fic::FlipVertical(src);
-    case 5: {
-      fic::ImageBuffer flipped = fic::FlipHorizontal(src);
-      return fic::RotateImage(flipped, 90);
-    }
-    case 6:
-      return fic::RotateImage(src, 90);
-    case 7: {
-      fic::ImageBuffer flipped = fic::FlipHorizontal(src);
-      return fic::RotateImage(flipped, 270);
+// Reads the optional trailing options map, {jobId, priority, deadlineMs},
+// that follows the positional arguments.
+static void ParseOptions(const flutter::EncodableList& args,
+                         CompressParams* params) {
+  if (args.empty() ||
+      !std::holds_alternative<flutter::EncodableMap>(args.back())) {
+    return;
+  }
+  const auto& options = std::get<flutter::EncodableMap>(args.back());
+  auto job_id = options.find(flutter::EncodableValue("jobId"));
+  if (job_id != options.end()) {
+    GetString(job_id->second, &params->job_id);
+  }
+  auto priority = options.find(flutter::EncodableValue("priority"));
+  int priority_value = 0;
+  if (priority != options.end() && GetInt(priority->second, &priority_value)) {
+    params->priority = priority_value == 1 ? fic::Priority::kBackground
+                                           : fic::Priority::kInteractive;
+  }
+  auto deadline = options.find(flutter::EncodableValue("deadlineMs"));
+  if (deadline != options.end() &&
+      GetInt(deadline->second, &params->deadline_ms) &&
+      params->deadline_ms > 0) {
+    params->deadline = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(params->deadline_ms);
+  }
+  auto crop = options.find(flutter::EncodableValue("crop"));
+  if (crop != options.end() &&
+      std::holds_alternative<flutter::EncodableList>(crop->second)) {
+    const auto& rect = std::get<flutter::EncodableList>(crop->second);
+    if (rect.size() == 4) {
+      GetInt(rect[0], &params->crop_x);
+      GetInt(rect[1], &params->crop_y);
+      GetInt(rect[2], &params->crop_width);
+      GetInt(rect[3], &params->crop_height);
     }
-    case 8:
-      return fic::RotateImage(src, 270);
-    default:
-      return src;
+  }
+  auto preview = options.find(flutter::EncodableValue("preview"));
+  if (preview != options.end()) {
+    GetBool(preview->second, &params->preview);
   }
 }
 
@@ -176,95 +259,720 @@ static bool ParseFileArgs(const flutter::EncodableList& args,
   return true;
 }
 
+static double NanosSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// |params|.crop clipped to the image of |info| once it is turned by
+// |orientation|. Returns false when the crop misses the image.
+static bool OrientedCrop(const fic::ImageInfo& info, int orientation,
+                         const CompressParams& params, int* x, int* y,
+                         int* w, int* h) {
+  const bool transposed = orientation >= 5 && orientation <= 8;
+  *x = params.crop_x;
+  *y = params.crop_y;
+  *w = params.crop_width;
+  *h = params.crop_height;
+  return fic::ClipRect(transposed ? info.height : info.width,
+                       transposed ? info.width : info.height, x, y, w, h);
+}
+
+// Points |options| at the rectangle of the stored image that OrientImage
+// turns into |params|.crop. Returns false when the crop misses the image.
+static bool StoredCrop(const fic::ImageInfo& info, int orientation,
+                       const CompressParams& params,
+                       fic::DecodeOptions* options) {
+  int x = 0;
+  int y = 0;
+  int w = 0;
+  int h = 0;
+  if (!OrientedCrop(info, orientation, params, &x, &y, &w, &h)) {
+    return false;
+  }
+  // Stored position of the crop's top-left corner; orientations 5 to 8
+  // also swap its width and height.
+  int stored_x = x;
+  int stored_y = y;
+  switch (orientation) {
+    case 2:
+      stored_x = info.width - x - w;
+      break;
+    case 3:
+      stored_x = info.width - x - w;
+      stored_y = info.height - y - h;
+      break;
+    case 4:
+      stored_y = info.height - y - h;
+      break;
+    case 5:
+      stored_x = info.width - y - h;
+      stored_y = info.height - x - w;
+      break;
+    case 6:
+      stored_x = y;
+      stored_y = info.height - x - w;
+      break;
+    case 7:
+      stored_x = y;
+      stored_y = x;
+      break;
+    case 8:
+      stored_x = info.width - y - h;
+      stored_y = x;
+      break;
+    default:
+      break;
+  }
+  const bool transposed = orientation >= 5 && orientation <= 8;
+  options->crop_x = stored_x;
+  options->crop_y = stored_y;
+  options->crop_width = transposed ? h : w;
+  options->crop_height = transposed ? w : h;
+  return true;
+}
+
+// Size of the image of |info| once CompressBytes has applied |orientation|,
+// |params|.crop and |params|.rotate.
+static void OrientedSize(const fic::ImageInfo& info, int orientation,
+                         const CompressParams& params, int* width,
+                         int* height) {
+  const bool transposed = orientation >= 5 && orientation <= 8;
+  double w = transposed ? info.height : info.width;
+  double h = transposed ? info.width : info.height;
+  int crop_x = 0;
+  int crop_y = 0;
+  int crop_w = 0;
+  int crop_h = 0;
+  if (params.crop_width > 0 &&
+      OrientedCrop(info, orientation, params, &crop_x, &crop_y, &crop_w,
+                   &crop_h)) {
+    w = crop_w;
+    h = crop_h;
+  }
+  int angle = params.rotate % 360;
+  if (angle < 0) angle += 360;
+  if (angle == 90 || angle == 270) {
+    std::swap(w, h);
+  } else if (angle % 90 != 0) {
+    // RotateImage grows the canvas to the rotated bounding box.
+    const double rad = angle * std::acos(-1.0) / 180.0;
+    const double rotated_w =
+        std::abs(w * std::cos(rad)) + std::abs(h * std::sin(rad));
+    h = std::abs(w * std::sin(rad)) + std::abs(h * std::cos(rad));
+    w = rotated_w;
+  }
+  *width = static_cast<int>(std::ceil(w));
+  *height = static_cast<int>(std::ceil(h));
+}
+
+// Size CompressBytes resizes the image of |info| to once it is oriented.
+// JPEG applies in_sample in the decoder, so its target is relative to the
+// in_sample size.
+static void TargetSize(const fic::ImageInfo& info, int orientation,
+                       const CompressParams& params, int* target_w,
+                       int* target_h) {
+  int width = 0;
+  int height = 0;
+  OrientedSize(info, orientation, params, &width, &height);
+  int in_sample = params.in_sample;
+  if (info.format == fic::ImageFormat::kJpeg) {
+    fic::DecodeOptions sampled;
+    sampled.scale_denom = fic::PickJpegScaleDenom(params.in_sample);
+    width = fic::JpegScaledSize(width, sampled);
+    height = fic::JpegScaledSize(height, sampled);
+    in_sample = 1;
+  }
+  fic::CalcTargetSize(width, height, params.min_width, params.min_height,
+                      in_sample, target_w, target_h);
+}
+
+// libwebp scales to an exact size before the image is turned, so the
+// target goes back to stored orientation. Other angles than right ones
+// resize after rotating instead.
+static void PickWebpScale(int orientation, const CompressParams& params,
+                          int target_w, int target_h,
+                          fic::DecodeOptions* options) {
+  int angle = params.rotate % 360;
+  if (angle < 0) angle += 360;
+  if (angle % 90 != 0) {
+    return;
+  }
+  const bool transposed = (orientation >= 5 && orientation <= 8) !=
+                          (angle == 90 || angle == 270);
+  options->scaled_width = transposed ? target_h : target_w;
+  options->scaled_height = transposed ? target_w : target_h;
+}
+
+// Lets the decoder crop and shrink the image while it decodes, so a large
+// photo headed for a small output is never decoded in full: libjpeg to the
+// smallest DCT scale that still covers the target, libwebp to the target
+// itself, and a preview of an interlaced PNG to the fewest Adam7 passes
+// that do. The orientation comes from the image header, ahead of the full
+// EXIF read.
+static fic::DecodeOptions PickDecodeOptions(const fic::ImageInfo& info,
+                                            const CompressParams& params) {
+  fic::DecodeOptions options;
+  if (info.width <= 0 || info.height <= 0) {
+    return options;
+  }
+  const int orientation = params.auto_correction ? info.orientation : 1;
+  int width = 0;
+  int height = 0;
+  int target_w = 0;
+  int target_h = 0;
+  OrientedSize(info, orientation, params, &width, &height);
+  TargetSize(info, orientation, params, &target_w, &target_h);
+  if (params.crop_width > 0) {
+    StoredCrop(info, orientation, params, &options);
+  }
+  if (info.format == fic::ImageFormat::kJpeg) {
+    fic::PickJpegScale(width, height, target_w, target_h, &options);
+  } else if (info.format == fic::ImageFormat::kWebp) {
+    PickWebpScale(orientation, params, target_w, target_h, &options);
+  } else if (info.format == fic::ImageFormat::kPng && params.preview &&
+             info.progressive && params.crop_width <= 0) {
+    fic::PickPngPreviewScale(width, height, target_w, target_h, &options);
+  }
+  options.preview = params.preview && info.progressive;
+  return options;
+}
+
+// Settings that make CompressBytes finish by |params|.deadline on the
+// estimates of |model|.
+static fic::DeadlinePlan PlanCompress(const fic::ImageInfo& info,
+                                      const CompressParams& params,
+                                      const fic::CostModel& model) {
+  fic::DeadlineJob job;
+  job.input_format = info.format;
+  const int orientation = params.auto_correction ? info.orientation : 1;
+  OrientedSize(info, orientation, params, &job.width, &job.height);
+  TargetSize(info, orientation, params, &job.target_width,
+             &job.target_height);
+  job.transform = orientation > 1 || params.rotate != 0;
+  job.scaled_decode = PickDecodeOptions(info, params).scaled_width > 0;
+  job.output_format = static_cast<fic::ImageFormat>(params.format);
+  job.quality = params.quality;
+  double budget_ms = std::chrono::duration<double, std::milli>(
+                         params.deadline - std::chrono::steady_clock::now())
+                         .count();
+  return fic::PlanForDeadline(job, budget_ms, model);
+}
+
+// Whether CompressBytes can hand the image of |info| to StreamCompress: a
+// JPEG or PNG that is not turned, cropped or previewed, going by the
+// orientation in its header. A cropped image is decoded no larger than the
+// crop anyway, and a JPEG DecodeImage splits into bands finishes sooner
+// buffered than streamed through one thread.
+static bool CanStream(const fic::ImageInfo& info,
+                      const CompressParams& params) {
+  if (info.width <= 0 || info.height <= 0 || params.rotate != 0 ||
+      params.crop_width > 0 || (params.preview && info.progressive) ||
+      params.format == static_cast<int>(fic::ImageFormat::kHeic)) {
+    return false;
+  }
+  if (params.auto_correction && info.orientation > 1) {
+    return false;
+  }
+  if (fic::JpegDecodesInBands(info)) {
+    return false;
+  }
+  return info.format == fic::ImageFormat::kJpeg ||
+         info.format == fic::ImageFormat::kPng;
+}
+
+// Feeds the stages of a streamed |job| to |model| as if they had run one
+// after another.
+static void RecordStreamTimings(const fic::ImageInfo& info,
+                                const fic::StreamJob& job,
+                                const fic::StreamTimings& timings,
+                                fic::CostModel* model) {
+  model->Record(fic::CostStage::kDecode, info.format,
+                info.format == fic::ImageFormat::kJpeg
+                    ? fic::DecodeVariant(job.decode)
+                    : 0,
+                fic::DecodeWorkUnits(info.format, info.width, info.height,
+                                     job.decode),
+                timings.decode_nanos);
+  const double pixels =
+      static_cast<double>(timings.output_width) * timings.output_height;
+  if (timings.output_width != timings.decoded_width ||
+      timings.output_height != timings.decoded_height) {
+    model->Record(fic::CostStage::kResize, fic::ImageFormat::kUnknown,
+                  static_cast<int>(job.filter), pixels,
+                  timings.resize_nanos);
+  }
+  model->Record(fic::CostStage::kEncode, job.format,
+                job.format == fic::ImageFormat::kWebp
+                    ? job.encode.webp_method
+                    : 0,
+                pixels, timings.encode_nanos);
+}
+
+// Reads the metadata of |input|, or of |src_path| when given. Returns
+// whether there was any; a file without metadata is not an error.
+static bool ReadExif(const std::vector<uint8_t>& input,
+                     const std::string& src_path, fic::ExifPack* exif) {
+  std::string ignored;
+  return src_path.empty() ? fic::ReadExifFromBytes(input, exif, &ignored)
+                          : fic::ReadExifFromFile(src_path, exif, &ignored);
+}
+
+// Whether the target of the JPEG of |info| is small enough that its EXIF
+// thumbnail may cover it; the metadata is then read before the decode.
+static bool MayUseThumbnail(const fic::ImageInfo& info,
+                            const CompressParams& params) {
+  if (info.format != fic::ImageFormat::kJpeg || info.width <= 0 ||
+      info.height <= 0 || params.crop_width > 0) {
+    return false;
+  }
+  const int orientation = params.auto_correction ? info.orientation : 1;
+  int target_w = 0;
+  int target_h = 0;
+  TargetSize(info, orientation, params, &target_w, &target_h);
+  return std::max(target_w, target_h) <= kMaxThumbnailTarget;
+}
+
+// Takes the JPEG thumbnail in |exif| into |thumbnail|, and its header into
+// |thumb|, when it can stand in for the image of |info|: the same aspect
+// ratio within a pixel, so not a letterboxed one, and at least the target
+// size once turned to |orientation|, the one |exif| gives. Sets |options|
+// to decode it for that target.
+static bool PickThumbnail(const fic::ImageInfo& info, int orientation,
+                          const CompressParams& params,
+                          const fic::ExifPack& exif,
+                          std::vector<uint8_t>* thumbnail,
+                          fic::ImageInfo* thumb,
+                          fic::DecodeOptions* options) {
+  if (!fic::ReadExifThumbnail(exif, thumbnail) ||
+      !fic::ReadImageInfo(*thumbnail, thumb, nullptr) ||
+      thumb->format != fic::ImageFormat::kJpeg) {
+    thumbnail->clear();
+    return false;
+  }
+  const int64_t skew = static_cast<int64_t>(thumb->width) * info.height -
+                       static_cast<int64_t>(thumb->height) * info.width;
+  int width = 0;
+  int height = 0;
+  int target_w = 0;
+  int target_h = 0;
+  OrientedSize(*thumb, orientation, params, &width, &height);
+  TargetSize(info, orientation, params, &target_w, &target_h);
+  if (std::abs(skew) > std::max(info.width, info.height) ||
+      target_w > width || target_h > height) {
+    thumbnail->clear();
+    return false;
+  }
+  *options = fic::DecodeOptions();
+  fic::PickJpegScale(width, height, target_w, target_h, options);
+  return true;
+}
+
+// With keep_exif, writes |exif| into the encoded |output|.
+static bool WriteBackExif(const CompressParams& params, bool has_exif,
+                          fic::ExifPack* exif, std::vector<uint8_t>* output,
+                          std::string* error) {
+  if (!params.keep_exif || !has_exif || exif->empty()) {
+    return true;
+  }
+  if (params.auto_correction || params.rotate != 0) {
+    fic::NormalizeOrientation(exif);
+  }
+  std::string ext = "jpg";
+  if (params.format == static_cast<int>(fic::ImageFormat::kPng)) {
+    ext = "png";
+  } else if (params.format == static_cast<int>(fic::ImageFormat::kWebp)) {
+    ext = "webp";
+  }
+  std::string temp_path = MakeTempPath(ext);
+  if (temp_path.empty()) {
+    if (error) *error = "Failed to create temp path";
+    return false;
+  }
+  if (!fic::WriteBytesToFile(temp_path, *output, error)) {
+    return false;
+  }
+  if (!fic::ApplyExifToFile(temp_path, *exif, error)) {
+    std::remove(temp_path.c_str());
+    return true;
+  }
+  std::vector<uint8_t> final_bytes;
+  if (!fic::ReadFileToBytes(temp_path, &final_bytes, error)) {
+    return false;
+  }
+  std::remove(temp_path.c_str());
+  *output = std::move(final_bytes);
+  return true;
+}
+
+// |degradations|, if not null, receives what a deadline made CompressBytes
+// give up. Every stage's timing feeds the cost model deadlines are planned
+// with.
 static bool CompressBytes(const std::vector<uint8_t>& input,
                           const std::string& src_path,
                           const CompressParams& params,
+                          const fic::CancelToken* cancel,
                           std::vector<uint8_t>* output,
+                          std::vector<std::string>* degradations,
                           std::string* error) {
+  if (fic::CheckCancelled(cancel, error)) {
+    return false;
+  }
+  // Metadata parsing only reads the input, so it runs beside the pixel
+  // decode and the two are joined before the orientation is applied. Until
+  // then the decode scale and a deadline plan use the orientation found in
+  // the JPEG header.
+  const bool read_exif = params.keep_exif || params.auto_correction;
   fic::ExifPack exif;
   bool has_exif = false;
-  if (params.keep_exif || params.auto_correction) {
-    if (!src_path.empty()) {
-      has_exif = fic::ReadExifFromFile(src_path, &exif, error);
-    } else {
-      has_exif = fic::ReadExifFromBytes(input, &exif, error);
+
+  fic::CostModel& model = fic::CostModel::Instance();
+  fic::ImageInfo info;
+  fic::ReadImageInfo(input, &info, nullptr);
+  const int header_orientation = params.auto_correction ? info.orientation : 1;
+  fic::DecodeOptions crop_check;
+  if (params.crop_width > 0 && info.width > 0 && info.height > 0 &&
+      !StoredCrop(info, header_orientation, params, &crop_check)) {
+    if (error) *error = kCropOutsideError;
+    return false;
+  }
+  // A small target is made from the EXIF thumbnail when it covers it, which
+  // takes the metadata read ahead of the decode.
+  bool exif_read = false;
+  std::vector<uint8_t> thumbnail;
+  fic::ImageInfo thumbnail_info;
+  fic::DecodeOptions decode_options;
+  if (MayUseThumbnail(info, params)) {
+    has_exif = ReadExif(input, src_path, &exif);
+    exif_read = true;
+  }
+  // The thumbnail is turned by the orientation in the metadata, which
+  // may not be the one the header showed.
+  const bool use_thumbnail =
+      has_exif &&
+      PickThumbnail(info,
+                    params.auto_correction ? fic::OrientationFromExif(exif)
+                                           : 1,
+                    params, exif, &thumbnail, &thumbnail_info,
+                    &decode_options);
+  const std::vector<uint8_t>& source = use_thumbnail ? thumbnail : input;
+  if (!use_thumbnail) {
+    decode_options = PickDecodeOptions(info, params);
+  }
+  fic::ResizeFilter resize_filter = fic::ResizeFilter::kBilinear;
+  fic::EncodeOptions encode_options;
+  bool planned_scale = false;
+  if (params.deadline_ms > 0 && info.width > 0 && info.height > 0) {
+    fic::DeadlinePlan plan = PlanCompress(info, params, model);
+    // The plan only tunes JPEG decoding, of the image itself.
+    if (info.format == fic::ImageFormat::kJpeg && !use_thumbnail) {
+      plan.decode.crop_x = decode_options.crop_x;
+      plan.decode.crop_y = decode_options.crop_y;
+      plan.decode.crop_width = decode_options.crop_width;
+      plan.decode.crop_height = decode_options.crop_height;
+      plan.decode.preview = decode_options.preview;
+      decode_options = plan.decode;
+      planned_scale =
+          std::find(plan.degradations.begin(), plan.degradations.end(),
+                    "jpegScale") != plan.degradations.end();
     }
+    resize_filter = plan.resize;
+    encode_options = plan.encode;
+    if (degradations) *degradations = plan.degradations;
   }
 
+  // An image that is not turned goes through in rows and is never held
+  // whole; anything StreamCompress declines is decoded in full below.
+  bool try_stream = !use_thumbnail && CanStream(info, params);
+  fic::StreamJob stream_job;
+  if (try_stream) {
+    stream_job.decode = decode_options;
+    TargetSize(info, 1, params, &stream_job.target_width,
+               &stream_job.target_height);
+    stream_job.filter = resize_filter;
+    stream_job.format = static_cast<fic::ImageFormat>(params.format);
+    stream_job.quality = params.quality;
+    stream_job.encode = encode_options;
+  }
+  fic::StreamResult streamed = fic::StreamResult::kUnsupported;
+  fic::StreamTimings stream_timings;
+
   fic::ImageBuffer image;
   fic::ImageFormat detected = fic::ImageFormat::kUnknown;
-  if (!fic::DecodeImage(input, &image, &detected, params.in_sample, error)) {
+  auto stage_start = std::chrono::steady_clock::now();
+  double decode_nanos = 0;
+  bool decoded = false;
+  auto decode = [&]() {
+    if (try_stream) {
+      streamed = fic::StreamCompress(input, stream_job, output,
+                                     &stream_timings, cancel, error);
+      if (streamed != fic::StreamResult::kUnsupported) {
+        return;
+      }
+      stage_start = std::chrono::steady_clock::now();
+    }
+    decoded = fic::DecodeImage(source, decode_options, &image, &detected,
+                               cancel, error);
+    decode_nanos = NanosSince(stage_start);
+  };
+  if (read_exif && !exif_read) {
+    // The calling thread takes the decode; a scheduler thread steals the
+    // metadata read, or the caller runs it afterwards if none is free.
+    fic::TaskScheduler::Instance().ParallelFor(
+        2, 1, [&](size_t begin, size_t end) {
+          for (size_t i = begin; i < end; ++i) {
+            if (i == 0) {
+              decode();
+            } else {
+              has_exif = ReadExif(input, src_path, &exif);
+            }
+          }
+        });
+  } else {
+    decode();
+  }
+  if (streamed == fic::StreamResult::kFailed) {
     return false;
   }
-
-  if (params.auto_correction && has_exif) {
-    int orientation = fic::OrientationFromExif(exif);
-    image = ApplyOrientation(image, orientation);
+  const int orientation = params.auto_correction && has_exif
+                              ? fic::OrientationFromExif(exif)
+                              : 1;
+  // The decoder was given the crop and scale as the header orients the
+  // image. When the EXIF read disagrees, they are picked again for the
+  // target it turns to, keeping a scale the deadline plan lowered, and the
+  // image is decoded again if they changed.
+  bool redecode = false;
+  if (!use_thumbnail && orientation != header_orientation &&
+      info.width > 0 && info.height > 0) {
+    fic::ImageInfo exif_info = info;
+    exif_info.orientation = orientation;
+    if (params.crop_width > 0 &&
+        !StoredCrop(exif_info, orientation, params, &crop_check)) {
+      if (error) *error = kCropOutsideError;
+      return false;
+    }
+    const fic::DecodeOptions picked = PickDecodeOptions(exif_info, params);
+    if (!planned_scale) {
+      redecode = picked.scale_num * decode_options.scale_denom !=
+                 decode_options.scale_num * picked.scale_denom;
+      decode_options.scale_num = picked.scale_num;
+      decode_options.scale_denom = picked.scale_denom;
+    }
+    redecode = redecode ||
+               picked.scaled_width != decode_options.scaled_width ||
+               picked.scaled_height != decode_options.scaled_height ||
+               picked.crop_x != decode_options.crop_x ||
+               picked.crop_y != decode_options.crop_y ||
+               picked.crop_width != decode_options.crop_width ||
+               picked.crop_height != decode_options.crop_height;
+    decode_options.scaled_width = picked.scaled_width;
+    decode_options.scaled_height = picked.scaled_height;
+    decode_options.crop_x = picked.crop_x;
+    decode_options.crop_y = picked.crop_y;
+    decode_options.crop_width = picked.crop_width;
+    decode_options.crop_height = picked.crop_height;
   }
-
-  if (params.rotate != 0) {
-    image = fic::RotateImage(image, params.rotate);
+  if (streamed == fic::StreamResult::kDone) {
+    if (orientation == 1) {
+      RecordStreamTimings(info, stream_job, stream_timings, &model);
+      return WriteBackExif(params, has_exif, &exif, output, error);
+    }
+    // The full metadata read found an orientation the header did not show.
+    output->clear();
+    try_stream = false;
+    stage_start = std::chrono::steady_clock::now();
+    decode();
+  } else if (decoded && redecode) {
+    stage_start = std::chrono::steady_clock::now();
+    decode();
+  }
+  if (decoded && params.crop_width > 0 && decode_options.crop_width <= 0) {
+    // The header could not be read, so the whole image was decoded and is
+    // cropped here.
+    fic::ImageInfo decoded_info = info;
+    if (info.width <= 0 || info.height <= 0) {
+      decoded_info.width = image.width;
+      decoded_info.height = image.height;
+    }
+    fic::DecodeOptions crop;
+    if (!StoredCrop(decoded_info, orientation, params, &crop)) {
+      if (error) *error = kCropOutsideError;
+      return false;
+    }
+    image = fic::CropImage(std::move(image), crop.crop_x, crop.crop_y,
+                           crop.crop_width, crop.crop_height);
+  }
+  if (!decoded) {
+    return false;
+  }
+  int decoded_w = info.width > 0 ? info.width : image.width;
+  int decoded_h = info.height > 0 ? info.height : image.height;
+  if (use_thumbnail) {
+    decoded_w = thumbnail_info.width;
+    decoded_h = thumbnail_info.height;
   }
+  if (decode_options.crop_width > 0) {
+    decoded_w = decode_options.crop_width;
+    decoded_h = decode_options.crop_height;
+  }
+  const bool jpeg = detected == fic::ImageFormat::kJpeg;
+  model.Record(fic::CostStage::kDecode, detected,
+               jpeg || decode_options.preview
+                   ? fic::DecodeVariant(decode_options)
+                   : 0,
+               fic::DecodeWorkUnits(detected, decoded_w, decoded_h,
+                                    decode_options),
+               decode_nanos);
 
-  int resize_in_sample = params.in_sample;
-  // JPEG is already decoder-downsampled by in_sample; avoid applying it twice.
-  if (detected == fic::ImageFormat::kJpeg && resize_in_sample > 1) {
-    resize_in_sample = 1;
+  if (orientation > 1 || params.rotate != 0) {
+    stage_start = std::chrono::steady_clock::now();
+    const double pixels = static_cast<double>(image.width) * image.height;
+    if (orientation > 1) {
+      image = fic::OrientImage(std::move(image), orientation);
+    }
+    if (params.rotate != 0) {
+      image = fic::RotateImage(std::move(image), params.rotate);
+    }
+    model.Record(fic::CostStage::kTransform, fic::ImageFormat::kUnknown, 0,
+                 pixels, NanosSince(stage_start));
+  }
+  if (fic::CheckCancelled(cancel, error)) {
+    return false;
   }
 
+  // The target is relative to the full-size (for JPEG, in_sample-size)
+  // image; a DCT-scaled decode is never scaled back up.
   int target_w = image.width;
   int target_h = image.height;
-  fic::CalcTargetSize(image.width, image.height, params.min_width,
-                      params.min_height, resize_in_sample, &target_w,
-                      &target_h);
+  if (info.width > 0 && info.height > 0) {
+    TargetSize(info, orientation, params, &target_w, &target_h);
+  } else {
+    fic::CalcTargetSize(image.width, image.height, params.min_width,
+                        params.min_height, jpeg ? 1 : params.in_sample,
+                        &target_w, &target_h);
+  }
+  target_w = std::min(target_w, image.width);
+  target_h = std::min(target_h, image.height);
   if (target_w != image.width || target_h != image.height) {
-    image = fic::ResizeImageBilinear(image, target_w, target_h);
+    stage_start = std::chrono::steady_clock::now();
+    image = fic::ResizeImage(image, target_w, target_h, resize_filter,
+                             cancel);
+    if (fic::CheckCancelled(cancel, error)) {
+      return false;
+    }
+    model.Record(fic::CostStage::kResize, fic::ImageFormat::kUnknown,
+                 static_cast<int>(resize_filter),
+                 static_cast<double>(target_w) * target_h,
+                 NanosSince(stage_start));
   }
 
   fic::ImageFormat out_format =
       static_cast<fic::ImageFormat>(params.format);
-  if (!fic::EncodeImage(image, out_format, params.quality, output, error)) {
+  stage_start = std::chrono::steady_clock::now();
+  if (!fic::EncodeImage(image, out_format, params.quality, encode_options,
+                        output, cancel, error)) {
+    return false;
+  }
+  model.Record(fic::CostStage::kEncode, out_format,
+               out_format == fic::ImageFormat::kWebp
+                   ? encode_options.webp_method
+                   : 0,
+               static_cast<double>(image.width) * image.height,
+               NanosSince(stage_start));
+  image = fic::ImageBuffer();
+  if (fic::CheckCancelled(cancel, error)) {
     return false;
   }
+  return WriteBackExif(params, has_exif, &exif, output, error);
+}
 
-  if (params.keep_exif && has_exif && !exif.empty()) {
-    if (params.auto_correction || params.rotate != 0) {
-      fic::NormalizeOrientation(&exif);
-    }
-    std::string ext = "jpg";
-    if (out_format == fic::ImageFormat::kPng) {
-      ext = "png";
-    } else if (out_format == fic::ImageFormat::kWebp) {
-      ext = "webp";
-    }
-    std::string temp_path = MakeTempPath(ext);
-    if (temp_path.empty()) {
-      if (error) *error = "Failed to create temp path";
-      return false;
-    }
-    if (!fic::WriteBytesToFile(temp_path, *output, error)) {
-      return false;
-    }
-    if (!fic::ApplyExifToFile(temp_path, exif, error)) {
-      std::remove(temp_path.c_str());
-      return true;
-    }
-    std::vector<uint8_t> final_bytes;
-    if (!fic::ReadFileToBytes(temp_path, &final_bytes, error)) {
-      return false;
-    }
-    std::remove(temp_path.c_str());
-    *output = std::move(final_bytes);
+// Upper bound on the bytes CompressBytes holds at once for an image with
+// header |info| and |input_size| encoded bytes. Each stage keeps its input
+// alive while it allocates its output:
+//   decode      decoded, at the size the decoder scales to
+//   transform   decoded, plus a second frame for a quarter turn or the
+//               bounding box of another angle; flips and half turns run in
+//               place
+//   resize      decoded + resized
+//   encode      resized + an output of at most the same size, copied once
+//               more when EXIF is written back.
+// A streamed image holds a band of decoded rows instead of the stages up to
+// the encode. Pixels take the channels the header says the image decodes
+// to.
+static uint64_t EstimatePeakMemory(const fic::ImageInfo& info,
+                                   uint64_t input_size,
+                                   const CompressParams& params) {
+  if (info.width <= 0 || info.height <= 0) {
+    return input_size;
   }
+  const fic::DecodeOptions decode_options = PickDecodeOptions(info, params);
+  int decoded_w = 0;
+  int decoded_h = 0;
+  fic::DecodedSize(info.format, info.width, info.height, decode_options,
+                   &decoded_w, &decoded_h);
+  const uint64_t decoded = static_cast<uint64_t>(decoded_w) *
+                           static_cast<uint64_t>(decoded_h) * info.channels;
+  int target_w = info.width;
+  int target_h = info.height;
+  TargetSize(info, params.auto_correction ? info.orientation : 1, params,
+             &target_w, &target_h);
+  // RotateImage gives gray and RGB an alpha channel for the corners an
+  // angle other than a right one leaves.
+  int angle = params.rotate % 360;
+  if (angle < 0) angle += 360;
+  const int output_channels =
+      info.channels + (angle % 90 != 0 ? info.channels % 2 : 0);
+  const uint64_t resized = static_cast<uint64_t>(target_w) *
+                           static_cast<uint64_t>(target_h) * output_channels;
 
-  return true;
+  if (CanStream(info, params)) {
+    const uint64_t band =
+        static_cast<uint64_t>(decoded_w) * info.channels * 16;
+    return input_size + band + resized * (params.keep_exif ? 3 : 2);
+  }
+  uint64_t peak = decoded;
+  const int orientation = params.auto_correction ? info.orientation : 1;
+  if (angle % 90 != 0) {
+    fic::ImageInfo decoded_info = info;
+    decoded_info.width = decoded_w;
+    decoded_info.height = decoded_h;
+    CompressParams turn;
+    turn.rotate = angle;
+    int turned_w = 0;
+    int turned_h = 0;
+    OrientedSize(decoded_info, orientation, turn, &turned_w, &turned_h);
+    peak = decoded + static_cast<uint64_t>(turned_w) *
+                         static_cast<uint64_t>(turned_h) * output_channels;
+  } else if ((orientation >= 5 && orientation <= 8) || angle == 90 ||
+             angle == 270) {
+    peak = decoded * 2;
+  }
+  peak = std::max(peak, decoded + resized);
+  peak = std::max(peak, resized * (params.keep_exif ? 3 : 2));
+  return input_size + peak;
+}
+
+// Estimated peak memory of compressing the file at |path|, from its size
+// and header alone.
+static uint64_t EstimateFileJobMemory(const std::string& path,
+                                      const CompressParams& params) {
+  std::error_code ec;
+  uint64_t input_size = std::filesystem::file_size(path, ec);
+  fic::ImageInfo info;
+  fic::ReadImageInfoFromFile(path, &info, nullptr);
+  return EstimatePeakMemory(info, ec ? 0 : input_size, params);
 }
 
 static bool CompressToFile(const std::vector<uint8_t>& input,
                            const std::string& src_path,
-                           const CompressParams& params, std::string* error) {
+                           const CompressParams& params,
+                           const fic::CancelToken* cancel,
+                           std::vector<std::string>* degradations,
+                           std::string* error) {
   std::vector<uint8_t> output;
-  if (!CompressBytes(input, src_path, params, &output, error)) {
+  if (!CompressBytes(input, src_path, params, cancel, &output, degradations,
+                     error)) {
     return false;
   }
   if (!fic::WriteBytesToFile(params.target_path, output, error)) {
@@ -273,11 +981,404 @@ static bool CompressToFile(const std::vector<uint8_t>& input,
   return true;
 }
 
+static CallOutcome Success(flutter::EncodableValue value) {
+  CallOutcome outcome;
+  outcome.ok = true;
+  outcome.value = std::move(value);
+  return outcome;
+}
+
+static CallOutcome Failure(const std::string& code,
+                           const std::string& message) {
+  CallOutcome outcome;
+  outcome.error_code = code;
+  outcome.error_message = message;
+  return outcome;
+}
+
+// |value|, or {result, degradations} for a call made with a deadline.
+static CallOutcome CompressSuccess(
+    flutter::EncodableValue value, const CompressParams& params,
+    const std::vector<std::string>& degradations) {
+  if (params.deadline_ms <= 0) {
+    return Success(std::move(value));
+  }
+  flutter::EncodableList list;
+  for (const std::string& degradation : degradations) {
+    list.emplace_back(degradation);
+  }
+  flutter::EncodableMap map;
+  map[flutter::EncodableValue("result")] = std::move(value);
+  map[flutter::EncodableValue("degradations")] =
+      flutter::EncodableValue(std::move(list));
+  return Success(flutter::EncodableValue(std::move(map)));
+}
+
+// Error code for a failed stage; cancellation wins over |code|.
+static const char* FailureCode(const fic::CancelToken* cancel,
+                               const char* code) {
+  return cancel && cancel->cancelled() ? kCancelledCode : code;
+}
+
+static CallOutcome CompressWithList(const std::vector<uint8_t>& input,
+                                    const CompressParams& params,
+                                    fic::MemoryBudget* budget,
+                                    const fic::CancelToken* cancel) {
+  std::string error;
+  fic::ImageInfo info;
+  fic::ReadImageInfo(input, &info, nullptr);
+  fic::MemoryReservation reservation(
+      budget, EstimatePeakMemory(info, input.size(), params), params.priority,
+      cancel);
+  if (!reservation.admitted()) {
+    return Failure(kCancelledCode, fic::kCancelledError);
+  }
+  std::vector<uint8_t> output;
+  std::vector<std::string> degradations;
+  if (!CompressBytes(input, std::string(), params, cancel, &output, &degradations,
+                     &error)) {
+    return Failure(FailureCode(cancel, "compress_error"), error);
+  }
+  return CompressSuccess(flutter::EncodableValue(std::move(output)), params,
+                         degradations);
+}
+
+static CallOutcome CompressWithFile(const std::string& path,
+                                    const CompressParams& params,
+                                    fic::MemoryBudget* budget,
+                                    const fic::CancelToken* cancel) {
+  std::string error;
+  if (fic::CheckCancelled(cancel, &error)) {
+    return Failure(kCancelledCode, error);
+  }
+  fic::MemoryReservation reservation(
+      budget, EstimateFileJobMemory(path, params), params.priority, cancel);
+  if (!reservation.admitted()) {
+    return Failure(kCancelledCode, fic::kCancelledError);
+  }
+  std::vector<uint8_t> input;
+  if (!fic::ReadFileToBytes(path, &input, &error)) {
+    return Failure("read_error", error);
+  }
+  std::vector<uint8_t> output;
+  std::vector<std::string> degradations;
+  if (!CompressBytes(input, path, params, cancel, &output, &degradations,
+                     &error)) {
+    return Failure(FailureCode(cancel, "compress_error"), error);
+  }
+  return CompressSuccess(flutter::EncodableValue(std::move(output)), params,
+                         degradations);
+}
+
+static bool CompressFileToFile(const std::string& path,
+                               const CompressParams& params,
+                               fic::MemoryBudget* budget,
+                               const fic::CancelToken* cancel,
+                               std::vector<std::string>* degradations,
+                               std::string* error_code, std::string* error) {
+  if (fic::CheckCancelled(cancel, error)) {
+    *error_code = kCancelledCode;
+    return false;
+  }
+  fic::MemoryReservation reservation(
+      budget, EstimateFileJobMemory(path, params), params.priority, cancel);
+  if (!reservation.admitted()) {
+    *error_code = kCancelledCode;
+    fic::CheckCancelled(cancel, error);
+    return false;
+  }
+  std::vector<uint8_t> input;
+  if (!fic::ReadFileToBytes(path, &input, error)) {
+    *error_code = "read_error";
+    return false;
+  }
+  if (!CompressToFile(input, path, params, cancel, degradations, error)) {
+    *error_code = FailureCode(cancel, "compress_error");
+    return false;
+  }
+  return true;
+}
+
+static CallOutcome CompressAndGetFile(const std::string& path,
+                                      const CompressParams& params,
+                                      fic::MemoryBudget* budget,
+                                      const fic::CancelToken* cancel) {
+  std::vector<std::string> degradations;
+  std::string error_code;
+  std::string error;
+  if (!CompressFileToFile(path, params, budget, cancel, &degradations,
+                          &error_code, &error)) {
+    return Failure(error_code, error);
+  }
+  return CompressSuccess(flutter::EncodableValue(params.target_path), params,
+                         degradations);
+}
+
+struct BatchJob {
+  std::string path;
+  CompressParams params;
+  // Carried between the pipeline stages.
+  uint64_t reserved = 0;
+  std::vector<uint8_t> input;
+  std::vector<uint8_t> output;
+  bool ok = false;
+  std::string error_code;
+  std::string error;
+};
+
+// One map per job, in request order: {ok, path[, code, message]}.
+static flutter::EncodableValue BatchResults(const std::vector<BatchJob>& jobs) {
+  flutter::EncodableList results;
+  results.reserve(jobs.size());
+  for (const BatchJob& job : jobs) {
+    flutter::EncodableMap entry;
+    entry[flutter::EncodableValue("ok")] = flutter::EncodableValue(job.ok);
+    entry[flutter::EncodableValue("path")] =
+        flutter::EncodableValue(job.params.target_path);
+    if (!job.ok) {
+      entry[flutter::EncodableValue("code")] =
+          flutter::EncodableValue(job.error_code);
+      entry[flutter::EncodableValue("message")] =
+          flutter::EncodableValue(job.error);
+    }
+    results.emplace_back(std::move(entry));
+  }
+  return flutter::EncodableValue(std::move(results));
+}
+
+// One map per path, in request order: {ok, path, format, width, height,
+// orientation} or {ok, path, code, message}.
+static CallOutcome ProbeFiles(const std::vector<std::string>& paths,
+                              const fic::CancelToken* cancel) {
+  std::vector<fic::ProbedImage> probed;
+  fic::ReadImageInfoFromFiles(paths, cancel, &probed);
+  if (cancel->cancelled()) {
+    return Failure(kCancelledCode, fic::kCancelledError);
+  }
+  flutter::EncodableList results;
+  results.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const fic::ProbedImage& image = probed[i];
+    flutter::EncodableMap entry;
+    entry[flutter::EncodableValue("ok")] = flutter::EncodableValue(image.ok);
+    entry[flutter::EncodableValue("path")] = flutter::EncodableValue(paths[i]);
+    if (image.ok) {
+      entry[flutter::EncodableValue("format")] =
+          flutter::EncodableValue(static_cast<int>(image.info.format));
+      entry[flutter::EncodableValue("width")] =
+          flutter::EncodableValue(image.info.width);
+      entry[flutter::EncodableValue("height")] =
+          flutter::EncodableValue(image.info.height);
+      entry[flutter::EncodableValue("orientation")] =
+          flutter::EncodableValue(image.info.orientation);
+    } else {
+      entry[flutter::EncodableValue("code")] =
+          flutter::EncodableValue("probe_error");
+      entry[flutter::EncodableValue("message")] =
+          flutter::EncodableValue(image.error);
+    }
+    results.emplace_back(std::move(entry));
+  }
+  return Success(flutter::EncodableValue(std::move(results)));
+}
+
+// Everything in |params| that shapes the output.
+static std::string ParamsKey(const CompressParams& params) {
+  return std::to_string(params.min_width) + "x" +
+         std::to_string(params.min_height) + "|q" +
+         std::to_string(params.quality) + "|r" +
+         std::to_string(params.rotate) + "|a" +
+         std::to_string(params.auto_correction) + "|f" +
+         std::to_string(params.format) + "|e" +
+         std::to_string(params.keep_exif) + "|s" +
+         std::to_string(params.in_sample) + "|d" +
+         std::to_string(params.deadline_ms) + "|c" +
+         std::to_string(params.crop_x) + "," + std::to_string(params.crop_y) +
+         "," + std::to_string(params.crop_width) + "," +
+         std::to_string(params.crop_height) + "|p" +
+         std::to_string(params.preview) + "|" + params.target_path;
+}
+
+// Identifies the file by path, size and modification time, so an edited
+// file never joins a run on its old contents. Empty when it cannot be
+// stat'ed.
+static std::string FileKey(const std::string& path,
+                           const CompressParams& params) {
+  std::error_code ec;
+  uint64_t size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return std::string();
+  }
+  auto mtime = std::filesystem::last_write_time(path, ec);
+  if (ec) {
+    return std::string();
+  }
+  return "file|" + path + "|" + std::to_string(size) + "|" +
+         std::to_string(mtime.time_since_epoch().count()) + "|" +
+         ParamsKey(params);
+}
+
+static std::string BytesKey(const std::vector<uint8_t>& input,
+                            const CompressParams& params) {
+  return "bytes|" + std::to_string(input.size()) + "|" +
+         std::to_string(fic::HashBytes(input.data(), input.size())) + "|" +
+         ParamsKey(params);
+}
+
+// Reads the pipeline queue bounds, {readAhead, writeBehind}, from the batch
+// options map.
+static void ParsePipelineDepths(const flutter::EncodableList& args,
+                                fic::PipelineDepths* depths) {
+  if (args.empty() ||
+      !std::holds_alternative<flutter::EncodableMap>(args.back())) {
+    return;
+  }
+  const auto& options = std::get<flutter::EncodableMap>(args.back());
+  int value = 0;
+  auto read_ahead = options.find(flutter::EncodableValue("readAhead"));
+  if (read_ahead != options.end() && GetInt(read_ahead->second, &value) &&
+      value > 0) {
+    depths->read_ahead = static_cast<size_t>(value);
+  }
+  auto write_behind = options.find(flutter::EncodableValue("writeBehind"));
+  if (write_behind != options.end() && GetInt(write_behind->second, &value) &&
+      value > 0) {
+    depths->write_behind = static_cast<size_t>(value);
+  }
+}
+
 }  // namespace
 
-ImageCompressPlusWindowsPlugin::ImageCompressPlusWindowsPlugin() {}
+ImageCompressPlusWindowsPlugin::ImageCompressPlusWindowsPlugin()
+    : jobs_(std::make_unique<fic::JobRegistry>()),
+      budget_(std::make_unique<fic::MemoryBudget>(fic::DefaultMemoryBudget())),
+      flights_(std::make_unique<fic::SingleFlight<SharedOutcome>>()),
+      pool_(std::make_unique<fic::WorkerPool>(fic::DefaultWorkerCount())),
+      batches_(std::make_unique<fic::BatchPipeline>(pool_.get())) {
+  HINSTANCE instance = GetModuleHandleW(nullptr);
+  WNDCLASSEXW window_class = {};
+  window_class.cbSize = sizeof(window_class);
+  window_class.lpfnWndProc = PlatformTaskWindowProc;
+  window_class.hInstance = instance;
+  window_class.lpszClassName = kTaskWindowClassName;
+  // Fails harmlessly when another plugin instance already registered it.
+  RegisterClassExW(&window_class);
+  task_window_ = CreateWindowExW(0, kTaskWindowClassName, L"", 0, 0, 0, 0, 0,
+                                 HWND_MESSAGE, nullptr, instance, nullptr);
+  SetWindowLongPtrW(task_window_, GWLP_USERDATA,
+                    reinterpret_cast<LONG_PTR>(this));
+}
+
+ImageCompressPlusWindowsPlugin::~ImageCompressPlusWindowsPlugin() {
+  // Finishing the batches and joining the pool first guarantees no worker
+  // posts to a dead window.
+  stopping_ = true;
+  batches_.reset();
+  pool_.reset();
+  if (task_window_) {
+    SetWindowLongPtrW(task_window_, GWLP_USERDATA, 0);
+    DestroyWindow(task_window_);
+  }
+}
+
+LRESULT CALLBACK ImageCompressPlusWindowsPlugin::PlatformTaskWindowProc(
+    HWND hwnd, UINT message, WPARAM wparam, LPARAM lparam) {
+  if (message == kRunPlatformTasksMessage) {
+    auto* plugin = reinterpret_cast<ImageCompressPlusWindowsPlugin*>(
+        GetWindowLongPtrW(hwnd, GWLP_USERDATA));
+    if (plugin) {
+      plugin->RunPlatformTasks();
+    }
+    return 0;
+  }
+  return DefWindowProcW(hwnd, message, wparam, lparam);
+}
+
+void ImageCompressPlusWindowsPlugin::PostToPlatformThread(
+    std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(platform_tasks_mutex_);
+    platform_tasks_.push_back(std::move(task));
+  }
+  PostMessageW(task_window_, kRunPlatformTasksMessage, 0, 0);
+}
+
+void ImageCompressPlusWindowsPlugin::RunPlatformTasks() {
+  std::vector<std::function<void()>> tasks;
+  {
+    std::lock_guard<std::mutex> lock(platform_tasks_mutex_);
+    tasks.swap(platform_tasks_);
+  }
+  for (auto& task : tasks) {
+    task();
+  }
+}
+
+// A call queued by RunInBackground().
+struct ImageCompressPlusWindowsPlugin::BackgroundCall {
+  std::shared_ptr<flutter::MethodResult<flutter::EncodableValue>> result;
+  std::string job_id;
+  fic::Priority priority;
+  std::shared_ptr<fic::CancelToken> cancel;
+  std::function<std::string()> key;
+  std::function<CallOutcome(const fic::CancelToken*)> work;
+};
+
+void ImageCompressPlusWindowsPlugin::RunInBackground(
+    std::unique_ptr<flutter::MethodResult<flutter::EncodableValue>> result,
+    const std::string& job_id, fic::Priority priority,
+    std::function<std::string()> key,
+    std::function<CallOutcome(const fic::CancelToken*)> work) {
+  auto call = std::make_shared<BackgroundCall>();
+  call->result = std::move(result);
+  call->job_id = job_id;
+  call->priority = priority;
+  call->cancel = jobs_->Acquire(job_id);
+  call->key = std::move(key);
+  call->work = std::move(work);
+  pool_->Submit(priority, [this, call]() { RunCall(call); });
+}
+
+void ImageCompressPlusWindowsPlugin::RunCall(
+    const std::shared_ptr<BackgroundCall>& call) {
+  std::string key = call->key ? call->key() : std::string();
+  if (key.empty()) {
+    FinishCall(call, std::make_shared<const CallOutcome>(
+                         call->work(call->cancel.get())));
+    return;
+  }
+  if (!flights_->Join(key, [this, call](const SharedOutcome& outcome) {
+        FinishCall(call, outcome);
+      })) {
+    return;
+  }
+  flights_->Complete(key, std::make_shared<const CallOutcome>(
+                              call->work(call->cancel.get())));
+}
 
-ImageCompressPlusWindowsPlugin::~ImageCompressPlusWindowsPlugin() {}
+// Answers |call| with |outcome|, which may be shared with other calls.
+void ImageCompressPlusWindowsPlugin::FinishCall(
+    const std::shared_ptr<BackgroundCall>& call, const SharedOutcome& outcome) {
+  SharedOutcome answer = outcome;
+  if (call->cancel->cancelled()) {
+    answer = std::make_shared<const CallOutcome>(
+        Failure(kCancelledCode, fic::kCancelledError));
+  } else if (!outcome->ok && outcome->error_code == kCancelledCode &&
+             !stopping_) {
+    // The shared run was cancelled by another caller; run again for this
+    // one, unless the pool is going away, which leaves it cancelled too.
+    pool_->Submit(call->priority, [this, call]() { RunCall(call); });
+    return;
+  }
+  jobs_->Release(call->job_id);
+  PostToPlatformThread([result = call->result, answer]() {
+    if (answer->ok) {
+      result->Success(answer->value);
+    } else {
+      result->Error(answer->error_code, answer->error_message);
+    }
+  });
+}
 
 void ImageCompressPlusWindowsPlugin::RegisterWithRegistrar(
     flutter::PluginRegistrarWindows* registrar) {
@@ -285,6 +1386,7 @@ void ImageCompressPlusWindowsPlugin::RegisterWithRegistrar(
       registrar->messenger(), kChannelName,
       &flutter::StandardMethodCodec::GetInstance());
 
+  fic::InitExifLibrary();
   auto plugin = std::make_unique<ImageCompressPlusWindowsPlugin>();
 
   channel->SetMethodCallHandler(
@@ -316,12 +1418,16 @@ void ImageCompressPlusWindowsPlugin::HandleMethodCall(
       result->Error("bad_args", error);
       return;
     }
-    std::vector<uint8_t> output;
-    if (!CompressBytes(input, std::string(), params, &output, &error)) {
-      result->Error("compress_error", error);
-      return;
-    }
-    result->Success(flutter::EncodableValue(output));
+    ParseOptions(args, &params);
+    auto shared_input =
+        std::make_shared<const std::vector<uint8_t>>(std::move(input));
+    RunInBackground(
+        std::move(result), params.job_id, params.priority,
+        [shared_input, params]() { return BytesKey(*shared_input, params); },
+        [this, shared_input, params](const fic::CancelToken* cancel) {
+          return CompressWithList(*shared_input, params, budget_.get(),
+                                  cancel);
+        });
     return;
   }
 
@@ -338,17 +1444,13 @@ void ImageCompressPlusWindowsPlugin::HandleMethodCall(
       result->Error("bad_args", error);
       return;
     }
-    std::vector<uint8_t> input;
-    if (!fic::ReadFileToBytes(path, &input, &error)) {
-      result->Error("read_error", error);
-      return;
-    }
-    std::vector<uint8_t> output;
-    if (!CompressBytes(input, path, params, &output, &error)) {
-      result->Error("compress_error", error);
-      return;
-    }
-    result->Success(flutter::EncodableValue(output));
+    ParseOptions(args, &params);
+    RunInBackground(
+        std::move(result), params.job_id, params.priority,
+        [path, params]() { return FileKey(path, params); },
+        [this, path, params](const fic::CancelToken* cancel) {
+          return CompressWithFile(path, params, budget_.get(), cancel);
+        });
     return;
   }
 
@@ -365,16 +1467,216 @@ void ImageCompressPlusWindowsPlugin::HandleMethodCall(
       result->Error("bad_args", error);
       return;
     }
-    std::vector<uint8_t> input;
-    if (!fic::ReadFileToBytes(path, &input, &error)) {
-      result->Error("read_error", error);
+    ParseOptions(args, &params);
+    RunInBackground(
+        std::move(result), params.job_id, params.priority,
+        [path, params]() { return FileKey(path, params); },
+        [this, path, params](const fic::CancelToken* cancel) {
+          return CompressAndGetFile(path, params, budget_.get(), cancel);
+        });
+    return;
+  }
+
+  if (method == "compressBatch") {
+    // Arguments: [jobs, maxParallel, options], where every job is a
+    // compressAndGetFile argument list and the options apply to every job.
+    if (!args_ptr || !std::holds_alternative<flutter::EncodableList>(*args_ptr)) {
+      result->Error("bad_args", "Invalid arguments");
       return;
     }
-    if (!CompressToFile(input, path, params, &error)) {
-      result->Error("compress_error", error);
+    const auto& args = std::get<flutter::EncodableList>(*args_ptr);
+    if (args.empty() || !std::holds_alternative<flutter::EncodableList>(args[0])) {
+      result->Error("bad_args", "Invalid arguments");
       return;
     }
-    result->Success(flutter::EncodableValue(params.target_path));
+    const auto& job_args = std::get<flutter::EncodableList>(args[0]);
+    int max_parallel = 0;
+    if (args.size() > 1) {
+      GetInt(args[1], &max_parallel);
+    }
+    auto jobs = std::make_shared<std::vector<BatchJob>>(job_args.size());
+    for (size_t i = 0; i < job_args.size(); ++i) {
+      BatchJob& job = (*jobs)[i];
+      std::string error = "Invalid arguments";
+      if (!std::holds_alternative<flutter::EncodableList>(job_args[i]) ||
+          !ParseFileArgs(std::get<flutter::EncodableList>(job_args[i]),
+                         &job.path, &job.params, &error, true)) {
+        result->Error("bad_args", "Job " + std::to_string(i) + ": " + error);
+        return;
+      }
+    }
+    CompressParams options;
+    ParseOptions(args, &options);
+    std::shared_ptr<fic::CancelToken> cancel = jobs_->Acquire(options.job_id);
+    std::string job_id = options.job_id;
+    std::shared_ptr<flutter::MethodResult<flutter::EncodableValue>>
+        shared_result = std::move(result);
+    fic::PipelineDepths depths;
+    ParsePipelineDepths(args, &depths);
+
+    // Files are read and written on the pipeline's own threads while the
+    // pool compresses, so disk and CPU stay busy together.
+    fic::BatchStages stages;
+    stages.cost = [jobs](size_t i) -> uint64_t {
+      std::error_code ec;
+      uint64_t size = std::filesystem::file_size((*jobs)[i].path, ec);
+      return ec ? 0 : size;
+    };
+    stages.read = [jobs, cancel](size_t i) {
+      BatchJob& job = (*jobs)[i];
+      if (fic::CheckCancelled(cancel.get(), &job.error)) {
+        job.error_code = kCancelledCode;
+        return false;
+      }
+      if (!fic::ReadFileToBytes(job.path, &job.input, &job.error)) {
+        job.error_code = "read_error";
+        return false;
+      }
+      return true;
+    };
+    // The budget is reserved on the pool slot, like a single call's: a job
+    // that holds memory while it waits for a slot could wait on the calls
+    // that fill every slot waiting for that memory.
+    stages.process = [this, jobs, cancel](size_t i) {
+      BatchJob& job = (*jobs)[i];
+      fic::ImageInfo info;
+      fic::ReadImageInfo(job.input, &info, nullptr);
+      uint64_t bytes = EstimatePeakMemory(info, job.input.size(), job.params);
+      if (!budget_->Acquire(bytes, job.params.priority, cancel.get())) {
+        job.error_code = kCancelledCode;
+        fic::CheckCancelled(cancel.get(), &job.error);
+        return false;
+      }
+      job.reserved = bytes;
+      if (!CompressBytes(job.input, job.path, job.params, cancel.get(),
+                         &job.output, nullptr, &job.error)) {
+        job.error_code = FailureCode(cancel.get(), "compress_error");
+        return false;
+      }
+      return true;
+    };
+    stages.write = [jobs](size_t i) {
+      BatchJob& job = (*jobs)[i];
+      job.ok = fic::WriteBytesToFile(job.params.target_path, job.output,
+                                     &job.error);
+      if (!job.ok) {
+        job.error_code = "compress_error";
+      }
+    };
+    stages.finish = [this, jobs](size_t i) {
+      BatchJob& job = (*jobs)[i];
+      std::vector<uint8_t>().swap(job.input);
+      std::vector<uint8_t>().swap(job.output);
+      budget_->Release(job.reserved);
+      job.reserved = 0;
+    };
+    stages.on_done = [this, jobs, job_id, shared_result]() {
+      jobs_->Release(job_id);
+      auto value = std::make_shared<flutter::EncodableValue>(
+          BatchResults(*jobs));
+      PostToPlatformThread(
+          [shared_result, value]() { shared_result->Success(*value); });
+    };
+    batches_->Run(options.priority, jobs->size(),
+                  static_cast<size_t>(std::max(0, max_parallel)), depths,
+                  std::move(stages));
+    return;
+  }
+
+  if (method == "probe") {
+    // Arguments: [paths, options]. Reads only the header of every file, a
+    // few KB each, for its format, size and EXIF orientation.
+    if (!args_ptr || !std::holds_alternative<flutter::EncodableList>(*args_ptr)) {
+      result->Error("bad_args", "Invalid arguments");
+      return;
+    }
+    const auto& args = std::get<flutter::EncodableList>(*args_ptr);
+    if (args.empty() || !std::holds_alternative<flutter::EncodableList>(args[0])) {
+      result->Error("bad_args", "Invalid arguments");
+      return;
+    }
+    const auto& path_args = std::get<flutter::EncodableList>(args[0]);
+    std::vector<std::string> paths(path_args.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (!GetString(path_args[i], &paths[i])) {
+        result->Error("bad_args",
+                      "Path " + std::to_string(i) + " is not a string");
+        return;
+      }
+    }
+    CompressParams params;
+    ParseOptions(args, &params);
+    RunInBackground(std::move(result), params.job_id, params.priority, nullptr,
+                    [paths](const fic::CancelToken* cancel) {
+                      return ProbeFiles(paths, cancel);
+                    });
+    return;
+  }
+
+  if (method == "getPipelineStats") {
+    // Responds with the number of batch jobs in each pipeline stage, summed
+    // over all running batches.
+    fic::PipelineStats stats = batches_->stats();
+    flutter::EncodableMap value;
+    value[flutter::EncodableValue("reading")] =
+        flutter::EncodableValue(static_cast<int64_t>(stats.reading));
+    value[flutter::EncodableValue("readQueue")] =
+        flutter::EncodableValue(static_cast<int64_t>(stats.read_queue));
+    value[flutter::EncodableValue("processing")] =
+        flutter::EncodableValue(static_cast<int64_t>(stats.processing));
+    value[flutter::EncodableValue("writeQueue")] =
+        flutter::EncodableValue(static_cast<int64_t>(stats.write_queue));
+    result->Success(flutter::EncodableValue(std::move(value)));
+    return;
+  }
+
+  if (method == "cancel") {
+    // Argument: the jobId given to the jobs to stop. Responds with whether
+    // any queued or running job had that id.
+    std::string job_id;
+    if (!args_ptr || !GetString(*args_ptr, &job_id)) {
+      result->Error("bad_args", "Invalid arguments");
+      return;
+    }
+    result->Success(flutter::EncodableValue(jobs_->Cancel(job_id)));
+    return;
+  }
+
+  if (method == "setBackgroundShare") {
+    double share = 0;
+    if (!args_ptr || !GetDouble(*args_ptr, &share)) {
+      result->Error("bad_args", "Invalid arguments");
+      return;
+    }
+    pool_->SetBackgroundShare(share);
+    result->Success();
+    return;
+  }
+
+  if (method == "setMemoryBudget") {
+    // Argument: the byte budget shared by all in-flight jobs; values <= 0
+    // restore the default of half the physical memory.
+    int64_t bytes = 0;
+    if (!args_ptr || !GetInt64(*args_ptr, &bytes)) {
+      result->Error("bad_args", "Invalid arguments");
+      return;
+    }
+    budget_->SetLimit(bytes > 0 ? static_cast<uint64_t>(bytes)
+                                : fic::DefaultMemoryBudget());
+    result->Success();
+    return;
+  }
+
+  if (method == "setMaxConcurrency") {
+    int max_concurrency = 0;
+    if (!args_ptr || !GetInt(*args_ptr, &max_concurrency)) {
+      result->Error("bad_args", "Invalid arguments");
+      return;
+    }
+    pool_->SetMaxConcurrency(max_concurrency > 0
+                                 ? static_cast<size_t>(max_concurrency)
+                                 : fic::DefaultWorkerCount());
+    result->Success();
     return;
   }
 
@@ -3,8 +3,25 @@
 
 #include <flutter/method_channel.h>
 #include <flutter/plugin_registrar_windows.h>
+#include <windows.h>
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fic {
+class BatchPipeline;
+class CancelToken;
+class JobRegistry;
+class MemoryBudget;
+class WorkerPool;
+enum class Priority;
+template <typename Result>
+class SingleFlight;
+}  // namespace fic
 
 namespace image_compress_plus_windows {
 
@@ -19,10 +36,56 @@ class ImageCompressPlusWindowsPlugin : public flutter::Plugin {
   ImageCompressPlusWindowsPlugin(const ImageCompressPlusWindowsPlugin&) = delete;
   ImageCompressPlusWindowsPlugin& operator=(const ImageCompressPlusWindowsPlugin&) = delete;
 
+  // Result of a job, produced on a worker and replayed on the platform thread.
+  struct CallOutcome {
+    bool ok = false;
+    flutter::EncodableValue value;
+    std::string error_code;
+    std::string error_message;
+  };
+
  private:
+  static LRESULT CALLBACK PlatformTaskWindowProc(HWND hwnd, UINT message,
+                                                 WPARAM wparam, LPARAM lparam);
+
   void HandleMethodCall(
       const flutter::MethodCall<flutter::EncodableValue>& method_call,
       std::unique_ptr<flutter::MethodResult<flutter::EncodableValue>> result);
+
+  struct BackgroundCall;
+  using SharedOutcome = std::shared_ptr<const CallOutcome>;
+
+  // Runs |work| on the worker pool's |priority| lane and completes |result|
+  // with its outcome on the platform thread. |job_id| is registered right
+  // away so that `cancel` also reaches jobs still waiting in the queue.
+  // Calls whose |key|, computed on the worker, matches a call still running
+  // attach to it and get its outcome instead of running |work| again; an
+  // empty key opts out.
+  void RunInBackground(
+      std::unique_ptr<flutter::MethodResult<flutter::EncodableValue>> result,
+      const std::string& job_id, fic::Priority priority,
+      std::function<std::string()> key,
+      std::function<CallOutcome(const fic::CancelToken*)> work);
+  void RunCall(const std::shared_ptr<BackgroundCall>& call);
+  void FinishCall(const std::shared_ptr<BackgroundCall>& call,
+                  const SharedOutcome& outcome);
+
+  void PostToPlatformThread(std::function<void()> task);
+  void RunPlatformTasks();
+
+  // Message-only window owned by the platform thread; workers post to it to
+  // get back onto that thread.
+  HWND task_window_ = nullptr;
+  std::mutex platform_tasks_mutex_;
+  std::vector<std::function<void()>> platform_tasks_;
+  std::unique_ptr<fic::JobRegistry> jobs_;
+  std::unique_ptr<fic::MemoryBudget> budget_;
+  std::unique_ptr<fic::SingleFlight<SharedOutcome>> flights_;
+  std::unique_ptr<fic::WorkerPool> pool_;
+  std::unique_ptr<fic::BatchPipeline> batches_;
+  // Set once the destructor starts tearing the pool down; calls then finish
+  // instead of going back to it.
+  std::atomic<bool> stopping_{false};
 };
 
 }  // namespace image_compress_plus_windows